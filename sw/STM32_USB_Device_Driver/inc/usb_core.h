@@ -420,6 +420,16 @@ register uint16_t _wRegVal;       \
 #define _GetEPDblBuf0Count(bEpNum) (_GetEPTxCount(bEpNum))
 #define _GetEPDblBuf1Count(bEpNum) (_GetEPRxCount(bEpNum))
 
+/* Byte stream into a PMA buffer: the PMA is written by halfwords only, an odd
+   byte waits in "odd" for its partner */
+typedef struct
+{
+  __IO uint16_t *pdwVal;
+  uint16_t       odd;
+  uint16_t       has_odd;
+}
+PMA_Stream;
+
 /* Exported variables --------------------------------------------------------*/
 extern __IO uint16_t wIstr;  /* ISTR register last read value */
 
@@ -489,6 +499,9 @@ uint16_t ByteSwap(uint16_t);
 void SetDeviceAddress(uint8_t);
 void UserToPMABufferCopy(uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes);
 void PMAToUserBufferCopy(uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes);
+void PMA_StreamInit(PMA_Stream *pStream, uint16_t wPMABufAddr);
+void PMA_StreamWrite(PMA_Stream *pStream, const uint8_t *pbUsrBuf, uint16_t wNBytes);
+void PMA_StreamFlush(PMA_Stream *pStream);
 
 #endif /* __USB_CORE_H__ */
 
@@ -75,6 +75,7 @@ typedef struct USB_ep
   uint16_t       pmaaddr0;
   uint16_t       pmaaddr1;
   uint8_t        doublebuffer;      
+  uint8_t        pending;           /* packets queued on a double buffered IN endpoint */
   uint32_t       maxpacket;
   /* transaction level variables !!! up to one max packet per transaction !!! */
   uint8_t        *xfer_buff;
@@ -207,6 +208,11 @@ uint32_t    DCD_EP_Tx (USB_CORE_HANDLE *pdev,
                                uint8_t  ep_addr,
                                uint8_t  *pbuf,
                                uint32_t   buf_len);
+uint16_t    DCD_EP_TxBuffer (USB_CORE_HANDLE *pdev,
+                               uint8_t  ep_addr);
+uint32_t    DCD_EP_TxPMA (USB_CORE_HANDLE *pdev,
+                               uint8_t  ep_addr,
+                               uint32_t   len);
 uint32_t    DCD_EP_Stall (USB_CORE_HANDLE *pdev,
                               uint8_t   epnum);
 uint32_t    DCD_EP_ClrStall (USB_CORE_HANDLE *pdev,
@@ -674,23 +674,40 @@ void FreeUserBuffer(uint8_t bEpNum, uint8_t bDir)
 void UserToPMABufferCopy(uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
 {
   uint32_t n = (wNBytes + 1) >> 1; 
-  uint32_t i;
-  uint16_t temp1, temp2;
-  uint16_t *pdwVal;
-  pdwVal = (uint16_t *)(wPMABufAddr + PMAAddr);
+  __IO uint16_t *pdwVal;
+  pdwVal = (__IO uint16_t *)(wPMABufAddr + PMAAddr);
   
-  for (i = n; i != 0; i--)
+  if (((uint32_t)pbUsrBuf & 1) == 0)
   {
-    temp1 = (uint16_t) * pbUsrBuf;
-    pbUsrBuf++;
-    temp2 = temp1 | (uint16_t) * pbUsrBuf << 8;
-    *pdwVal++ = temp2;
-    pbUsrBuf++;
+    /* Aligned source: PMA is little-endian as the core, move whole halfwords 
+       (a trailing odd byte takes its neighbour along, PMA ignores it) */
+    const uint16_t *pSrc = (const uint16_t *)pbUsrBuf;
+    for (; n >= 4; n -= 4)
+    {
+      pdwVal[0] = pSrc[0];
+      pdwVal[1] = pSrc[1];
+      pdwVal[2] = pSrc[2];
+      pdwVal[3] = pSrc[3];
+      pdwVal += 4;
+      pSrc += 4;
+    }
+    for (; n != 0; n--)
+    {
+      *pdwVal++ = *pSrc++;
+    }
+  }
+  else
+  {
+    for (; n != 0; n--)
+    {
+      *pdwVal++ = (uint16_t)pbUsrBuf[0] | ((uint16_t)pbUsrBuf[1] << 8);
+      pbUsrBuf += 2;
+    }
   }
 }
 
 /**
-  * @brief Copy a buffer from user memory area to packet memory area (PMA)
+  * @brief Copy a buffer from packet memory area (PMA) to user memory area
   * @param   pbUsrBuf    = pointer to user memory area.
   * @param   wPMABufAddr: address into PMA.
   * @param   wNBytes: no. of bytes to be copied.
@@ -698,14 +715,112 @@ void UserToPMABufferCopy(uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNByt
   */
 void PMAToUserBufferCopy(uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
 {
-  uint32_t n = (wNBytes + 1) >> 1;
-  uint32_t i;
-  uint16_t *pdwVal;
-  pdwVal = (uint16_t *)(wPMABufAddr + PMAAddr);
-  for (i = n; i != 0; i--)
+  uint32_t n = wNBytes >> 1;
+  __IO uint16_t *pdwVal;
+  uint16_t temp;
+  pdwVal = (__IO uint16_t *)(wPMABufAddr + PMAAddr);
+
+  if (((uint32_t)pbUsrBuf & 1) == 0)
+  {
+    uint16_t *pDst = (uint16_t *)pbUsrBuf;
+    for (; n >= 4; n -= 4)
+    {
+      pDst[0] = pdwVal[0];
+      pDst[1] = pdwVal[1];
+      pDst[2] = pdwVal[2];
+      pDst[3] = pdwVal[3];
+      pdwVal += 4;
+      pDst += 4;
+    }
+    for (; n != 0; n--)
+    {
+      *pDst++ = *pdwVal++;
+    }
+    pbUsrBuf = (uint8_t *)pDst;
+  }
+  else
+  {
+    for (; n != 0; n--)
+    {
+      temp = *pdwVal++;
+      pbUsrBuf[0] = (uint8_t)temp;
+      pbUsrBuf[1] = (uint8_t)(temp >> 8);
+      pbUsrBuf += 2;
+    }
+  }
+
+  /* Odd count: store only the last byte, the user buffer may end here */
+  if (wNBytes & 1)
+  {
+    *pbUsrBuf = (uint8_t)*pdwVal;
+  }
+}
+
+/**
+  * @brief Start writing a byte stream into a PMA buffer
+  * @param   pStream: stream state.
+  * @param   wPMABufAddr: address into PMA, halfword aligned.
+  * @retval None
+  */
+void PMA_StreamInit(PMA_Stream *pStream, uint16_t wPMABufAddr)
+{
+  pStream->pdwVal = (__IO uint16_t *)(wPMABufAddr + PMAAddr);
+  pStream->has_odd = 0;
+}
+
+/**
+  * @brief Append bytes to a PMA stream
+  * @param   pStream: stream state.
+  * @param   pbUsrBuf: bytes to be written, any alignment.
+  * @param   wNBytes: no. of bytes to be written.
+  * @retval None
+  */
+void PMA_StreamWrite(PMA_Stream *pStream, const uint8_t *pbUsrBuf, uint16_t wNBytes)
+{
+  __IO uint16_t *pdwVal = pStream->pdwVal;
+
+  if (wNBytes == 0)
+  {
+    return;
+  }
+  if (pStream->has_odd)
+  {
+    *pdwVal++ = pStream->odd | ((uint16_t)*pbUsrBuf++ << 8);
+    wNBytes--;
+    pStream->has_odd = 0;
+  }
+  for (; wNBytes >= 4; wNBytes -= 4)
+  {
+    pdwVal[0] = (uint16_t)pbUsrBuf[0] | ((uint16_t)pbUsrBuf[1] << 8);
+    pdwVal[1] = (uint16_t)pbUsrBuf[2] | ((uint16_t)pbUsrBuf[3] << 8);
+    pdwVal += 2;
+    pbUsrBuf += 4;
+  }
+  if (wNBytes >= 2)
+  {
+    *pdwVal++ = (uint16_t)pbUsrBuf[0] | ((uint16_t)pbUsrBuf[1] << 8);
+    pbUsrBuf += 2;
+    wNBytes -= 2;
+  }
+  if (wNBytes)
+  {
+    pStream->odd = *pbUsrBuf;
+    pStream->has_odd = 1;
+  }
+  pStream->pdwVal = pdwVal;
+}
+
+/**
+  * @brief Write out the byte still waiting in a PMA stream
+  * @param   pStream: stream state.
+  * @retval None
+  */
+void PMA_StreamFlush(PMA_Stream *pStream)
+{
+  if (pStream->has_odd)
   {
-    *(uint16_t*)pbUsrBuf++ = *pdwVal++;
-    pbUsrBuf++;
+    *pStream->pdwVal++ = pStream->odd;
+    pStream->has_odd = 0;
   }
 }
 
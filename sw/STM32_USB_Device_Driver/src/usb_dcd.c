@@ -248,11 +248,16 @@ uint32_t DCD_EP_Open(USB_CORE_HANDLE *pdev ,
     
     if (ep->is_in==0)
     {
+      /* Both buffers take a whole packet, PrepareRx leaves the counters 
+         alone as the USB may be filling one of them */
+      SetEPDblBuffCount(ep->num, EP_DBUF_OUT, ep->maxpacket);
+
       /* Clear the data toggle bits for the endpoint IN/OUT*/
       ClearDTOG_RX(ep->num);
       ClearDTOG_TX(ep->num);
       
-      /* Reset value of the data toggle bits for the endpoint out*/
+      /* Reset value of the data toggle bits for the endpoint out:
+         USB fills buffer 0 first (DTOG_RX), SW_BUF points to the other one */
       ToggleDTOG_TX(ep->num);
       
       SetEPRxStatus(ep->num, EP_RX_VALID);
@@ -260,10 +265,12 @@ uint32_t DCD_EP_Open(USB_CORE_HANDLE *pdev ,
     }
     else
     {
-      /* Clear the data toggle bits for the endpoint IN/OUT*/
+      /* Clear the data toggle bits for the endpoint IN/OUT: with 
+         DTOG_TX == SW_BUF both buffers belong to the application and the
+         endpoint NAKs until DCD_EP_Tx hands one over */
       ClearDTOG_RX(ep->num);
       ClearDTOG_TX(ep->num);
-      ToggleDTOG_RX(ep->num);
+      ep->pending = 0;
       /* Configure DISABLE status for the Endpoint*/
       SetEPTxStatus(ep->num, EP_TX_DIS);
       SetEPRxStatus(ep->num, EP_RX_DIS);
@@ -325,7 +332,7 @@ uint32_t DCD_EP_Close(USB_CORE_HANDLE *pdev , uint8_t  ep_addr)
       /* Clear the data toggle bits for the endpoint IN/OUT*/
       ClearDTOG_RX(ep->num);
       ClearDTOG_TX(ep->num);
-      ToggleDTOG_RX(ep->num);
+      ep->pending = 0;
       /* Configure DISABLE status for the Endpoint*/
       SetEPTxStatus(ep->num, EP_TX_DIS);
       SetEPRxStatus(ep->num, EP_RX_DIS);
@@ -376,11 +383,7 @@ uint32_t DCD_EP_PrepareRx( USB_CORE_HANDLE *pdev,
     /*Set RX buffer count*/
     SetEPRxCount(ep->num, len);
   }
-  else
-  {
-    /*Set the Double buffer counter*/
-    SetEPDblBuffCount(ep->num, ep->is_in, len);
-  } 
+  /* Double buffer counters are set once in DCD_EP_Open */
   
   SetEPRxStatus(ep->num, EP_RX_VALID);
   
@@ -393,6 +396,7 @@ uint32_t DCD_EP_PrepareRx( USB_CORE_HANDLE *pdev,
   * @param  ep_addr: endpoint address
   * @param  pbuf: pointer to Tx buffer
   * @param  buf_len: data length
+  * @note   double buffered endpoints take one packet per call
   * @retval : status
   */
 uint32_t  DCD_EP_Tx ( USB_CORE_HANDLE *pdev,
@@ -405,47 +409,85 @@ uint32_t  DCD_EP_Tx ( USB_CORE_HANDLE *pdev,
   
   ep = &pdev->dev.in_ep[ep_addr & 0x7F];
   
-  /*setup and start the Xfer */
-  ep->num = ep_addr & 0x7F; 
-  ep->xfer_buff = pbuf;  
-  ep->xfer_len = buf_len;
-  ep->xfer_count = 0; 
-  
   /*Multi packet transfer*/
-  if (ep->xfer_len > ep->maxpacket)
+  if (buf_len > ep->maxpacket)
   {
-    len=ep->maxpacket;
-    ep->xfer_len-=len; 
+    len = ep->maxpacket;
   }
   else
   {
-    len=ep->xfer_len;
-    ep->xfer_len =0;
+    len = buf_len;
   }
   
+  UserToPMABufferCopy(pbuf, DCD_EP_TxBuffer(pdev, ep_addr), len);
+  DCD_EP_TxPMA(pdev, ep_addr, len);
+
+  /*setup the rest of the Xfer */
+  ep->xfer_buff = pbuf;  
+  ep->xfer_len = (ep->doublebuffer == 0) ? (buf_len - len) : 0;
+  
+  return USB_OK; 
+}
+
+/**
+  * @brief Get the PMA buffer the next IN packet goes into: the one owned by 
+  *        the application (SW_BUF) for a double buffered endpoint
+  * @param  pdev: device instance
+  * @param  ep_addr: endpoint address
+  * @retval : PMA address
+  */
+uint16_t  DCD_EP_TxBuffer (USB_CORE_HANDLE *pdev, uint8_t ep_addr)
+{
+  USB_EP *ep;
+  
+  ep = &pdev->dev.in_ep[ep_addr & 0x7F];
+
+  if (ep->doublebuffer == 0) 
+  {
+    return ep->pmaadress;
+  }
+  return (GetENDPOINT(ep->num)&EP_DTOG_RX) ? ep->pmaaddr1 : ep->pmaaddr0;
+}
+
+/**
+  * @brief Transmit the packet already written into DCD_EP_TxBuffer
+  * @param  pdev: device instance
+  * @param  ep_addr: endpoint address
+  * @param  len: packet length, not more than max packet size
+  * @retval : status
+  */
+uint32_t  DCD_EP_TxPMA (USB_CORE_HANDLE *pdev, uint8_t ep_addr, uint32_t len)
+{
+  USB_EP *ep;
+  
+  ep = &pdev->dev.in_ep[ep_addr & 0x7F];
+  
+  /*setup and start the Xfer */
+  ep->num = ep_addr & 0x7F; 
+  ep->xfer_buff = 0;  
+  ep->xfer_len = 0;
+  ep->xfer_count = 0; 
+  
   /* configure and validate Tx endpoint */
   if (ep->doublebuffer == 0) 
   {
-    UserToPMABufferCopy(ep->xfer_buff, ep->pmaadress, len);
     SetEPTxCount(ep->num, len);
   }
   else
   {
-    uint16_t pmabuffer=0;
-    /*Set the Double buffer counter*/
-    SetEPDblBuffCount(ep->num, ep->is_in, len);
-    
-    /*Write the data to the USB endpoint*/
-    if (GetENDPOINT(ep->num)&EP_DTOG_TX)
+    /* Toggling SW_BUF hands the buffer over while the USB may still be 
+       sending the other one, so up to two packets can be queued. Only the
+       counter of this buffer is set. */
+    if (GetENDPOINT(ep->num)&EP_DTOG_RX)
     {
-      pmabuffer = ep->pmaaddr1;
+      SetEPDblBuf1Count(ep->num, EP_DBUF_IN, len);
     }
     else
     {
-      pmabuffer = ep->pmaaddr0;
+      SetEPDblBuf0Count(ep->num, EP_DBUF_IN, len);
     }
-    UserToPMABufferCopy(ep->xfer_buff, pmabuffer, len);
-    FreeUserBuffer(ep->num, ep->is_in);
+    FreeUserBuffer(ep->num, EP_DBUF_IN);
+    ep->pending++;
   }
   
   SetEPTxStatus(ep->num, EP_TX_VALID);
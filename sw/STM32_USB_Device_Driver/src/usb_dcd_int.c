@@ -191,47 +191,38 @@ void CTR(void)
         /* IN double Buffering*/
         if (ep->doublebuffer == 0)
         {
-          ep->xfer_count = GetEPTxCount(ep->num);
-          if (ep->xfer_count != 0)
+          /*multi-packet on the NON control IN endpoint: the packet is 
+            already sent, move on to the rest of the buffer */
+          ep->xfer_count =GetEPTxCount(ep->num);
+          ep->xfer_buff+=ep->xfer_count;
+         
+          /* Zero Length Packet? */
+          if (ep->xfer_len == 0)
           {
-            UserToPMABufferCopy(ep->xfer_buff, ep->pmaadress, ep->xfer_count);
-          }
-        }
-        else
-        {
-          if (GetENDPOINT(ep->num) & EP_DTOG_TX)
-          {
-            /*read from endpoint BUF0Addr buffer*/
-            ep->xfer_count = GetEPDblBuf0Count(ep->num);
-            if (ep->xfer_count != 0)
-            {
-              UserToPMABufferCopy(ep->xfer_buff, ep->pmaaddr0, ep->xfer_count);
-            }
+            /* TX COMPLETE */
+            USBD_DCD_INT_fops->DataInStage(&USB_Device_dev, ep->num);
           }
           else
           {
-            /*read from endpoint BUF1Addr buffer*/
-            ep->xfer_count = GetEPDblBuf1Count(ep->num);
-            if (ep->xfer_count != 0)
-            {
-              UserToPMABufferCopy(ep->xfer_buff, ep->pmaaddr1, ep->xfer_count);
-            }
+            DCD_EP_Tx  (&USB_Device_dev,ep->num, ep->xfer_buff, ep->xfer_len);
           }
-          FreeUserBuffer(ep->num, EP_DBUF_IN);  
-        }
-        /*multi-packet on the NON control IN endpoint*/
-        ep->xfer_count =GetEPTxCount(ep->num);
-        ep->xfer_buff+=ep->xfer_count;
-       
-        /* Zero Length Packet? */
-        if (ep->xfer_len == 0)
-        {
-          /* TX COMPLETE */
-          USBD_DCD_INT_fops->DataInStage(&USB_Device_dev, ep->num);
         }
         else
         {
-          DCD_EP_Tx  (&USB_Device_dev,ep->num, ep->xfer_buff, ep->xfer_len);
+          /* DTOG_TX != SW_BUF while a packet is still waiting for the host,
+             everything queued before it is sent. One CTR may stand for two
+             packets, each one completes its own transfer. */
+          uint16_t wReg = GetENDPOINT(ep->num);
+          uint8_t waiting = (((wReg & EP_DTOG_TX) != 0) != ((wReg & EP_DTOG_RX) != 0)) ? 1 : 0;
+          uint8_t done = (ep->pending > waiting) ? (ep->pending - waiting) : 0;
+          
+          ep->pending -= done;
+          ep->xfer_count = 0;
+          while (done--)
+          {
+            /* TX COMPLETE */
+            USBD_DCD_INT_fops->DataInStage(&USB_Device_dev, ep->num);
+          }
         }
         
       } /* if((wEPVal & EP_CTR_TX) != 0) */
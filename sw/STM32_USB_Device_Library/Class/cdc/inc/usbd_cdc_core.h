@@ -89,6 +89,22 @@ CDC_IF_Prop_TypeDef;
 extern USBD_Class_cb_TypeDef  USBD_CDC_cb;
 
 /* Exported functions ------------------------------------------------------- */ 
+void usbd_cdc_Kick     (void);
+void usbd_cdc_Deadline (uint32_t deadline);
+
+#ifdef CDC_IN_ZERO_COPY
+/* Provided by the application: bytes waiting to be sent, and writing up to 
+   max of them into the PMA buffer at pma (returns the number written) */
+extern uint32_t VCP_TxPending (void);
+extern uint16_t VCP_TxFill    (uint16_t pma, uint16_t max);
+#endif
+
+#ifdef LATENCY_STATS
+/* Provided by the application: a time stamp for a packet handed to CDC_IN_EP,
+   and the stamp of the packet that has been sent */
+extern uint32_t VCP_TxQueued  (void);
+extern void     VCP_TxSent    (uint32_t stamp);
+#endif
 
 #endif  /* __USB_CDC_CORE_H_ */
   
@@ -69,6 +69,11 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+#ifndef CDC_SNG_BUF
+#define CDC_IN_QUEUE    2   /* packets that can be queued on the double buffered CDC_IN_EP */
+#else
+#define CDC_IN_QUEUE    1
+#endif
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 /* Private function prototypes -----------------------------------------------*/ 
@@ -87,7 +92,7 @@ uint8_t  usbd_cdc_SOF         (void *pdev);
 /*********************************************
    CDC specific management functions
  *********************************************/
-static void Handle_USBAsynchXfer (void *pdev);
+static void Handle_USBAsynchXfer (void *pdev, bool flush);
 static uint8_t *USBD_cdc_GetCfgDesc (uint8_t speed, uint16_t *length);
 
 extern CDC_IF_Prop_TypeDef  APP_FOPS;
@@ -101,13 +106,25 @@ uint8_t USB_Rx_Buffer[CDC_DATA_MAX_PACKET_SIZE];
 
 uint8_t CmdBuff[CDC_CMD_PACKET_SZE];
 
+#ifndef CDC_IN_ZERO_COPY
 volatile uint8_t APP_Rx_Buffer[APP_RX_DATA_SIZE]; 
 volatile uint32_t APP_Rx_idx_in  = 0;
 volatile uint32_t APP_Rx_idx_out = 0;
-volatile uint32_t APP_Rx_length  = 0;
+volatile uint32_t APP_Rx_idx_wrap = APP_RX_DATA_SIZE;
+#endif
 volatile bool APP_last_packet = false;
 
-static bool USB_Tx_Enabled = false;
+static uint8_t USB_Tx_Pending = 0;     /* packets queued on CDC_IN_EP, up to CDC_IN_QUEUE */
+#ifdef LATENCY_STATS
+static uint32_t USB_Tx_Stamp[CDC_IN_QUEUE];  /* VCP_TxQueued() of the queued packets, oldest first */
+#define TX_STAMP()  (USB_Tx_Stamp[USB_Tx_Pending] = VCP_TxQueued())
+#else
+#define TX_STAMP()
+#endif
+
+static void *cdc_pdev = NULL;           /* set while the data interface is configured */
+static uint32_t cdc_deadline = CDC_IN_FLUSH_DEADLINE;
+static uint32_t cdc_age = 0;            /* frames the pending IN data has been waiting */
 
 static uint32_t cdcCmd = 0xFF;
 static uint32_t cdcLen = 0;
@@ -234,9 +251,17 @@ uint8_t  usbd_cdc_Init (void  *pdev,
                                uint8_t cfgidx)
 {
   (void)cfgidx;
+  /* Data endpoints are double buffered: the host is served from one PMA 
+     buffer while the other one is filled or drained */
+#ifndef CDC_SNG_BUF
+  DCD_PMA_Config(pdev , CDC_IN_EP,USB_DBL_BUF,PMA_DBL_ADDRESS(BULK_IN_TX_ADDRESS, BULK_IN_TX_ADDRESS1));
+  DCD_PMA_Config(pdev , CDC_CMD_EP,USB_SNG_BUF,INT_IN_TX_ADDRESS);
+  DCD_PMA_Config(pdev , CDC_OUT_EP,USB_DBL_BUF,PMA_DBL_ADDRESS(BULK_OUT_RX_ADDRESS, BULK_OUT_RX_ADDRESS1));
+#else
   DCD_PMA_Config(pdev , CDC_IN_EP,USB_SNG_BUF,BULK_IN_TX_ADDRESS);
   DCD_PMA_Config(pdev , CDC_CMD_EP,USB_SNG_BUF,INT_IN_TX_ADDRESS);
   DCD_PMA_Config(pdev , CDC_OUT_EP,USB_SNG_BUF,BULK_OUT_RX_ADDRESS);
+#endif
 
   /* Open EP IN */
   DCD_EP_Open(pdev,
@@ -266,6 +291,10 @@ uint8_t  usbd_cdc_Init (void  *pdev,
                    CDC_OUT_EP,
                    (uint8_t*)(USB_Rx_Buffer),
                    CDC_DATA_OUT_PACKET_SIZE);
+
+  USB_Tx_Pending = 0;
+  APP_last_packet = false;
+  cdc_pdev = pdev;
   
   return USBD_OK;
 }
@@ -281,6 +310,8 @@ uint8_t  usbd_cdc_DeInit (void  *pdev,
                                  uint8_t cfgidx)
 {
   (void)cfgidx;
+  cdc_pdev = NULL;
+
   /* Open EP IN */
   DCD_EP_Close(pdev,
               CDC_IN_EP);
@@ -428,38 +459,22 @@ uint8_t  usbd_cdc_DataIn (void *pdev, uint8_t epnum)
 {
   (void) epnum;
   
-  if (!USB_Tx_Enabled)
+  if (USB_Tx_Pending == 0)
   {
     return USBD_OK;
   }
 
-  if (APP_Rx_length == 0)
-  {
-    if (APP_last_packet)
-    {
-      APP_last_packet = false;
-      /*Send zero-length packet*/
-      DCD_EP_Tx (pdev, CDC_IN_EP, 0, 0);
-    }
-    else
-    {
-      USB_Tx_Enabled = false;
-    }
-  }
-  else
+  /* Keep the pipe busy: the next packet is queued right from the 
+     completion of the previous one */
+  USB_Tx_Pending--;
+#ifdef LATENCY_STATS
+  VCP_TxSent(USB_Tx_Stamp[0]);
+  for (uint8_t i = 1; i < CDC_IN_QUEUE; i++)
   {
-    uint16_t USB_Tx_idx = APP_Rx_idx_out;
-    uint16_t USB_Tx_length = (APP_Rx_length > CDC_DATA_IN_PACKET_SIZE) ? (CDC_DATA_IN_PACKET_SIZE) : (APP_Rx_length);
-    APP_Rx_idx_out += USB_Tx_length;
-    APP_Rx_length  -= USB_Tx_length;
-
-    if ((APP_Rx_length == 0) && (USB_Tx_length == CDC_DATA_IN_PACKET_SIZE))
-    { 
-      APP_last_packet = true;
-    }
-
-    DCD_EP_Tx (pdev, CDC_IN_EP, (uint8_t*)&APP_Rx_Buffer[USB_Tx_idx], USB_Tx_length);
+    USB_Tx_Stamp[i - 1] = USB_Tx_Stamp[i];
   }
+#endif
+  Handle_USBAsynchXfer(pdev, false);
 
   return USBD_OK;
 }
@@ -500,67 +515,151 @@ uint8_t  usbd_cdc_DataOut (void *pdev, uint8_t epnum)
   */
 uint8_t  usbd_cdc_SOF (void *pdev)
 {      
-  static uint32_t FrameCount = 0;
-  
-  if (FrameCount++ == CDC_IN_FRAME_INTERVAL)
+  if (USB_Tx_Pending >= CDC_IN_QUEUE)
   {
-    /* Reset the frame counter */
-    FrameCount = 0;
-    
-    /* Check the data to be sent through IN pipe */
-    Handle_USBAsynchXfer(pdev);
+    cdc_age = 0;
+    return USBD_OK;
+  }
+
+  /* Data collected while a packet was in flight is flushed once it is
+     cdc_deadline frames old, at once if nothing is in flight (a fallback
+     for usbd_cdc_Kick) */
+#ifdef CDC_IN_ZERO_COPY
+  if ((VCP_TxPending() != 0) || APP_last_packet)
+#else
+  if ((APP_Rx_idx_in != APP_Rx_idx_out) || APP_last_packet)
+#endif
+  {
+    if (++cdc_age >= cdc_deadline || USB_Tx_Pending == 0)
+    {
+      Handle_USBAsynchXfer(pdev, true);
+    }
+  }
+  else
+  {
+    cdc_age = 0;
   }
   
   return USBD_OK;
 }
 
 /**
-  * @brief  Handle_USBAsynchXfer
-  *         Send data to USB
-  * @param  pdev: instance
+  * @brief  usbd_cdc_Kick
+  *         New data has been committed: queue IN packets 
+  *         while the endpoint has a free buffer. Data goes out at once while 
+  *         nothing is in flight; behind a packet in flight only whole packets
+  *         are started, the rest waits for its completion or the flush deadline.
+  *         Must not be preempted by the USB interrupt (see VCP_TxReserve).
+  * @param  None
   * @retval None
   */
-static void Handle_USBAsynchXfer (void *pdev)
+void usbd_cdc_Kick (void)
 {
-  if (USB_Tx_Enabled)
+  if (cdc_pdev == NULL)
   {
     return;
   }
+  Handle_USBAsynchXfer(cdc_pdev, false);
+}
 
-  if (APP_Rx_idx_out == APP_RX_DATA_SIZE)
-  {
-    APP_Rx_idx_out = 0;
-  }
+/**
+  * @brief  usbd_cdc_Deadline
+  *         Set the flush deadline of IN data collected behind a packet in flight
+  * @param  deadline: in frames (ms), 0 flushes on every SOF
+  * @retval None
+  */
+void usbd_cdc_Deadline (uint32_t deadline)
+{
+  cdc_deadline = deadline;
+}
 
-  if (APP_Rx_idx_out == APP_Rx_idx_in)
+/**
+  * @brief  Handle_USBAsynchXfer
+  *         Send data to USB
+  * @param  pdev: instance
+  * @param  flush: send a short packet (or the terminating zero-length packet)
+  *         if there is not enough data for a whole one, even while a packet 
+  *         is in flight. With nothing in flight it is sent anyway.
+  * @retval None
+  */
+static void Handle_USBAsynchXfer (void *pdev, bool flush)
+{
+  if (((USB_CORE_HANDLE*)pdev)->dev.device_status != USB_CONFIGURED)
   {
-    APP_Rx_idx_out = 0;
-    APP_Rx_idx_in = 0;
     return;
   }
 
-  if (APP_Rx_idx_out > APP_Rx_idx_in)  /* rollback */
+  while (USB_Tx_Pending < CDC_IN_QUEUE)
   {
-    APP_Rx_length = APP_RX_DATA_SIZE - APP_Rx_idx_out;
-  }
-  else
-  {
-    APP_Rx_length = APP_Rx_idx_in - APP_Rx_idx_out;
-  }
+#ifdef CDC_IN_ZERO_COPY
+    uint32_t length = VCP_TxPending();
+    bool short_ok = flush || (USB_Tx_Pending == 0);
+#else
+    /* APP_Rx_idx_in belongs to the writer (see VCP_TxReserve), read it once 
+       and never modify it here */
+    uint32_t idx_in = APP_Rx_idx_in;
+    uint32_t length;
+    bool short_ok = flush || (USB_Tx_Pending == 0);
+
+    if ((idx_in < APP_Rx_idx_out) && (APP_Rx_idx_out == APP_Rx_idx_wrap))
+    {
+      APP_Rx_idx_out = 0; /* writer has wrapped, the tail is fully sent */
+    }
 
-  uint16_t USB_Tx_idx = APP_Rx_idx_out;
-  uint16_t USB_Tx_length = (APP_Rx_length > CDC_DATA_IN_PACKET_SIZE) ? (CDC_DATA_IN_PACKET_SIZE) : (APP_Rx_length);
-  APP_Rx_idx_out += USB_Tx_length;
-  APP_Rx_length  -= USB_Tx_length;
+    if (APP_Rx_idx_out > idx_in)  /* rollback */
+    {
+      length = APP_Rx_idx_wrap - APP_Rx_idx_out;
+      short_ok = true;            /* the tail can't grow any more */
+    }
+    else
+    {
+      length = idx_in - APP_Rx_idx_out;
+    }
+#endif
 
-  if ((APP_Rx_length == 0) && (USB_Tx_length == CDC_DATA_IN_PACKET_SIZE))
-  { 
-    APP_last_packet = true;
-  }
+    if (length == 0)
+    {
+      if (APP_last_packet && short_ok)
+      {
+        /* Previous packet was a full one: terminate the transfer */
+        APP_last_packet = false;
+        TX_STAMP();
+        USB_Tx_Pending++;
+        cdc_age = 0;
+        DCD_EP_Tx (pdev, CDC_IN_EP, 0, 0);
+      }
+      return;
+    }
 
-  USB_Tx_Enabled = true; 
+    if ((length < CDC_DATA_IN_PACKET_SIZE) && !short_ok)
+    {
+      return;
+    }
+
+#ifdef CDC_IN_ZERO_COPY
+    /* The packet is assembled right in the free PMA buffer */
+    uint16_t USB_Tx_length = VCP_TxFill(DCD_EP_TxBuffer(pdev, CDC_IN_EP), CDC_DATA_IN_PACKET_SIZE);
+    APP_last_packet = (USB_Tx_length == CDC_DATA_IN_PACKET_SIZE);
+
+    TX_STAMP();
+    USB_Tx_Pending++;
+    cdc_age = 0;
+
+    DCD_EP_TxPMA (pdev, CDC_IN_EP, USB_Tx_length);
+#else
+    uint32_t USB_Tx_idx = APP_Rx_idx_out;
+    uint16_t USB_Tx_length = (length > CDC_DATA_IN_PACKET_SIZE) ? (CDC_DATA_IN_PACKET_SIZE) : (length);
+    APP_Rx_idx_out += USB_Tx_length;
+    APP_last_packet = (USB_Tx_length == CDC_DATA_IN_PACKET_SIZE);
+
+    TX_STAMP();
+    USB_Tx_Pending++;
+    cdc_age = 0;
 
-  DCD_EP_Tx (pdev, CDC_IN_EP, (uint8_t*)&APP_Rx_Buffer[USB_Tx_idx], USB_Tx_length);
+    /* The packet is copied to PMA right away, its space can be reused */
+    DCD_EP_Tx (pdev, CDC_IN_EP, (uint8_t*)&APP_Rx_Buffer[USB_Tx_idx], USB_Tx_length);
+#endif
+  }
 }
 
 /**
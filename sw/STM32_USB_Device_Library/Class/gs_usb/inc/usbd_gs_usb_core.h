@@ -0,0 +1,150 @@
+/**
+  ******************************************************************************
+  * @file    usbd_gs_usb_core.h
+  * @brief   header file for the usbd_gs_usb_core.c file.
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __USB_GS_USB_CORE_H_
+#define __USB_GS_USB_CORE_H_
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbd_desc.h"
+
+/* Exported defines ----------------------------------------------------------*/
+
+#define USB_GS_USB_CONFIG_DESC_SIZ              (32)
+
+#define USB_REQ_TYPE_VENDOR                     0x40
+
+#define GS_USB_DATA_MAX_PACKET_SIZE             64
+#define GS_USB_CMD_PACKET_SIZE                  40  /* largest control payload (bt_const) */
+
+/*---------------------------------------------------------------------*/
+/*  gs_usb definitions (linux/drivers/net/can/usb/gs_usb.c)            */
+/*---------------------------------------------------------------------*/
+
+/**************************************************/
+/* gs_usb vendor requests                         */
+/**************************************************/
+#define GS_USB_BREQ_HOST_FORMAT                 0
+#define GS_USB_BREQ_BITTIMING                   1
+#define GS_USB_BREQ_MODE                        2
+#define GS_USB_BREQ_BERR                        3
+#define GS_USB_BREQ_BT_CONST                    4
+#define GS_USB_BREQ_DEVICE_CONFIG               5
+#define GS_USB_BREQ_TIMESTAMP                   6
+#define GS_USB_BREQ_IDENTIFY                    7
+
+#define GS_CAN_MODE_RESET                       0
+#define GS_CAN_MODE_START                       1
+
+#define GS_CAN_MODE_NORMAL                      0
+#define GS_CAN_MODE_LISTEN_ONLY                 (1 << 0)
+#define GS_CAN_MODE_LOOP_BACK                   (1 << 1)
+#define GS_CAN_MODE_TRIPLE_SAMPLE               (1 << 2)
+#define GS_CAN_MODE_ONE_SHOT                    (1 << 3)
+#define GS_CAN_MODE_HW_TIMESTAMP                (1 << 4)
+
+#define GS_CAN_FEATURE_LISTEN_ONLY              (1 << 0)
+#define GS_CAN_FEATURE_LOOP_BACK                (1 << 1)
+#define GS_CAN_FEATURE_TRIPLE_SAMPLE            (1 << 2)
+#define GS_CAN_FEATURE_ONE_SHOT                 (1 << 3)
+#define GS_CAN_FEATURE_HW_TIMESTAMP             (1 << 4)
+
+#define GS_CAN_FLAG_OVERFLOW                    (1 << 0)
+
+#define GS_CAN_EFF_FLAG                         0x80000000U
+#define GS_CAN_RTR_FLAG                         0x40000000U
+#define GS_CAN_ERR_FLAG                         0x20000000U
+
+/* Error frames (linux/can/error.h): class in can_id, details in data[] */
+#define GS_CAN_ERR_DLC                          8
+#define GS_CAN_ERR_TX_TIMEOUT                   0x00000001U
+#define GS_CAN_ERR_LOSTARB                      0x00000002U
+#define GS_CAN_ERR_PROT                         0x00000008U
+#define GS_CAN_ERR_BUSERROR                     0x00000080U
+#define GS_CAN_ERR_PROT_TX                      0x80  /* data[2] */
+
+#define GS_HOST_FRAME_ECHO_RX                   0xFFFFFFFFU
+
+/* Exported types ------------------------------------------------------------*/
+/* All fields little-endian, as the host driver expects */
+typedef struct __attribute__((packed))
+{
+  uint32_t echo_id;
+  uint32_t can_id;
+  uint8_t  can_dlc;
+  uint8_t  channel;
+  uint8_t  flags;
+  uint8_t  reserved;
+  uint8_t  data[8];
+  uint32_t timestamp_us;  /* only sent in GS_CAN_MODE_HW_TIMESTAMP mode */
+}
+GS_Host_Frame_TypeDef;
+
+#define GS_HOST_FRAME_SIZE                      (sizeof(GS_Host_Frame_TypeDef) - 4)
+#define GS_HOST_FRAME_SIZE_TS                   (sizeof(GS_Host_Frame_TypeDef))
+
+typedef struct __attribute__((packed))
+{
+  uint8_t  reserved1;
+  uint8_t  reserved2;
+  uint8_t  reserved3;
+  uint8_t  icount;        /* number of CAN channels - 1 */
+  uint32_t sw_version;
+  uint32_t hw_version;
+}
+GS_Device_Config_TypeDef;
+
+typedef struct __attribute__((packed))
+{
+  uint32_t mode;
+  uint32_t flags;
+}
+GS_Device_Mode_TypeDef;
+
+typedef struct __attribute__((packed))
+{
+  uint32_t prop_seg;
+  uint32_t phase_seg1;
+  uint32_t phase_seg2;
+  uint32_t sjw;
+  uint32_t brp;
+}
+GS_Device_Bittiming_TypeDef;
+
+typedef struct __attribute__((packed))
+{
+  uint32_t feature;
+  uint32_t fclk_can;
+  uint32_t tseg1_min;
+  uint32_t tseg1_max;
+  uint32_t tseg2_min;
+  uint32_t tseg2_max;
+  uint32_t sjw_max;
+  uint32_t brp_min;
+  uint32_t brp_max;
+  uint32_t brp_inc;
+}
+GS_Device_BT_Const_TypeDef;
+
+typedef struct _GS_USB_IF_PROP
+{
+  uint16_t (*pIf_Init)     (void);
+  uint16_t (*pIf_DeInit)   (void);
+  uint16_t (*pIf_Ctrl)     (uint32_t Cmd, uint8_t* Buf, uint32_t Len); /* returns length of IN data; Buf NULL for an OUT request to come: USBD_OK if it can be taken */
+  uint16_t (*pIf_DataTx)   (uint8_t* Buf);                             /* next IN frame, returns its length or 0 */
+  uint16_t (*pIf_DataRx)   (uint8_t* Buf, uint32_t Len);
+}
+GS_USB_IF_Prop_TypeDef;
+
+/* Exported macros -----------------------------------------------------------*/
+/* Exported variables --------------------------------------------------------*/
+extern USBD_Class_cb_TypeDef  USBD_GS_USB_cb;
+
+/* Exported functions ------------------------------------------------------- */
+void usbd_gs_usb_Kick (void *pdev);
+
+#endif  /* __USB_GS_USB_CORE_H_ */
@@ -0,0 +1,394 @@
+/**
+  ******************************************************************************
+  * @file    usbd_gs_usb_core.c
+  * @brief   This file provides the high layer firmware functions to manage a
+  *          gs_usb (candleLight) compatible vendor class, handled on Linux by
+  *          the in-kernel gs_usb SocketCAN driver:
+  *           - Enumeration as vendor specific device with one bulk IN and one
+  *             bulk OUT endpoint
+  *           - Vendor requests (bit timing, mode, device configuration...)
+  *           - One struct gs_host_frame per IN/OUT transfer
+  *
+  *          Requests and frames are passed to the interface layer
+  *          (GS_USB_FOPS), which maps them onto the CAN driver.
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbd_gs_usb_core.h"
+#include <stdbool.h>
+
+/* Private typedef -----------------------------------------------------------*/
+/* Private define ------------------------------------------------------------*/
+#define NO_CMD                                  0xFF
+
+/* Private macro -------------------------------------------------------------*/
+/* Private variables ---------------------------------------------------------*/
+/* Private function prototypes -----------------------------------------------*/
+
+/*********************************************
+   gs_usb Device library callbacks
+ *********************************************/
+uint8_t  usbd_gs_usb_Init        (void  *pdev, uint8_t cfgidx);
+uint8_t  usbd_gs_usb_DeInit      (void  *pdev, uint8_t cfgidx);
+uint8_t  usbd_gs_usb_Setup       (void  *pdev, USB_SETUP_REQ *req);
+uint8_t  usbd_gs_usb_EP0_RxReady (void *pdev);
+uint8_t  usbd_gs_usb_DataIn      (void *pdev, uint8_t epnum);
+uint8_t  usbd_gs_usb_DataOut     (void *pdev, uint8_t epnum);
+uint8_t  usbd_gs_usb_SOF         (void *pdev);
+
+static uint8_t *USBD_gs_usb_GetCfgDesc (uint8_t speed, uint16_t *length);
+
+extern GS_USB_IF_Prop_TypeDef GS_USB_FOPS;
+
+static __IO uint32_t  usbd_gs_usb_AltSet  = 0;
+
+static uint8_t GS_Rx_Buffer[GS_USB_DATA_MAX_PACKET_SIZE];
+static uint8_t GS_Tx_Buffer[GS_USB_DATA_MAX_PACKET_SIZE];
+
+static uint32_t GS_CmdBuff[GS_USB_CMD_PACKET_SIZE / 4]; /* word aligned for the interface layer */
+
+static bool USB_Tx_Enabled = false;
+
+static uint32_t gsCmd = NO_CMD;
+static uint32_t gsLen = 0;
+
+/* gs_usb interface class callbacks structure */
+USBD_Class_cb_TypeDef  USBD_GS_USB_cb =
+{
+  usbd_gs_usb_Init,
+  usbd_gs_usb_DeInit,
+  usbd_gs_usb_Setup,
+  NULL,                 /* EP0_TxSent, */
+  usbd_gs_usb_EP0_RxReady,
+  usbd_gs_usb_DataIn,
+  usbd_gs_usb_DataOut,
+  usbd_gs_usb_SOF,
+  USBD_gs_usb_GetCfgDesc,
+};
+
+/* USB gs_usb device Configuration Descriptor */
+const uint8_t usbd_gs_usb_CfgDesc[USB_GS_USB_CONFIG_DESC_SIZ] =
+{
+  /*Configuration Descriptor*/
+  0x09,   /* bLength: Configuration Descriptor size */
+  USB_CONFIGURATION_DESCRIPTOR_TYPE,      /* bDescriptorType: Configuration */
+  USB_GS_USB_CONFIG_DESC_SIZ,             /* wTotalLength:no of returned bytes */
+  0x00,
+  0x01,   /* bNumInterfaces: 1 interface */
+  0x01,   /* bConfigurationValue: Configuration value */
+  0x00,   /* iConfiguration: Index of string descriptor describing the configuration */
+  0xC0,   /* bmAttributes: self powered */
+  0x32,   /* MaxPower 100 mA */
+
+  /*---------------------------------------------------------------------------*/
+
+  /*Interface Descriptor */
+  0x09,   /* bLength: Interface Descriptor size */
+  USB_INTERFACE_DESCRIPTOR_TYPE,  /* bDescriptorType: Interface */
+  0x00,   /* bInterfaceNumber: Number of Interface */
+  0x00,   /* bAlternateSetting: Alternate setting */
+  0x02,   /* bNumEndpoints: Two endpoints used */
+  0xFF,   /* bInterfaceClass: Vendor Specific */
+  0xFF,   /* bInterfaceSubClass: */
+  0xFF,   /* bInterfaceProtocol: */
+  0x00,   /* iInterface: */
+
+  /*Endpoint IN Descriptor*/
+  0x07,   /* bLength: Endpoint Descriptor size */
+  USB_ENDPOINT_DESCRIPTOR_TYPE,         /* bDescriptorType: Endpoint */
+  GS_USB_IN_EP,                         /* bEndpointAddress */
+  0x02,                                 /* bmAttributes: Bulk */
+  LOBYTE(GS_USB_DATA_MAX_PACKET_SIZE),  /* wMaxPacketSize: */
+  HIBYTE(GS_USB_DATA_MAX_PACKET_SIZE),
+  0x00,                                 /* bInterval: ignore for Bulk transfer */
+
+  /*Endpoint OUT Descriptor*/
+  0x07,   /* bLength: Endpoint Descriptor size */
+  USB_ENDPOINT_DESCRIPTOR_TYPE,         /* bDescriptorType: Endpoint */
+  GS_USB_OUT_EP,                        /* bEndpointAddress */
+  0x02,                                 /* bmAttributes: Bulk */
+  LOBYTE(GS_USB_DATA_MAX_PACKET_SIZE),  /* wMaxPacketSize: */
+  HIBYTE(GS_USB_DATA_MAX_PACKET_SIZE),
+  0x00                                  /* bInterval: ignore for Bulk transfer */
+} ;
+
+/* Private function ----------------------------------------------------------*/
+/**
+  * @brief  usbd_gs_usb_Init
+  *         Initialize the gs_usb interface
+  * @param  pdev: device instance
+  * @param  cfgidx: Configuration index
+  * @retval status
+  */
+uint8_t  usbd_gs_usb_Init (void  *pdev,
+                           uint8_t cfgidx)
+{
+  (void)cfgidx;
+  DCD_PMA_Config(pdev , GS_USB_IN_EP,USB_SNG_BUF,BULK_IN_TX_ADDRESS);
+  DCD_PMA_Config(pdev , GS_USB_OUT_EP,USB_SNG_BUF,BULK_OUT_RX_ADDRESS);
+
+  /* Open EP IN */
+  DCD_EP_Open(pdev,
+              GS_USB_IN_EP,
+              GS_USB_DATA_MAX_PACKET_SIZE,
+              USB_EP_BULK);
+
+  /* Open EP OUT */
+  DCD_EP_Open(pdev,
+              GS_USB_OUT_EP,
+              GS_USB_DATA_MAX_PACKET_SIZE,
+              USB_EP_BULK);
+
+  USB_Tx_Enabled = false;
+
+  /* Initialize the Interface physical components */
+  GS_USB_FOPS.pIf_Init();
+
+  /* Prepare Out endpoint to receive next packet */
+  DCD_EP_PrepareRx(pdev,
+                   GS_USB_OUT_EP,
+                   (uint8_t*)(GS_Rx_Buffer),
+                   GS_USB_DATA_MAX_PACKET_SIZE);
+
+  return USBD_OK;
+}
+
+/**
+  * @brief  usbd_gs_usb_DeInit
+  *         DeInitialize the gs_usb layer
+  * @param  pdev: device instance
+  * @param  cfgidx: Configuration index
+  * @retval status
+  */
+uint8_t  usbd_gs_usb_DeInit (void  *pdev,
+                             uint8_t cfgidx)
+{
+  (void)cfgidx;
+  /* Close EP IN */
+  DCD_EP_Close(pdev,
+              GS_USB_IN_EP);
+
+  /* Close EP OUT */
+  DCD_EP_Close(pdev,
+              GS_USB_OUT_EP);
+
+  USB_Tx_Enabled = false;
+
+  /* Restore default state of the Interface physical components */
+  GS_USB_FOPS.pIf_DeInit();
+
+  return USBD_OK;
+}
+
+/**
+  * @brief  usbd_gs_usb_Setup
+  *         Handle the gs_usb vendor requests
+  * @param  pdev: instance
+  * @param  req: usb requests
+  * @retval status
+  */
+uint8_t  usbd_gs_usb_Setup (void  *pdev,
+                            USB_SETUP_REQ *req)
+{
+  switch (req->bmRequest & USB_REQ_TYPE_MASK)
+  {
+    /* gs_usb Vendor Requests -------------------------------*/
+  case USB_REQ_TYPE_VENDOR :
+    if (req->wLength > sizeof(GS_CmdBuff))
+    {
+      USBD_CtlError (pdev, req);
+      return USBD_FAIL;
+    }
+
+    /* Check if the request is a data setup packet */
+    if (req->wLength)
+    {
+      /* Check if the request is Device-to-Host */
+      if (req->bmRequest & 0x80)
+      {
+        /* Get the data to be sent to Host from interface layer */
+        uint16_t len = GS_USB_FOPS.pIf_Ctrl(req->bRequest, (uint8_t*)GS_CmdBuff, req->wLength);
+        if (len == 0)
+        {
+          /* Unknown request */
+          USBD_CtlError (pdev, req);
+          return USBD_FAIL;
+        }
+
+        /* Send the data to the host */
+        USBD_CtlSendData (pdev,
+                          (uint8_t*)GS_CmdBuff,
+                          MIN(len, req->wLength));
+      }
+      else /* Host-to-Device requeset */
+      {
+        /* Stall a request the interface layer cannot take yet */
+        if (GS_USB_FOPS.pIf_Ctrl(req->bRequest, NULL, req->wLength) != USBD_OK)
+        {
+          USBD_CtlError (pdev, req);
+          return USBD_FAIL;
+        }
+
+        /* Set the value of the current command to be processed */
+        gsCmd = req->bRequest;
+        gsLen = req->wLength;
+
+        /* Prepare the reception of the buffer over EP0
+        Next step: the received data will be managed in usbd_gs_usb_EP0_RxReady()
+        function. */
+        USBD_CtlPrepareRx (pdev,
+                           (uint8_t*)GS_CmdBuff,
+                           req->wLength);
+      }
+    }
+    else /* No Data request */
+    {
+      /* Transfer the command to the interface layer */
+      GS_USB_FOPS.pIf_Ctrl(req->bRequest, NULL, 0);
+    }
+
+    return USBD_OK;
+
+    /* Standard Requests -------------------------------*/
+  case USB_REQ_TYPE_STANDARD:
+    switch (req->bRequest)
+    {
+    case USB_REQ_GET_INTERFACE :
+      USBD_CtlSendData (pdev,
+                        (uint8_t *)&usbd_gs_usb_AltSet,
+                        1);
+      break;
+
+    case USB_REQ_SET_INTERFACE :
+      if ((uint8_t)(req->wValue) < USBD_ITF_MAX_NUM)
+      {
+        usbd_gs_usb_AltSet = (uint8_t)(req->wValue);
+      }
+      else
+      {
+        /* Call the error management function (command will be nacked */
+        USBD_CtlError (pdev, req);
+      }
+      break;
+    }
+    return USBD_OK;
+
+  default:
+    USBD_CtlError (pdev, req);
+    return USBD_FAIL;
+  }
+}
+
+/**
+  * @brief  usbd_gs_usb_EP0_RxReady
+  *         Data received on control endpoint
+  * @param  pdev: device device instance
+  * @retval status
+  */
+uint8_t  usbd_gs_usb_EP0_RxReady (void  *pdev)
+{
+  (void)pdev;
+  if (gsCmd != NO_CMD)
+  {
+    /* Process the data */
+    GS_USB_FOPS.pIf_Ctrl(gsCmd, (uint8_t*)GS_CmdBuff, gsLen);
+
+    /* Reset the command variable to default value */
+    gsCmd = NO_CMD;
+  }
+
+  return USBD_OK;
+}
+
+/**
+  * @brief  usbd_gs_usb_Kick
+  *         Start sending the next queued frame if the IN endpoint is idle.
+  *         Must be called from the USB interrupt priority level or with
+  *         interrupts masked.
+  * @param  pdev: device instance
+  * @retval None
+  */
+void usbd_gs_usb_Kick (void *pdev)
+{
+  if (USB_Tx_Enabled || (((USB_CORE_HANDLE*)pdev)->dev.device_status != USB_CONFIGURED))
+  {
+    return;
+  }
+
+  uint16_t len = GS_USB_FOPS.pIf_DataTx(GS_Tx_Buffer);
+  if (len != 0)
+  {
+    USB_Tx_Enabled = true;
+    DCD_EP_Tx (pdev, GS_USB_IN_EP, GS_Tx_Buffer, len);
+  }
+}
+
+/**
+  * @brief  usbd_gs_usb_DataIn
+  *         Data sent on non-control IN endpoint
+  * @param  pdev: device instance
+  * @param  epnum: endpoint number
+  * @retval status
+  */
+uint8_t  usbd_gs_usb_DataIn (void *pdev, uint8_t epnum)
+{
+  (void) epnum;
+
+  USB_Tx_Enabled = false;
+  usbd_gs_usb_Kick(pdev);
+
+  return USBD_OK;
+}
+
+/**
+  * @brief  usbd_gs_usb_DataOut
+  *         Data received on non-control Out endpoint
+  * @param  pdev: device instance
+  * @param  epnum: endpoint number
+  * @retval status
+  */
+uint8_t  usbd_gs_usb_DataOut (void *pdev, uint8_t epnum)
+{
+  uint16_t USB_Rx_Cnt;
+
+  /* Get the received data buffer and update the counter */
+  USB_Rx_Cnt = ((USB_CORE_HANDLE*)pdev)->dev.out_ep[epnum].xfer_count;
+
+  GS_USB_FOPS.pIf_DataRx(GS_Rx_Buffer, USB_Rx_Cnt);
+
+  /* Prepare Out endpoint to receive next packet */
+  DCD_EP_PrepareRx(pdev,
+                   GS_USB_OUT_EP,
+                   (uint8_t*)(GS_Rx_Buffer),
+                   GS_USB_DATA_MAX_PACKET_SIZE);
+
+  return USBD_OK;
+}
+
+/**
+  * @brief  usbd_gs_usb_SOF
+  *         Start Of Frame event management: picks up frames queued while
+  *         the IN endpoint was idle and nobody kicked it.
+  * @param  pdev: instance
+  * @retval status
+  */
+uint8_t  usbd_gs_usb_SOF (void *pdev)
+{
+  usbd_gs_usb_Kick(pdev);
+  return USBD_OK;
+}
+
+/**
+  * @brief  USBD_gs_usb_GetCfgDesc
+  *         Return configuration descriptor
+  * @param  speed : current device speed
+  * @param  length : pointer data length
+  * @retval pointer to descriptor buffer
+  */
+static uint8_t  *USBD_gs_usb_GetCfgDesc (uint8_t speed, uint16_t *length)
+{
+  (void)speed;
+  *length = sizeof (usbd_gs_usb_CfgDesc);
+  return (uint8_t*)usbd_gs_usb_CfgDesc;
+}
@@ -0,0 +1,61 @@
+#ifndef _BINRECORD_HPP_
+#define _BINRECORD_HPP_
+
+#include <stdint.h>
+
+// Layout of the binary VCP stream (see 'B' command). Every item is a fixed
+// 20-byte record, all fields little-endian. Command replies travel as Reply
+// records carrying the ASCII answer ("z\r", "\a", ...) in data, so they can
+// never be confused with CAN traffic. An Overflow record takes the place of
+// frames that were lost (hardware FIFO overrun or no room in the stream), its
+// id counts the losses. A TxDone record reports a transmit request that ended
+// (see 'E' command): id, flags and dlc of the frame, data[0..3] the tag given
+// with it, data[4] the CANbus::TxResult and time as for received frames. An
+// Error record reports a bus error or error state change: dlc is the
+// CANbus::Event, data[0..3] TEC, REC, last error code and ESR state flags.
+// In batch mode the records come in groups, each preceded by a Header with
+// their number and length: as many as go into one IN packet whole, or as
+// many as queued up before the first of them was sent.
+namespace BinRecord
+{
+  enum Type : uint8_t
+  {
+    Frame = 0x01,
+    Reply = 0x02,
+    Overflow = 0x03,
+    TxDone = 0x04,
+    Error = 0x05,
+    Batch = 0xB5
+  };
+
+  enum Flags : uint8_t
+  {
+    IDE  = 0x01,
+    RTR  = 0x02,
+    Time = 0x04,  // time field is valid
+    Micro = 0x08  // time is 32-bit microseconds at SOF, else 16-bit milliseconds
+  };
+
+  typedef struct __attribute__((packed))
+  {
+    uint8_t  type;
+    uint8_t  flags;
+    uint8_t  dlc;       // frame DLC or number of used reply bytes
+    uint8_t  reserved;
+    uint32_t id;
+    uint8_t  data[8];
+    uint32_t time;
+  } Record;
+
+  typedef struct __attribute__((packed))
+  {
+    uint8_t  type;      // Batch
+    uint8_t  count;     // number of records that follow
+    uint16_t length;    // number of bytes that follow
+  } Header;
+
+  static_assert (sizeof(Record) == 20, "Record must be 20 bytes!");
+  static_assert (sizeof(Header) == 4, "Header must be 4 bytes!");
+};
+
+#endif // _BINRECORD_HPP_
@@ -2,6 +2,7 @@
 #include "can.hpp"
 #include "fifo.hpp"
 #include "timer_led.hpp"
+#include "latency.hpp"
 
 
 extern "C" void CEC_CAN_IRQHandler (void);
@@ -11,13 +12,86 @@ using CANbus::OpenMode;
 using CANbus::Bitrate;
 using CANbus::RxMsg;
 using CANbus::TxMsg;
+using CANbus::TimeStamp;
+using CANbus::TxPolicy;
+using CANbus::TxDone;
+using CANbus::TxResult;
 
 
 static TimerLed timled;
-static bool timestamping = false;
+static Timer timus (TIM2, 48, 0);  // 1 us ticks, TIM2 is 32-bit: ARR = 0 - 1 = 0xFFFFFFFF
+static TimeStamp timestamping = TimeStamp::Off;
 static CANbus::RxCallback rx_cb = nullptr;
+static CANbus::EventCallback event_cb = nullptr;
+static CANbus::TxCallback tx_cb = nullptr;
+static CANbus::SentCallback sent_cb = nullptr;
+static volatile uint32_t overrun_cnt = 0;
+static volatile uint8_t status_flags = 0;
+static uint32_t esr_state = 0;              // EWGF, EPVF, BOFF as last reported
+static volatile uint32_t lec_cnt[7] = {0};
+static volatile uint8_t last_lec = 0;
 static bool isopen = false;
 static uint32_t btr_reg = static_cast<uint32_t>(Bitrate::br1Mbit);
+static uint32_t filter_code = 0;
+static uint32_t filter_mask = 0;
+
+// TTCM latches a counter of CAN bit times at the SOF sample point of every 
+// frame (RDTR TIME). It runs from the same 48 MHz clock as TIM2, so once tied
+// to the microsecond timer it gives the SOF time free of interrupt latency.
+static const uint32_t mcr_cfg = CAN_MCR_ABOM | CAN_MCR_TTCM;
+static uint32_t bit_clk = 0;     // CAN bit time in 48 MHz clocks
+static bool synced = false;      // sync_* tie the bit counter to timus:
+static uint32_t sync_us = 0;     //   bit counter value sync_bits was at timus
+static uint32_t sync_clk = 0;    //   sync_us + sync_clk/48
+static uint16_t sync_bits = 0;
+
+// Software TX queue in front of the three mailboxes, refilled from the
+// mailbox-empty interrupt. It is a binary heap ordered by key, then by the
+// order of send(): with TxPolicy::Fifo all keys are 0 and the mailboxes go
+// out in request order (TXFP), with TxPolicy::Priority the key is the bus
+// arbitration order and the mailboxes go out by identifier. The main loop
+// pushes with the CAN interrupt masked.
+typedef struct
+{
+  TxMsg msg;
+  uint32_t key;
+  uint32_t seq;
+} TxEntry;
+
+static const uint32_t txq_depth = 32;
+static TxEntry txq[txq_depth];
+static volatile uint32_t txq_used = 0;
+static volatile uint32_t txq_peak = 0;
+static volatile uint32_t txq_rejected = 0;    // send() calls that found the queue full
+static uint32_t txq_seq = 0;
+static TxPolicy txpolicy = TxPolicy::Fifo;
+static TxMsg txmb[3];   // frames in the mailboxes, for TxDone
+
+// What the interrupt hands on to poll(), in the order it happened: frames
+// as it took them out of FIFO0, TX completions and events. The callbacks
+// all run from poll(), so the host sees them in that order too.
+enum class Entry : uint8_t { Frame, TxDone, Event };
+
+typedef struct
+{
+  uint32_t RIR;     // TxDone: the mailbox registers, same layout
+  uint32_t RDTR;
+  uint32_t RDLR;
+  uint32_t RDHR;
+  uint32_t Time;    // RxMsg::Time, TxDone::Time
+  union
+  {
+    uint32_t Now;   // Frame: RxMsg::Arrival
+    uint32_t Tag;   // TxDone: TxMsg::Tag
+    uint32_t Lost;  // Event Overrun: entries lost, reported one by one
+  };
+  Entry Kind;
+  uint8_t Code;     // TxDone: TxResult, Event: CANbus::Event
+} RxRaw;
+
+static FIFO<RxRaw, 32> rxring;
+static volatile uint32_t rx_lost = 0;     // entries lost since the last Overrun went into rxring
+static volatile uint32_t rx_dropped = 0;  // entries lost since rx_clear_stats()
 
 
 Status CANbus::init (void)
@@ -29,7 +103,7 @@ Status CANbus::init (void)
   GPIOB->AFR[1] |=  0x00000044;
 
   RCC->APB1ENR |= RCC_APB1ENR_CANEN;
-  CAN->MCR = CAN_MCR_SLEEP | CAN_MCR_ABOM | CAN_MCR_TXFP;
+  CAN->MCR = CAN_MCR_SLEEP | mcr_cfg | CAN_MCR_TXFP;
 
   CAN->FMR |= CAN_FMR_FINIT; 
   CAN->FM1R = 0;                    // 0: Two 32-bit registers of filter bank x are in Identifier Mask mode.
@@ -41,29 +115,117 @@ Status CANbus::init (void)
   CAN->FMR &= ~(uint32_t)CAN_FMR_FINIT;
 
   timled.init();
+  timus.init();
 
   return Status::Ok;
 }
 
 
-Status CANbus::filtermask (uint32_t msk)
+// Back to a single 32-bit mask in bank 0, whatever filters() has set up
+static void filter_single (void)
 {
   CAN->FMR |= CAN_FMR_FINIT; 
-  CAN->sFilterRegister[0].FR2 = ~msk; // MASK  
+  CAN->FA1R = 0;
+  CAN->FM1R = 0;
+  CAN->FS1R = CAN_FS1R_FSC0;
+  CAN->sFilterRegister[0].FR1 = filter_code;  // ID
+  CAN->sFilterRegister[0].FR2 = filter_mask;  // MASK
+  CAN->FA1R = CAN_FA1R_FACT0;
   CAN->FMR &= ~(uint32_t)CAN_FMR_FINIT;
+}
+
+
+Status CANbus::filtermask (uint32_t msk)
+{
+  filter_mask = ~msk;
+  filter_single();
   return Status::Ok;
 }
 
 
 Status CANbus::filtercode (uint32_t code)
 {
+  filter_code = code;
+  filter_single();
+  return Status::Ok;
+}
+
+
+// Banks are taken over as given, the ones past n are switched off
+Status CANbus::filters (const CANFilter::Bank* banks, uint32_t n)
+{
+  if (n > CANFilter::Banks) return Status::Error;
+
+  uint32_t fm = 0;
+  uint32_t fs = 0;
+  uint32_t fa = 0;
   CAN->FMR |= CAN_FMR_FINIT; 
-  CAN->sFilterRegister[0].FR1 = code; // ID  
+  CAN->FA1R = 0;                    // a bank must be inactive to be written
+  for (uint32_t i = 0; i < n; i++)
+  {
+    CAN->sFilterRegister[i].FR1 = banks[i].FR1;
+    CAN->sFilterRegister[i].FR2 = banks[i].FR2;
+    fm |= (banks[i].List) ? (1 << i) : 0;
+    fs |= (banks[i].Wide) ? (1 << i) : 0;
+    fa |= 1 << i;
+  }
+  CAN->FM1R = fm;
+  CAN->FS1R = fs;
+  CAN->FFA1R = 0;                   // all to FIFO 0
+  CAN->FA1R = fa;
   CAN->FMR &= ~(uint32_t)CAN_FMR_FINIT;
   return Status::Ok;
 }
 
 
+static void set_bit_clk (void)
+{
+  uint32_t brp = (btr_reg & CAN_BTR_BRP) + 1;
+  uint32_t ts1 = ((btr_reg & CAN_BTR_TS1) >> 16) + 1;
+  uint32_t ts2 = ((btr_reg & CAN_BTR_TS2) >> 20) + 1;
+  bit_clk = brp * (1 + ts1 + ts2);
+  synced = false;
+}
+
+
+// Bits from SOF up to the point the frame is taken (last but one bit of EOF)
+// without stuff bits: the shortest this frame can have taken on the bus
+static inline uint32_t frame_bits (bool ide, bool rtr, uint32_t dlc)
+{
+  uint32_t dlen = (rtr) ? 0 : ((dlc > 8) ? 8 : dlc);
+  return ((ide) ? 63 : 43) + 8*dlen;
+}
+
+
+// Maps the SOF bit counter of a frame received just now onto timus
+static uint32_t sof_time (uint16_t bits, uint32_t now, uint32_t min_bits)
+{
+  // Both candidates can only be late: SOF was at least min_bits ago, and the
+  // previous estimate was late by the same amount as any time derived from it
+  uint32_t clk = min_bits * bit_clk;
+  uint32_t t_us = now - clk / 48;
+  uint32_t t_clk = 0;
+
+  // The 16-bit counter is unambiguous for 65536 bits after the last sync
+  if (synced && (now - sync_us) < ((65536 - 256) * bit_clk) / 48)
+  {
+    clk = sync_clk + static_cast<uint16_t>(bits - sync_bits) * bit_clk;
+    uint32_t m_us = sync_us + clk / 48;
+    if (static_cast<int32_t>(t_us - m_us) > 0)
+    {
+      t_us = m_us;
+      t_clk = clk % 48;
+    }
+  }
+
+  sync_us = t_us;
+  sync_clk = t_clk;
+  sync_bits = bits;
+  synced = true;
+  return t_us;
+}
+
+
 Status CANbus::bitrate (Bitrate br)
 {
   return bitrate(static_cast<uint32_t>(br));
@@ -82,6 +244,7 @@ Status CANbus::bitrate (uint32_t btr)
     while (!(CAN->MSR & CAN_MSR_INAK));
 
     CAN->BTR = btr_reg;
+    set_bit_clk();
   
     CAN->MCR &= ~((uint32_t)CAN_MCR_INRQ);
     while (CAN->MSR & CAN_MSR_INAK);
@@ -99,6 +262,12 @@ Status CANbus::open (OpenMode mode)
   CAN->MCR |= CAN_MCR_INRQ;
   while (!(CAN->MSR & CAN_MSR_INAK));
 
+  CAN->MCR |= mcr_cfg | ((txpolicy == TxPolicy::Fifo) ? CAN_MCR_TXFP : 0);  // reset has cleared them
+  txq_used = 0;
+  esr_state = 0;
+  rxring.clear();   // nothing from the last session, the reset has masked the interrupts
+  rx_lost = 0;
+
   btr_reg &= ~(CAN_BTR_LBKM | CAN_BTR_SILM);
   switch (mode)
   {
@@ -107,13 +276,15 @@ Status CANbus::open (OpenMode mode)
     case OpenMode::ListenOnly: btr_reg |= CAN_BTR_SILM; break;
   }
   CAN->BTR = btr_reg;
+  set_bit_clk();
 
   CAN->MCR &= ~(uint32_t)CAN_MCR_INRQ;
   while (CAN->MSR & CAN_MSR_INAK);
   
   CAN->MCR &= ~(uint32_t)CAN_MCR_SLEEP;
 
-  CAN->IER |= CAN_IER_FMPIE0;
+  CAN->IER |= CAN_IER_FMPIE0 | CAN_IER_FFIE0 | CAN_IER_FOVIE0 | CAN_IER_TMEIE |
+              CAN_IER_ERRIE | CAN_IER_EWGIE | CAN_IER_EPVIE | CAN_IER_BOFIE | CAN_IER_LECIE;
   NVIC_SetPriority(CEC_CAN_IRQn, 1);
   NVIC_EnableIRQ(CEC_CAN_IRQn);
   
@@ -130,51 +301,300 @@ Status CANbus::close (void)
     
   NVIC_DisableIRQ(CEC_CAN_IRQn);
 
+  txq_used = 0;
+  rxring.clear();
+  rx_lost = 0;
   isopen = false;
   timled.link(false);
   return Status::Ok;
 }
 
 
-Status CANbus::timestamp (bool state)
+bool CANbus::is_open (void)
 {
-  timestamping = state;
+  return isopen;
+}
+
+
+Status CANbus::timestamp (TimeStamp mode)
+{
+  timestamping = mode;
   return Status::Ok;
 }
 
 
-bool CANbus::timestamp (void)
+TimeStamp CANbus::timestamp (void)
 {
   return timestamping;
 }
 
 
-Status CANbus::send (TxMsg &msg)
+uint32_t CANbus::time_us (void)
 {
-  Status result = Status::Error;
-  
-  if (CAN->TSR & (CAN_TSR_TME))
+  return timus.value();
+}
+
+
+uint32_t CANbus::time (void)
+{
+  switch (timestamping)
   {
-    uint32_t mb = (CAN->TSR & CAN_TSR_CODE) >> 24;
+    case TimeStamp::Milli: return timled.value();
+    case TimeStamp::Micro: return timus.value();
+    default: return 0;
+  }
+}
+
+
+// Latched flags are cleared by reading, the error state ones stay set while
+// the state lasts
+uint8_t CANbus::status (void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint8_t st = status_flags;
+  status_flags = 0;
+  __set_PRIMASK(primask);
+
+  uint32_t esr = CAN->ESR;
+  if (esr & CAN_ESR_EWGF) st |= CANbus::StWarning;
+  if (esr & CAN_ESR_EPVF) st |= CANbus::StPassive;
+  if (esr & CAN_ESR_BOFF) st |= CANbus::StBusError;
+  if (txq_used == txq_depth) st |= CANbus::StTxFull;
+  return st;
+}
+
+
+void CANbus::errors (Errors &err)
+{
+  uint32_t esr = CAN->ESR;
+  err.TEC = (esr & CAN_ESR_TEC) >> 16;
+  err.REC = (esr & CAN_ESR_REC) >> 24;
+  err.LEC = last_lec;
+  err.State = esr & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+  for (uint32_t i = 0; i < 7; i++) err.Count[i] = lec_cnt[i];
+}
+
+
+uint32_t CANbus::overruns (void)
+{
+  return overrun_cnt;
+}
+
+
+void CANbus::rx_stats (uint32_t& used, uint32_t& peak, uint32_t& dropped)
+{
+  used = rxring.size();
+  peak = rxring.high_water();
+  dropped = rx_dropped;
+}
+
 
+void CANbus::rx_clear_stats (void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  rxring.clear_stats();
+  rx_dropped = 0;
+  __set_PRIMASK(primask);
+}
+
+
+// Bits in the order they are sent: base id, RTR or SRR, IDE, extended id,
+// RTR. Dominant is 0, so the lower key wins arbitration.
+static inline uint32_t arb_key (const TxMsg& msg)
+{
+  uint32_t rtr = (msg.RTR) ? 1 : 0;
+  if (msg.IDE)
+  {
+    return ((msg.Id >> 18) & 0x7FF) << 21 | 3 << 19 | (msg.Id & 0x3FFFF) << 1 | rtr;
+  }
+  return (msg.Id & 0x7FF) << 21 | rtr << 20;
+}
+
+
+static inline uint32_t tir_value (const TxMsg& msg)
+{
+  uint32_t tmp;
+  tmp = msg.Id << (msg.IDE ? 3 : 21);
+  tmp |= msg.IDE ? CAN_TI0R_IDE : 0;
+  tmp |= msg.RTR ? CAN_TI0R_RTR : 0;
+  return tmp;
+}
+
+
+static inline bool txq_before (const TxEntry& a, const TxEntry& b)
+{
+  return (a.key != b.key) ? (a.key < b.key) : (static_cast<int32_t>(a.seq - b.seq) < 0);
+}
+
+
+static void txq_push (const TxMsg& msg)
+{
+  uint32_t i = txq_used;
+  TxEntry e;
+  e.msg = msg;
+  e.key = (txpolicy == TxPolicy::Priority) ? arb_key(msg) : 0;
+  e.seq = txq_seq++;
+  while (i > 0)
+  {
+    uint32_t parent = (i - 1) / 2;
+    if (!txq_before(e, txq[parent])) break;
+    txq[i] = txq[parent];
+    i = parent;
+  }
+  txq[i] = e;
+  txq_used = txq_used + 1;
+}
+
+
+static void txq_pop (void)
+{
+  uint32_t n = txq_used - 1;
+  uint32_t i = 0;
+  const TxEntry& last = txq[n];
+  for (;;)
+  {
+    uint32_t child = 2*i + 1;
+    if (child >= n) break;
+    if (child + 1 < n && txq_before(txq[child + 1], txq[child])) child++;
+    if (!txq_before(txq[child], last)) break;
+    txq[i] = txq[child];
+    i = child;
+  }
+  txq[i] = last;
+  txq_used = n;
+}
+
+
+// Mailboxes with equal identifiers go out lowest number first: a frame must
+// not overtake an earlier one with the same identifier.
+static inline bool tx_pending_id (uint32_t tir)
+{
+  static const uint32_t tme[3] = {CAN_TSR_TME0, CAN_TSR_TME1, CAN_TSR_TME2};
+  uint32_t tsr = CAN->TSR;
+  for (uint32_t mb = 0; mb < 3; mb++)
+  {
+    if (!(tsr & tme[mb]) && (CAN->sTxMailBox[mb].TIR & ~CAN_TI0R_TXRQ) == tir) return true;
+  }
+  return false;
+}
+
+
+// Moves queued frames into free mailboxes. Runs in the CAN interrupt or with
+// it masked.
+static void tx_refill (void)
+{
+  while (txq_used != 0 && (CAN->TSR & CAN_TSR_TME))
+  {
+    const TxMsg& msg = txq[0].msg;
+    uint32_t tir = tir_value(msg);
+    if (txpolicy == TxPolicy::Priority && tx_pending_id(tir)) break;
+
+    uint32_t mb = (CAN->TSR & CAN_TSR_CODE) >> 24;
     CAN->sTxMailBox[mb].TDTR = msg.DLC;
     CAN->sTxMailBox[mb].TDLR = msg.Data32[0];
     CAN->sTxMailBox[mb].TDHR = msg.Data32[1];
+    CAN->sTxMailBox[mb].TIR = tir | CAN_TI0R_TXRQ;
+    txmb[mb] = msg;
+    txq_pop();
 
-    uint32_t tmp;
-    tmp = msg.Id << (msg.IDE ? 3 : 21);
-    tmp |= msg.IDE ? CAN_TI0R_IDE : 0;
-    tmp |= msg.RTR ? CAN_TI0R_RTR : 0;
-    CAN->sTxMailBox[mb].TIR = tmp | CAN_TI0R_TXRQ;
-    
     timled.tx_blink(5);
+  }
+}
+
+
+Status CANbus::send (TxMsg &msg)
+{
+  Status result = Status::Error;
+  
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (isopen && txq_used < txq_depth)
+  {
+    txq_push(msg);
+    if (txq_used > txq_peak) txq_peak = txq_used;
+    tx_refill();
+    result = Status::Ok;
+  }
+  else if (isopen)
+  {
+    status_flags = status_flags | CANbus::StTxFull;
+    txq_rejected = txq_rejected + 1;
+  }
+  __set_PRIMASK(primask);
+
+  return result;
+}
+
+
+// Keys are fixed when a frame is queued, so the policy changes only while
+// the queue is empty. Frames already in the mailboxes are not reordered.
+Status CANbus::tx_policy (TxPolicy policy)
+{
+  Status result = Status::Error;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (txq_used == 0)
+  {
+    txpolicy = policy;
+    if (policy == TxPolicy::Fifo)
+    {
+      CAN->MCR |= CAN_MCR_TXFP;
+    }
+    else
+    {
+      CAN->MCR &= ~(uint32_t)CAN_MCR_TXFP;
+    }
     result = Status::Ok;
   }
+  __set_PRIMASK(primask);
 
   return result;
 }
 
 
+TxPolicy CANbus::tx_policy (void)
+{
+  return txpolicy;
+}
+
+
+uint32_t CANbus::tx_depth (void)
+{
+  return txq_depth;
+}
+
+
+uint32_t CANbus::tx_used (void)
+{
+  return txq_used;
+}
+
+
+uint32_t CANbus::tx_peak (void)
+{
+  return txq_peak;
+}
+
+
+uint32_t CANbus::tx_rejected (void)
+{
+  return txq_rejected;
+}
+
+
+void CANbus::tx_clear_stats (void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  txq_peak = txq_used;
+  txq_rejected = 0;
+  __set_PRIMASK(primask);
+}
+
+
 Status CANbus::set_rx_cb(RxCallback cb)
 {
   Status result = Status::Error;
@@ -187,27 +607,314 @@ Status CANbus::set_rx_cb(RxCallback cb)
 }
 
 
+Status CANbus::set_tx_cb(TxCallback cb)
+{
+  Status result = Status::Error;
+  if (cb != nullptr)
+  {
+    tx_cb = cb;
+    result = Status::Ok;
+  }
+  return result;
+}
+
+
+Status CANbus::set_sent_cb(SentCallback cb)
+{
+  Status result = Status::Error;
+  if (cb != nullptr)
+  {
+    sent_cb = cb;
+    result = Status::Ok;
+  }
+  return result;
+}
+
+
+Status CANbus::set_event_cb(EventCallback cb)
+{
+  Status result = Status::Error;
+  if (cb != nullptr)
+  {
+    event_cb = cb;
+    result = Status::Ok;
+  }
+  return result;
+}
+
+
+// Queues an entry for poll(). After a loss nothing goes in before an
+// Overrun event marking where it happened.
+static bool rx_push (const RxRaw& e)
+{
+  if (rx_lost != 0 && rxring.space() >= 2)
+  {
+    RxRaw ovr;
+    ovr.Kind = Entry::Event;
+    ovr.Code = static_cast<uint8_t>(CANbus::Event::Overrun);
+    ovr.Lost = rx_lost;
+    rxring.push(ovr);
+    rx_lost = 0;
+  }
+  if (rx_lost == 0 && rxring.push(e)) return true;
+
+  rx_lost = rx_lost + 1;
+  rx_dropped = rx_dropped + 1;
+  return false;
+}
+
+
+// Reports the mailboxes completed in tsr, in the order they went out
+static void tx_done (uint32_t tsr)
+{
+  if (tx_cb == nullptr && sent_cb == nullptr) return;
+
+  uint32_t now = timus.value();
+  uint32_t ms = timled.value();
+  uint32_t mbs[3];
+  uint16_t stamp[3];
+  uint32_t n = 0;
+  for (uint32_t mb = 0; mb < 3; mb++)
+  {
+    uint32_t st = tsr >> (8*mb);  // RQCP, TXOK, ALST, TERR of mailbox mb in bits 0-3
+    if (!(st & CAN_TSR_RQCP0)) continue;
+    uint32_t i = n++;
+    stamp[mb] = CAN->sTxMailBox[mb].TDTR >> 16;
+    while (i > 0 && static_cast<int16_t>(stamp[mb] - stamp[mbs[i - 1]]) < 0)
+    {
+      mbs[i] = mbs[i - 1];
+      i--;
+    }
+    mbs[i] = mb;
+  }
+
+  for (uint32_t i = 0; i < n; i++)
+  {
+    uint32_t mb = mbs[i];
+    uint32_t st = tsr >> (8*mb);
+    const TxMsg& msg = txmb[mb];
+    TxResult result = (st & CAN_TSR_TXOK0) ? TxResult::Ok :
+                      (st & CAN_TSR_ALST0) ? TxResult::ArbitrationLost :
+                      (st & CAN_TSR_TERR0) ? TxResult::Error : TxResult::Aborted;
+    if (st & CAN_TSR_ALST0) status_flags = status_flags | CANbus::StArbLost;
+
+    uint32_t bus = now;   // SOF of the frame when sent, else the completion
+    if (result == TxResult::Ok && (timestamping == TimeStamp::Micro || msg.Origin != 0))
+    {
+      bus = sof_time(stamp[mb], now, frame_bits(msg.IDE, msg.RTR, msg.DLC));
+    }
+    if (msg.Origin != 0 && sent_cb != nullptr) sent_cb(msg, result, bus);
+    if (tx_cb == nullptr) continue;
+
+    RxRaw e;
+    e.Kind = Entry::TxDone;
+    e.Code = static_cast<uint8_t>(result);
+    e.RIR = tir_value(msg);
+    e.RDTR = msg.DLC;
+    e.RDLR = msg.Data32[0];
+    e.RDHR = msg.Data32[1];
+    e.Tag = msg.Tag;
+    e.Time = (timestamping == TimeStamp::Micro) ? bus : ms;
+    rx_push(e);
+  }
+}
+
+
+static inline void report (CANbus::Event ev)
+{
+  if (event_cb != nullptr)
+  {
+    RxRaw e;
+    e.Kind = Entry::Event;
+    e.Code = static_cast<uint8_t>(ev);
+    e.Lost = 1;
+    rx_push(e);
+  }
+}
+
+
+// Error interrupts fire when a state is entered, not when it is left (bus-off
+// recovery, counters going down): the state is compared on every interrupt.
+static void check_errors (void)
+{
+  if (CAN->MSR & CAN_MSR_ERRI)
+  {
+    CAN->MSR = CAN_MSR_ERRI;  // clear on 1, other bits ignore it
+    uint32_t lec = (CAN->ESR & CAN_ESR_LEC) >> 4;
+    if (lec != 0 && lec != 7)
+    {
+      CAN->ESR = CAN_ESR_LEC;  // 7 is never set by hardware: the next error shows as a change
+      lec_cnt[lec] = lec_cnt[lec] + 1;
+      last_lec = lec;
+      status_flags = status_flags | CANbus::StBusError;
+      report(CANbus::Event::BusError);
+    }
+  }
+
+  uint32_t state = CAN->ESR & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+  if (state != esr_state)
+  {
+    uint32_t entered = state & ~esr_state;
+    esr_state = state;
+    if (entered & CAN_ESR_EWGF) status_flags = status_flags | CANbus::StWarning;
+    if (entered & CAN_ESR_EPVF) status_flags = status_flags | CANbus::StPassive;
+    if (entered & CAN_ESR_BOFF) status_flags = status_flags | CANbus::StBusError;
+    report((state & CAN_ESR_BOFF) ? CANbus::Event::BusOff :
+           (state & CAN_ESR_EPVF) ? CANbus::Event::Passive :
+           (state & CAN_ESR_EWGF) ? CANbus::Event::Warning : CANbus::Event::Active);
+  }
+}
+
+
 void CEC_CAN_IRQHandler (void)
 {
-  
-  // TODO: add error handling
+  check_errors();
 
-  if (CAN->RF0R & CAN_RF0R_FMP0)
+  // A mailbox has completed (sent, lost or aborted): report and refill it
+  uint32_t tsr = CAN->TSR;
+  uint32_t rqcp = tsr & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2);
+  if (rqcp)
   {
-    RxMsg msg;
-    msg.Time = timled.value();
-    msg.IDE = (CAN->sFIFOMailBox[0].RIR & CAN_RI0R_IDE) ? true : false;
-    msg.Id = CAN->sFIFOMailBox[0].RIR >> ((msg.IDE) ? 3 : 21);
-    msg.RTR = (CAN->sFIFOMailBox[0].RIR & CAN_RI0R_RTR) ? true : false;
-    msg.DLC = CAN->sFIFOMailBox[0].RDTR & CAN_RDT0R_DLC;
-    msg.Data32[0] = CAN->sFIFOMailBox[0].RDLR;
-    msg.Data32[1] = CAN->sFIFOMailBox[0].RDHR;
-
-    CAN->RF0R |= CAN_RF0R_RFOM0;
+    tx_done(tsr);
+    CAN->TSR = rqcp;  // clear on 1, also clears TXOK/ALST/TERR of the mailbox
+    tx_refill();
+  }
+
+  // FIFO0 is 3 deep: once full, a new frame overwrites the last one, so the
+  // lost frame came after the first two mailboxes. Reported there, the loss
+  // shows in the stream where the frame is missing.
+  uint32_t rf0r = CAN->RF0R;
+  int32_t lost_after = -1;
+  if (rf0r & CAN_RF0R_FOVR0)
+  {
+    CAN->RF0R = CAN_RF0R_FOVR0;  // FULL0/FOVR0 clear on 1, RFOM0 ignores 0
+    overrun_cnt = overrun_cnt + 1;
+    status_flags = status_flags | CANbus::StOverrun | CANbus::StRxFull;
+    lost_after = 2;
+  }
+  if (rf0r & CAN_RF0R_FULL0)
+  {
+    CAN->RF0R = CAN_RF0R_FULL0;
+    status_flags = status_flags | CANbus::StRxFull;
+  }
+
+  // Drain everything pending, a burst must not wait for one interrupt per frame.
+  // Frames are only copied here, poll() decodes them in the main loop.
+  while (CAN->RF0R & CAN_RF0R_FMP0)
+  {
+    if (lost_after-- == 0) report(CANbus::Event::Overrun);
+
+    RxRaw raw;
+    uint32_t now = timus.value();
+    raw.RIR = CAN->sFIFOMailBox[0].RIR;
+    bool ide = (raw.RIR & CAN_RI0R_IDE) ? true : false;
+    if (!CANFilter::accept(raw.RIR >> ((ide) ? 3 : 21), ide))
+    {
+      CAN->RF0R = CAN_RF0R_RFOM0;
+      while (CAN->RF0R & CAN_RF0R_RFOM0);
+      continue;
+    }
+
+    uint32_t rdtr = CAN->sFIFOMailBox[0].RDTR;
+    raw.RDLR = CAN->sFIFOMailBox[0].RDLR;
+    raw.RDHR = CAN->sFIFOMailBox[0].RDHR;
+    CAN->RF0R = CAN_RF0R_RFOM0;
+
+    // The SOF anchor is shared with TX completions: it must see frames in order
+    if (timestamping == TimeStamp::Micro)
+    {
+      bool rtr = (raw.RIR & CAN_RI0R_RTR) ? true : false;
+      raw.Time = sof_time(rdtr >> 16, now, frame_bits(ide, rtr, rdtr & CAN_RDT0R_DLC));
+    }
+    else
+    {
+      raw.Time = timled.value();
+    }
+    raw.RDTR = rdtr;
+    raw.Now = now;
+    raw.Kind = Entry::Frame;
+    if (!rx_push(raw))
+    {
+      overrun_cnt = overrun_cnt + 1;
+      status_flags = status_flags | CANbus::StOverrun;
+    }
+
+    while (CAN->RF0R & CAN_RF0R_RFOM0);  // FMP0 is updated once the mailbox is released
     timled.rx_blink(5);
+  }
+  if (lost_after >= 0) report(CANbus::Event::Overrun);
+}
+
+
+// A loss with no later entry to carry its Overrun, taken once rxring is empty
+static uint32_t rx_lost_at_end (void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t lost = (rxring.empty()) ? rx_lost : 0;
+  rx_lost = rx_lost - lost;
+  __set_PRIMASK(primask);
+  return lost;
+}
+
+
+// Decodes what the interrupt has queued and calls the callbacks with
+// interrupts enabled, in the order the interrupt saw things happen
+void CANbus::poll (void)
+{
+  RxRaw raw;
+  for (;;)
+  {
+    if (!rxring.pop(raw))
+    {
+      raw.Lost = rx_lost_at_end();
+      if (raw.Lost == 0) return;
+      raw.Kind = Entry::Event;
+      raw.Code = static_cast<uint8_t>(CANbus::Event::Overrun);
+    }
+
+    if (raw.Kind == Entry::Event)
+    {
+      uint32_t n = (raw.Code == static_cast<uint8_t>(CANbus::Event::Overrun)) ? raw.Lost : 1;
+      for (uint32_t i = 0; i < n && event_cb != nullptr; i++)
+      {
+        event_cb(static_cast<CANbus::Event>(raw.Code));
+      }
+      continue;
+    }
+
+    bool ide = (raw.RIR & CAN_RI0R_IDE) ? true : false;
+    bool rtr = (raw.RIR & CAN_RI0R_RTR) ? true : false;
+    uint32_t id = raw.RIR >> ((ide) ? 3 : 21);
+    if (raw.Kind == Entry::TxDone)
+    {
+      TxDone done;
+      done.Msg.IDE = ide;
+      done.Msg.RTR = rtr;
+      done.Msg.Id = id;
+      done.Msg.DLC = raw.RDTR & CAN_TDT0R_DLC;
+      done.Msg.Data32[0] = raw.RDLR;
+      done.Msg.Data32[1] = raw.RDHR;
+      done.Msg.Tag = raw.Tag;
+      done.Time = raw.Time;
+      done.Result = static_cast<TxResult>(raw.Code);
+      if (tx_cb != nullptr) tx_cb(done);
+      continue;
+    }
+
+    RxMsg msg;
+    msg.IDE = ide;
+    msg.RTR = rtr;
+    msg.Id = id;
+    msg.DLC = raw.RDTR & CAN_RDT0R_DLC;
+    msg.Time = raw.Time;
+    msg.Arrival = raw.Now;
+    msg.Data32[0] = raw.RDLR;
+    msg.Data32[1] = raw.RDHR;
     if (rx_cb != nullptr)
     {
       rx_cb(msg);
     }
+    Latency::add(Latency::Rx, raw.Now);
   }
 }
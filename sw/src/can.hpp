@@ -1,6 +1,8 @@
 #ifndef _CAN_HPP_
 #define _CAN_HPP_
 
+#include "canfilter.hpp"
+
 namespace CANbus
 {
   template<uint32_t SJW, uint32_t TS2, uint32_t TS1, uint32_t BRP>
@@ -27,6 +29,34 @@ namespace CANbus
   };
   enum class Status : uint8_t     { Ok, Error };
   enum class OpenMode : uint8_t   { Normal, LoopBack, ListenOnly };
+  enum class TimeStamp : uint8_t  { Off, Milli, Micro };  // Milli: 16-bit, wraps at 60000; Micro: 32-bit at SOF
+  enum class TxPolicy : uint8_t   { Fifo, Priority };       // Priority: lowest identifier first
+  enum class TxResult : uint8_t   { Ok, ArbitrationLost, Error, Aborted };
+  enum class Event : uint8_t      { Overrun, BusError, Warning, Passive, BusOff, Active };
+  // Overrun: a frame, or a TX or event report, was lost right before this point;
+  // BusError: error frame, see errors(); Warning, Passive, BusOff: error state
+  // entered; Active: back to error active
+
+  // Latched conditions, in the bit layout of the LAWICEL 'F' reply
+  enum StatusFlags : uint8_t
+  {
+    StRxFull    = 0x01,   // RX FIFO full
+    StTxFull    = 0x02,   // TX queue full
+    StWarning   = 0x04,   // error warning
+    StOverrun   = 0x08,   // RX FIFO overrun
+    StPassive   = 0x20,   // error passive
+    StArbLost   = 0x40,   // arbitration lost
+    StBusError  = 0x80    // bus error or bus-off
+  };
+
+  typedef struct
+  {
+    uint8_t TEC;
+    uint8_t REC;
+    uint8_t LEC;          // last error code: 1 stuff, 2 form, 3 ack, 4 bit recessive, 5 bit dominant, 6 CRC
+    uint8_t State;        // ESR EWGF, EPVF, BOFF
+    uint32_t Count[7];    // error frames by LEC, [0] unused
+  } Errors;
 
   typedef struct
   {
@@ -37,6 +67,8 @@ namespace CANbus
       uint8_t  Data8[8];
       uint32_t Data32[2];
     };
+    uint32_t Tag;   // handed back in TxDone
+    uint8_t Origin; // 0: the host, else 1 + the index of the cyclic message
     bool IDE;
     bool RTR;
   } TxMsg;
@@ -50,23 +82,54 @@ namespace CANbus
       uint8_t  Data8[8];
       uint32_t Data32[2];
     };
-    uint16_t Time;
+    uint32_t Time;
+    uint32_t Arrival;   // time_us() when the interrupt took the frame out of FIFO0
     bool IDE;
     bool RTR;
   } RxMsg;
 
+  typedef struct
+  {
+    TxMsg Msg;
+    uint32_t Time;      // SOF of the frame on the bus when Ok, else completion time
+    TxResult Result;    // ArbitrationLost, Error: the last attempt before the request ended
+  } TxDone;
+
   typedef void (*RxCallback) (CANbus::RxMsg &msg);
+  typedef void (*TxCallback) (CANbus::TxDone &done);
+  typedef void (*EventCallback) (CANbus::Event ev);
+  typedef void (*SentCallback) (const CANbus::TxMsg &msg, CANbus::TxResult result, uint32_t time);
   
   Status init (void);
   Status bitrate (Bitrate br);
   Status bitrate (uint32_t btr); 
   Status open (OpenMode mode);
   Status close (void);
+  bool is_open (void);
   Status send (TxMsg &msg);
-  Status set_rx_cb(RxCallback cb);
+  Status tx_policy (TxPolicy policy);
+  TxPolicy tx_policy (void);
+  uint32_t tx_depth (void);
+  uint32_t tx_used (void);
+  uint32_t tx_peak (void);          // most frames queued since tx_clear_stats()
+  uint32_t tx_rejected (void);      // frames refused because the queue was full
+  void tx_clear_stats (void);
+  Status set_rx_cb(RxCallback cb);   // called from poll(), not from the interrupt
+  void poll (void);                  // main loop: hands frames, TX completions and events to the callbacks
+  Status set_event_cb(EventCallback cb);  // called from poll() as well, in order with the frames
+  Status set_tx_cb(TxCallback cb);        // likewise
+  Status set_sent_cb(SentCallback cb);    // from the CAN interrupt, for frames with an Origin; time: SOF in time_us()
   Status filtermask (uint32_t msk);
   Status filtercode (uint32_t code);
-  Status timestamp (bool state);
-  bool timestamp (void); 
+  Status filters (const CANFilter::Bank* banks, uint32_t n);
+  Status timestamp (TimeStamp mode);
+  TimeStamp timestamp (void); 
+  uint32_t time_us (void);
+  uint32_t time (void);
+  uint8_t status (void);
+  void errors (Errors &err);
+  uint32_t overruns (void);
+  void rx_stats (uint32_t& used, uint32_t& peak, uint32_t& dropped);  // entries waiting for poll()
+  void rx_clear_stats (void);
 };
 #endif // _CAN_HPP_
@@ -0,0 +1,451 @@
+#include <string.h>
+
+#include "canfilter.hpp"
+
+using CANFilter::Bank;
+
+
+typedef struct
+{
+  uint32_t value;
+  uint32_t mask;
+} Rule;
+
+enum Kind : uint8_t
+{
+  List16,   // standard identifier:  4 per bank
+  Mask16,   // standard mask:        2 per bank
+  List32,   // extended identifier:  2 per bank
+  Mask32    // anything else:        1 per bank
+};
+
+static const uint32_t IDE = 0x00000004;
+static const uint32_t RTR = 0x00000002;
+static const uint32_t EXID = 0x001FFFF8;
+static const uint32_t StdBits = 0xFFE00006;   // STID, IDE, RTR
+static const uint32_t AllBits = 0xFFFFFFFE;
+
+// The stack is 512 bytes: everything compile() works on is static
+static Rule subs[CANFilter::MaxRules];
+static uint32_t nrules = 0;
+static bool empty = true;     // nothing subscribed, not even rules that never match
+static Rule work[CANFilter::MaxRules];
+static uint8_t idx[CANFilter::MaxRules];
+
+// Software stage: written by the main loop, read by the RX interrupt. An
+// entry is a single word store, so the interrupt sees it either whole or not.
+static const uint32_t Used = 0x80000000;    // extended identifiers are 29 bits
+static uint32_t std_map[2048 / 32];
+static uint32_t ext_set[CANFilter::ExtSlots];
+static volatile bool soft_on = false;
+static volatile uint32_t n_accepted = 0;
+static volatile uint32_t n_rejected = 0;
+
+
+static inline uint32_t pack (uint32_t id, bool ide)
+{
+  return (ide) ? ((id << 3) | IDE) : (id << 21);
+}
+
+
+static inline bool is_std (const Rule& r)
+{
+  return (r.mask & IDE) && !(r.value & IDE);
+}
+
+
+static inline Kind kind (const Rule& r)
+{
+  if (is_std(r)) return (r.mask == StdBits) ? List16 : Mask16;
+  return (r.mask == AllBits) ? List32 : Mask32;
+}
+
+
+// log2 of the number of frame headers the rule passes
+static inline uint32_t freedom (const Rule& r)
+{
+  return __builtin_popcount(((is_std(r)) ? StdBits : AllBits) & ~r.mask);
+}
+
+
+static inline bool covers (const Rule& outer, const Rule& inner)
+{
+  return !(outer.mask & ~inner.mask) && !((outer.value ^ inner.value) & outer.mask);
+}
+
+
+static inline Rule merge (const Rule& a, const Rule& b)
+{
+  Rule r;
+  r.mask = a.mask & b.mask & ~(a.value ^ b.value);
+  r.value = a.value & r.mask;
+  return r;
+}
+
+
+// A standard frame carries no extended identifier: its bits compare as 0
+static bool add (uint32_t value, uint32_t mask)
+{
+  empty = false;
+  mask &= AllBits;
+  value &= mask;
+  if ((mask & IDE) && !(value & IDE))
+  {
+    if (value & EXID) return true;  // can never match
+    mask &= ~EXID;
+  }
+  if (nrules >= CANFilter::MaxRules) return false;
+  subs[nrules].value = value;
+  subs[nrules].mask = mask;
+  nrules++;
+  return true;
+}
+
+
+void CANFilter::clear (void)
+{
+  nrules = 0;
+  empty = true;
+}
+
+
+uint32_t CANFilter::rules (void)
+{
+  return nrules;
+}
+
+
+bool CANFilter::add_id (uint32_t id, bool ide, bool rtr)
+{
+  return add_range(id, id, ide, rtr);
+}
+
+
+// Split into aligned power-of-two blocks, one mask rule each
+bool CANFilter::add_range (uint32_t first, uint32_t last, bool ide, bool rtr)
+{
+  uint32_t top = (ide) ? 0x1FFFFFFF : 0x7FF;
+  if (first > last || last > top) return false;
+
+  for (uint32_t pass = 0; pass < 2; pass++)
+  {
+    uint32_t id = first;
+    uint32_t count = 0;
+    for (;;)
+    {
+      uint32_t size = (id == 0) ? (top + 1) : (id & (~id + 1));
+      while (size - 1 > last - id) size >>= 1;
+      if (pass == 0)
+      {
+        count++;
+      }
+      else
+      {
+        add(pack(id, ide) | ((rtr) ? RTR : 0), pack(top & ~(size - 1), ide) | IDE | RTR);
+      }
+      if (size - 1 == last - id) break;
+      id += size;
+    }
+    if (pass == 0 && nrules + count > MaxRules) return false;
+  }
+  return true;
+}
+
+
+bool CANFilter::add_mask (uint32_t code, uint32_t mask)
+{
+  return add(code, mask);
+}
+
+
+// Banks needed for work[0..n), spill is how many standard identifiers go
+// into free 16-bit mask slots instead of a list bank of their own
+static uint32_t layout (uint32_t n, uint32_t& spill)
+{
+  uint32_t cnt[4] = {0, 0, 0, 0};
+  for (uint32_t i = 0; i < n; i++) cnt[kind(work[i])]++;
+
+  uint32_t fixed = (cnt[List32] + 1) / 2 + cnt[Mask32];
+  uint32_t keep = (cnt[List16] + 3) / 4 + (cnt[Mask16] + 1) / 2;
+  uint32_t rest = cnt[List16] % 4;
+  uint32_t moved = cnt[List16] / 4 + (cnt[Mask16] + rest + 1) / 2;
+  spill = (moved < keep) ? rest : 0;
+  return fixed + ((moved < keep) ? moved : keep);
+}
+
+
+static inline uint32_t half (uint32_t r)
+{
+  return ((r >> 16) & 0xFFE0) | ((r & RTR) << 3) | ((r & IDE) << 1) | ((r >> 18) & 0x07);
+}
+
+
+// Indices of the rules of one kind, List16 ones past the first l16 go to Mask16
+static uint32_t select (uint32_t n, Kind k, uint32_t l16)
+{
+  uint32_t cnt = 0;
+  uint32_t seen = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    Kind ki = kind(work[i]);
+    if (ki == List16 && seen++ >= l16) ki = Mask16;
+    if (ki == k) idx[cnt++] = i;
+  }
+  return cnt;
+}
+
+
+// Unused slots repeat the last entry
+static uint32_t emit (Bank* banks, uint32_t nb, uint32_t n, Kind k, uint32_t l16)
+{
+  static const uint32_t per_bank[4] = {4, 2, 2, 1};
+  uint32_t cnt = select(n, k, l16);
+  for (uint32_t i = 0; i < cnt; i += per_bank[k])
+  {
+    const Rule* r[4];
+    for (uint32_t j = 0; j < per_bank[k]; j++)
+    {
+      r[j] = &work[idx[(i + j < cnt) ? (i + j) : (cnt - 1)]];
+    }
+
+    Bank& b = banks[nb++];
+    switch (k)
+    {
+      case List16:
+        b.FR1 = half(r[1]->value) << 16 | half(r[0]->value);
+        b.FR2 = half(r[3]->value) << 16 | half(r[2]->value);
+        break;
+      case Mask16:
+        b.FR1 = half(r[0]->mask) << 16 | half(r[0]->value);
+        b.FR2 = half(r[1]->mask) << 16 | half(r[1]->value);
+        break;
+      case List32:
+        b.FR1 = r[0]->value;
+        b.FR2 = r[1]->value;
+        break;
+      case Mask32:
+        b.FR1 = r[0]->value;
+        b.FR2 = r[0]->mask;
+        break;
+    }
+    b.List = (k == List16 || k == List32);
+    b.Wide = (k == List32 || k == Mask32);
+  }
+  return nb;
+}
+
+
+// Drops the rules work[keep] makes redundant
+static uint32_t prune (uint32_t n, uint32_t keep)
+{
+  for (uint32_t i = 0; i < n; )
+  {
+    if (i != keep && covers(work[keep], work[i]))
+    {
+      work[i] = work[--n];
+      if (keep == n) keep = i;
+    }
+    else
+    {
+      i++;
+    }
+  }
+  return n;
+}
+
+
+// Whether subs[] pass every frame r passes. r is split on a bit some
+// overlapping rule fixes until each part is covered or meets no rule; a
+// part is pushed per bit fixed, so the stack never holds more than 32.
+static bool exact (const Rule& r)
+{
+  static Rule stack[32];
+  uint32_t sp = 0;
+  stack[sp++] = r;
+  while (sp != 0)
+  {
+    Rule p = stack[--sp];
+    if ((p.mask & IDE) && !(p.value & IDE))
+    {
+      if (p.value & EXID) continue;   // no such standard frame
+      p.mask |= EXID;
+    }
+
+    const Rule* part = nullptr;   // overlaps p, does not cover it
+    bool covered = false;
+    for (uint32_t i = 0; i < nrules && !covered; i++)
+    {
+      const Rule& s = subs[i];
+      if ((p.value ^ s.value) & p.mask & s.mask) continue;
+      covered = covers(s, p);
+      part = &s;
+    }
+    if (covered) continue;
+    if (part == nullptr) return false;
+
+    uint32_t bit = part->mask & ~p.mask;
+    bit &= ~bit + 1;
+    p.mask |= bit;
+    stack[sp].value = p.value | bit;
+    stack[sp++].mask = p.mask;
+    stack[sp].value = p.value;
+    stack[sp++].mask = p.mask;
+  }
+  return true;
+}
+
+
+uint32_t CANFilter::compile (Bank* banks, bool& loose)
+{
+  loose = false;
+  if (nrules == 0 && !empty) return 0;
+  if (nrules == 0)
+  {
+    banks[0].FR1 = 0;
+    banks[0].FR2 = 0;
+    banks[0].List = false;
+    banks[0].Wide = true;
+    return 1;
+  }
+
+  uint32_t n = nrules;
+  for (uint32_t i = 0; i < n; i++) work[i] = subs[i];
+  for (uint32_t i = 0; i < n; i++) n = prune(n, i);
+
+  // Too many: merge the pair whose union lets through the fewest extra
+  // frames until everything fits
+  uint32_t spill;
+  while (layout(n, spill) > Banks)
+  {
+    uint32_t best_i = 0;
+    uint32_t best_j = 1;
+    uint32_t best = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < n; i++)
+    {
+      for (uint32_t j = i + 1; j < n; j++)
+      {
+        uint32_t f = freedom(merge(work[i], work[j]));
+        if (f < best)
+        {
+          best = f;
+          best_i = i;
+          best_j = j;
+        }
+      }
+    }
+    work[best_i] = merge(work[best_i], work[best_j]);
+    work[best_j] = work[--n];
+    n = prune(n, best_i);
+    loose = true;
+  }
+
+  // A merge lets more through only if the union was no pattern already
+  if (loose)
+  {
+    loose = false;
+    for (uint32_t i = 0; i < n && !loose; i++) loose = !exact(work[i]);
+  }
+
+  uint32_t l16 = 0;
+  for (uint32_t i = 0; i < n; i++) l16 += (kind(work[i]) == List16) ? 1 : 0;
+  l16 -= spill;
+
+  uint32_t nb = 0;
+  nb = emit(banks, nb, n, List16, l16);
+  nb = emit(banks, nb, n, Mask16, l16);
+  nb = emit(banks, nb, n, List32, l16);
+  nb = emit(banks, nb, n, Mask32, l16);
+  return nb;
+}
+
+
+static inline uint32_t ext_hash (uint32_t id)
+{
+  return (id * 0x9E3779B1) >> 25;   // Fibonacci hashing onto 128 slots
+}
+
+static_assert (CANFilter::ExtSlots == 128 && CANFilter::ExtProbes == 4,
+               "ext_hash() and accept() assume 128 slots and 4 probes!");
+
+
+void CANFilter::soft_enable (bool on)
+{
+  soft_on = on;
+}
+
+
+void CANFilter::soft_clear (void)
+{
+  memset(std_map, 0, sizeof(std_map));
+  memset(ext_set, 0, sizeof(ext_set));
+  n_accepted = 0;
+  n_rejected = 0;
+}
+
+
+bool CANFilter::soft_add (uint32_t id, bool ide)
+{
+  if (!ide)
+  {
+    if (id > 0x7FF) return false;
+    std_map[id >> 5] |= 1u << (id & 31);
+    return true;
+  }
+
+  if (id > 0x1FFFFFFF) return false;
+  uint32_t h = ext_hash(id);
+  for (uint32_t i = 0; i < ExtProbes; i++)
+  {
+    uint32_t& slot = ext_set[(h + i) & (ExtSlots - 1)];
+    if (slot == (id | Used)) return true;
+    if (slot == 0)
+    {
+      slot = id | Used;
+      return true;
+    }
+  }
+  return false;   // neighbourhood full
+}
+
+
+bool CANFilter::accept (uint32_t id, bool ide)
+{
+  if (!soft_on) return true;
+
+  bool ok;
+  if (!ide)
+  {
+    ok = (std_map[(id >> 5) & 0x3F] >> (id & 31)) & 1;
+  }
+  else
+  {
+    uint32_t key = id | Used;
+    uint32_t h = ext_hash(id);
+    ok = (ext_set[h] == key) |
+         (ext_set[(h + 1) & (ExtSlots - 1)] == key) |
+         (ext_set[(h + 2) & (ExtSlots - 1)] == key) |
+         (ext_set[(h + 3) & (ExtSlots - 1)] == key);
+  }
+
+  if (ok)
+  {
+    n_accepted = n_accepted + 1;
+  }
+  else
+  {
+    n_rejected = n_rejected + 1;
+  }
+  return ok;
+}
+
+
+uint32_t CANFilter::accepted (void)
+{
+  return n_accepted;
+}
+
+
+uint32_t CANFilter::rejected (void)
+{
+  return n_rejected;
+}
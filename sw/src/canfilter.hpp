@@ -0,0 +1,49 @@
+#ifndef _CANFILTER_HPP_
+#define _CANFILTER_HPP_
+
+#include <stdint.h>
+
+// Acceptance filter compiler. The host builds a subscription out of single
+// identifiers, identifier ranges and raw masks, compile() packs it into the
+// bxCAN filter banks. Rules are kept in the 32-bit filter register layout
+// (STID[10:0] EXID[17:0] IDE RTR 0), mask bits set must match.
+namespace CANFilter
+{
+  static const uint32_t Banks = 14;
+  static const uint32_t MaxRules = 64;
+
+  typedef struct
+  {
+    uint32_t FR1;
+    uint32_t FR2;
+    bool List;    // identifier list, else identifier mask
+    bool Wide;    // single 32-bit scale, else dual 16-bit
+  } Bank;
+
+  void clear (void);
+  bool add_id (uint32_t id, bool ide, bool rtr);
+  bool add_range (uint32_t first, uint32_t last, bool ide, bool rtr);
+  bool add_mask (uint32_t code, uint32_t mask);
+  uint32_t rules (void);
+
+  // Fills banks[Banks], returns the number used. loose is set when the banks
+  // let more frames through than asked for, which only happens when rules
+  // had to be merged into wider masks to fit. An empty subscription accepts
+  // everything, 0 banks nothing.
+  uint32_t compile (Bank* banks, bool& loose);
+
+  // Software acceptance behind the banks, for when they had to be widened:
+  // a bitmap of standard identifiers and a hash set of extended ones, looked
+  // up in constant time in the RX interrupt. Off it accepts everything.
+  static const uint32_t ExtSlots = 128;
+  static const uint32_t ExtProbes = 4;    // an identifier lives within 4 slots of its hash
+
+  void soft_enable (bool on);
+  void soft_clear (void);
+  bool soft_add (uint32_t id, bool ide);
+  bool accept (uint32_t id, bool ide);
+  uint32_t accepted (void);
+  uint32_t rejected (void);
+};
+
+#endif // _CANFILTER_HPP_
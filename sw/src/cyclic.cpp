@@ -0,0 +1,201 @@
+#include <string.h>
+
+#include "stm32f0xx.h"
+#include "Timer.hpp"
+#include "cyclic.hpp"
+
+
+extern "C" void TIM6_DAC_IRQHandler (void);
+
+using Cyclic::Stats;
+
+
+// Hashed wheel: a message due in d ms goes into slot (tick + d) % Slots and
+// waits (d - 1) / Slots more turns there
+static const uint32_t Slots = 64;
+static const int8_t None = -1;
+
+typedef struct
+{
+  CANbus::TxMsg msg;
+  uint32_t period;
+  uint32_t rounds;
+  uint32_t last;      // SOF of the last one on the bus, time_us()
+  Stats st;
+  int8_t next;        // next message in the same slot
+  bool used;
+  bool timed;         // last is the previous period's SOF
+} Msg;
+
+static Timer timwheel (TIM6, 48, 1000);  // 1 us ticks, update every 1 ms
+static Msg msgs[Cyclic::MaxMsgs];  // also written by sent() in the CAN interrupt, the main loop masks both
+static int8_t wheel[Slots];
+static uint32_t tick = 0;
+
+
+// With the wheel interrupt masked or from it
+static void schedule (uint32_t idx, uint32_t delay)
+{
+  if (delay == 0) delay = 1;
+  uint32_t slot = (tick + delay) & (Slots - 1);
+  msgs[idx].rounds = (delay - 1) / Slots;
+  msgs[idx].next = wheel[slot];
+  wheel[slot] = idx;
+}
+
+
+static void unlink (uint32_t idx)
+{
+  for (uint32_t s = 0; s < Slots; s++)
+  {
+    for (int8_t* p = &wheel[s]; *p != None; p = &msgs[*p].next)
+    {
+      if (*p == static_cast<int8_t>(idx))
+      {
+        *p = msgs[idx].next;
+        return;
+      }
+    }
+  }
+}
+
+
+// Completion of a cyclic frame, from the CAN interrupt. Periods are taken
+// between SOFs on the bus, so time spent behind other frames in the TX
+// queue shows as jitter.
+static void sent (const CANbus::TxMsg& msg, CANbus::TxResult result, uint32_t time)
+{
+  Msg& m = msgs[msg.Origin - 1];
+  if (!m.used) return;
+
+  if (result != CANbus::TxResult::Ok)
+  {
+    m.timed = false;
+    return;
+  }
+  if (m.timed)
+  {
+    int32_t dev = static_cast<int32_t>((time - m.last) - m.period * 1000);
+    uint32_t jitter = (dev < 0) ? -dev : dev;
+    if (jitter > m.st.Jitter) m.st.Jitter = jitter;
+  }
+  m.last = time;
+  m.timed = true;
+}
+
+
+void Cyclic::init (void)
+{
+  memset(wheel, None, sizeof(wheel));
+  timwheel.init();
+  TIM6->DIER = TIM_DIER_UIE;
+  NVIC_SetPriority(TIM6_DAC_IRQn, 1);   // as CAN: CANbus::send must not preempt the CAN interrupt
+  NVIC_EnableIRQ(TIM6_DAC_IRQn);
+  CANbus::set_sent_cb(sent);
+}
+
+
+// Adding a message at an index in use replaces it
+bool Cyclic::add (uint32_t idx, const CANbus::TxMsg& msg, uint32_t period, uint32_t offset)
+{
+  if (idx >= MaxMsgs || period == 0) return false;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (msgs[idx].used) unlink(idx);
+  msgs[idx].msg = msg;
+  msgs[idx].msg.Origin = idx + 1;
+  msgs[idx].period = period;
+  memset(&msgs[idx].st, 0, sizeof(msgs[idx].st));
+  msgs[idx].used = true;
+  msgs[idx].timed = false;
+  schedule(idx, offset);
+  __set_PRIMASK(primask);
+  return true;
+}
+
+
+// The schedule is left alone: the next transmission carries the new payload
+bool Cyclic::update (uint32_t idx, const uint8_t* data, uint32_t dlc)
+{
+  if (idx >= MaxMsgs || !msgs[idx].used || dlc > 8) return false;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  msgs[idx].msg.DLC = dlc;
+  memcpy(msgs[idx].msg.Data8, data, dlc);
+  __set_PRIMASK(primask);
+  return true;
+}
+
+
+bool Cyclic::remove (uint32_t idx)
+{
+  if (idx >= MaxMsgs || !msgs[idx].used) return false;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  unlink(idx);
+  msgs[idx].used = false;
+  __set_PRIMASK(primask);
+  return true;
+}
+
+
+void Cyclic::clear (void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  memset(wheel, None, sizeof(wheel));
+  for (uint32_t i = 0; i < MaxMsgs; i++) msgs[i].used = false;
+  __set_PRIMASK(primask);
+}
+
+
+bool Cyclic::stats (uint32_t idx, Stats& st)
+{
+  if (idx >= MaxMsgs || !msgs[idx].used) return false;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  st = msgs[idx].st;
+  __set_PRIMASK(primask);
+  return true;
+}
+
+
+void TIM6_DAC_IRQHandler (void)
+{
+  TIM6->SR = ~TIM_SR_UIF;
+  tick++;
+
+  // Detached first: messages due again in a full turn go back into this slot
+  uint32_t slot = tick & (Slots - 1);
+  int8_t i = wheel[slot];
+  wheel[slot] = None;
+  while (i != None)
+  {
+    Msg& m = msgs[i];
+    int8_t next = m.next;
+    if (m.rounds != 0)
+    {
+      m.rounds--;
+      m.next = wheel[slot];
+      wheel[slot] = i;
+    }
+    else
+    {
+      if (CANbus::send(m.msg) == CANbus::Status::Ok)
+      {
+        m.st.Sent++;
+      }
+      else
+      {
+        m.st.Missed++;
+        m.timed = false;
+      }
+      schedule(i, m.period);
+    }
+    i = next;
+  }
+}
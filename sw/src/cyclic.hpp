@@ -0,0 +1,31 @@
+#ifndef _CYCLIC_HPP_
+#define _CYCLIC_HPP_
+
+#include <stdint.h>
+
+#include "can.hpp"
+
+// Cyclic transmission on the device. Messages sit in a timer wheel of 1 ms
+// slots turned by the TIM6 update interrupt, which hands them to
+// CANbus::send when they are due. Periods and offsets are in ms, the jitter
+// is measured from the TX completions.
+namespace Cyclic
+{
+  static const uint32_t MaxMsgs = 16;
+
+  typedef struct
+  {
+    uint32_t Sent;
+    uint32_t Missed;    // due while the TX queue was full or the channel closed
+    uint32_t Jitter;    // largest deviation of a period on the bus, SOF to SOF, from the nominal one, us
+  } Stats;
+
+  void init (void);
+  bool add (uint32_t idx, const CANbus::TxMsg& msg, uint32_t period, uint32_t offset);
+  bool update (uint32_t idx, const uint8_t* data, uint32_t dlc);
+  bool remove (uint32_t idx);
+  void clear (void);
+  bool stats (uint32_t idx, Stats& st);
+};
+
+#endif // _CYCLIC_HPP_
@@ -3,44 +3,78 @@
 
 #include <stdlib.h>
 
+// Single-producer/single-consumer ring. The producer and the consumer may
+// live in different contexts (ISR and main loop): "in" is written only by
+// the producer, "out" only by the consumer, and each index is published
+// after the data it covers. Both indices run freely and are masked on use.
 template <class T, size_t SIZE>
 class FIFO
 {
+  static_assert (SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two!");
+
 private:
+  static constexpr size_t MASK = SIZE - 1;
+
   T buf[SIZE];
-  size_t in;
-  size_t out;
+  volatile size_t in;
+  volatile size_t out;
+  volatile size_t dropped;
+  volatile size_t peak;     // high-water mark, kept by the producer
+
+  // Single core: keeping the compiler from reordering buffer accesses
+  // around the index update is all the ordering that is needed. The host
+  // tests run the two sides on threads, there it takes a real fence.
+#ifdef __arm__
+  static inline void barrier (void) { __asm volatile ("" ::: "memory"); }
+#else
+  static inline void barrier (void) { __atomic_thread_fence(__ATOMIC_ACQ_REL); }
+#endif
 
 public:
-  FIFO (void) : in(0), out(0) {};
-  
-  bool empty (void) const { return (in == out); }
+  FIFO (void) : in(0), out(0), dropped(0), peak(0) {};
 
-  bool full (void) const
+  static constexpr size_t capacity (void) { return SIZE; }
+  size_t size (void) const { return in - out; }
+  size_t space (void) const { return SIZE - size(); }
+  size_t overflows (void) const { return dropped; }
+  size_t high_water (void) const { return peak; }
+
+  // Restarts the high-water mark from the current level and the overflow
+  // count from 0. The producer must not run meanwhile.
+  void clear_stats (void)
   {
-    size_t tmp = (in + 1)%SIZE;
-    return (tmp == out);
+    peak = size();
+    dropped = 0;
   }
-   
-  bool push (T& data)
+
+  bool empty (void) const { return (in == out); }
+  bool full (void) const { return (size() == SIZE); }
+
+  bool push (const T& data)
   {
-    size_t tmp = (in + 1)%SIZE;
-    if (tmp != out)
+    size_t tmp = in;
+    if (tmp - out != SIZE)
     {
-      buf[tmp] = data;
-      in = tmp;
+      barrier();
+      buf[tmp & MASK] = data;
+      barrier();
+      in = tmp + 1;
+      if (tmp + 1 - out > peak) peak = tmp + 1 - out;
       return true;
     }
+    dropped = dropped + 1;
     return false;
   }
 
   bool pop (T& data)
   {
-    if (!empty())
+    size_t tmp = out;
+    if (tmp != in)
     {
-      size_t tmp = (out + 1)%SIZE;
-      data = buf[tmp];
-      out = tmp;
+      barrier();
+      data = buf[tmp & MASK];
+      barrier();
+      out = tmp + 1;
       return true;
     }
     return false;
@@ -48,18 +82,91 @@ public:
 
   bool front (T& data)
   {
-    if (!empty())
+    size_t tmp = out;
+    if (tmp != in)
     {
-      size_t tmp = (out + 1)%SIZE;
-      data = buf[tmp];
+      barrier();
+      data = buf[tmp & MASK];
       return true;
     }
     return false;
   }
 
+  // Pushes as many of len items as fit, the rest is counted as dropped.
+  size_t push_n (const T* data, size_t len)
+  {
+    size_t done = 0;
+    while (done < len)
+    {
+      size_t n;
+      T* dst = reserve(n);
+      if (n == 0) break;
+      if (n > len - done) n = len - done;
+      for (size_t i = 0; i < n; i++) dst[i] = data[done + i];
+      commit(n);
+      done += n;
+    }
+    if (done != len) dropped = dropped + (len - done);
+    return done;
+  }
+
+  size_t pop_n (T* data, size_t len)
+  {
+    size_t done = 0;
+    while (done < len)
+    {
+      size_t n;
+      T* src = peek(n);
+      if (n == 0) break;
+      if (n > len - done) n = len - done;
+      for (size_t i = 0; i < n; i++) data[done + i] = src[i];
+      release(n);
+      done += n;
+    }
+    return done;
+  }
+
+  // Producer side: contiguous free space at the write position. Fill up to
+  // len items, then publish them with commit().
+  T* reserve (size_t& len)
+  {
+    size_t tmp = in;
+    size_t idx = tmp & MASK;
+    size_t n = SIZE - (tmp - out);
+    barrier();
+    len = (n > SIZE - idx) ? (SIZE - idx) : n;
+    return &buf[idx];
+  }
+
+  void commit (size_t n)
+  {
+    barrier();
+    in = in + n;
+    if (in - out > peak) peak = in - out;
+  }
+
+  // Consumer side: contiguous filled space at the read position. Consume up
+  // to len items, then hand them back with release().
+  T* peek (size_t& len)
+  {
+    size_t tmp = out;
+    size_t idx = tmp & MASK;
+    size_t n = in - tmp;
+    barrier();
+    len = (n > SIZE - idx) ? (SIZE - idx) : n;
+    return &buf[idx];
+  }
+
+  void release (size_t n)
+  {
+    barrier();
+    out = out + n;
+  }
+
+  // Consumer side: discard everything queued so far.
   void clear (void)
   {
-    in = out = 0;
+    out = in;
   }
 
 };
@@ -0,0 +1,196 @@
+#include <string.h>
+
+#include "forward.hpp"
+
+using Forward::Mode;
+
+
+typedef struct
+{
+  uint32_t id;        // with IDE in bit 31
+  uint32_t value;     // N, or the period in us
+  uint32_t count;     // frames since the last one passed
+  uint32_t last;      // Arrival of the last one passed
+  uint32_t dropped;
+  Mode mode;
+  bool fresh;         // nothing passed yet
+} Rule;
+
+static const uint32_t IDE = 0x80000000;
+
+// Main loop only: the commands change them, pass() runs from CANbus::poll()
+static Rule rules[Forward::MaxRules];
+static volatile uint32_t nrules = 0;
+
+// Times are RxMsg::Arrival, 32-bit us. They wrap after 71 minutes: an
+// identifier silent for longer may have a repeat held back for up to one
+// heartbeat, or lose its entry out of turn.
+typedef struct
+{
+  uint32_t id;        // with IDE in bit 31, RTR in bit 30, or Free
+  uint8_t data[8];
+  uint32_t sent;      // when the identifier was last passed
+  uint8_t dlc;
+} Entry;
+
+static const uint32_t RTR = 0x40000000;
+static const uint32_t Free = 0xFFFFFFFF;  // identifiers are 29 bits at most
+
+static Entry cache[Forward::CacheSets][Forward::CacheWays];
+static_assert (Forward::CacheSets == 16, "changed() hashes onto 16 sets!");
+static volatile bool cache_on = false;
+static uint32_t heartbeat = 0;      // us
+static volatile uint32_t n_hits = 0;
+static volatile uint32_t n_misses = 0;
+
+
+static inline uint32_t key (uint32_t id, bool ide)
+{
+  return id | ((ide) ? IDE : 0);
+}
+
+
+static Rule* find (uint32_t k)
+{
+  for (uint32_t i = 0; i < nrules; i++)
+  {
+    if (rules[i].id == k) return &rules[i];
+  }
+  return nullptr;
+}
+
+
+void Forward::clear (void)
+{
+  nrules = 0;
+}
+
+
+// A rule for an identifier that has one already replaces it
+bool Forward::add (uint32_t id, bool ide, Mode mode, uint32_t value)
+{
+  if (value == 0) return false;
+  if (mode == Mode::MinPeriod && value > 0xFFFFFFFF / 1000) return false;
+
+  Rule* r = find(key(id, ide));
+  if (r == nullptr && nrules < MaxRules)
+  {
+    r = &rules[nrules];
+    nrules = nrules + 1;
+  }
+  if (r != nullptr)
+  {
+    r->id = key(id, ide);
+    r->value = (mode == Mode::MinPeriod) ? value * 1000 : value;
+    r->count = 0;
+    r->last = 0;
+    r->dropped = 0;
+    r->mode = mode;
+    r->fresh = true;
+  }
+
+  return (r != nullptr);
+}
+
+
+bool Forward::dropped (uint32_t id, bool ide, uint32_t& count)
+{
+  Rule* r = find(key(id, ide));
+  if (r == nullptr) return false;
+  count = r->dropped;
+  return true;
+}
+
+
+void Forward::change_only (bool on, uint32_t hb)
+{
+  memset(cache, 0, sizeof(cache));
+  for (uint32_t s = 0; s < CacheSets; s++)
+  {
+    for (uint32_t w = 0; w < CacheWays; w++) cache[s][w].id = Free;
+  }
+  if (hb > 0xFFFF) hb = 0xFFFF;   // ms, as many as the c command takes
+  heartbeat = hb * 1000;
+  n_hits = 0;
+  n_misses = 0;
+  cache_on = on;
+}
+
+
+uint32_t Forward::hits (void)
+{
+  return n_hits;
+}
+
+
+uint32_t Forward::misses (void)
+{
+  return n_misses;
+}
+
+
+static bool changed (const CANbus::RxMsg& msg)
+{
+  uint32_t k = key(msg.Id, msg.IDE) | ((msg.RTR) ? RTR : 0);
+  uint32_t dlc = (msg.DLC > 8) ? 8 : msg.DLC;
+  uint32_t now = msg.Arrival;
+  Entry* set = cache[(k * 0x9E3779B1) >> 28];
+
+  Entry* e = nullptr;
+  Entry* oldest = &set[0];
+  for (uint32_t w = 0; w < Forward::CacheWays; w++)
+  {
+    if (set[w].id == k) e = &set[w];
+    if (oldest->id == Free) continue;
+    if (set[w].id == Free || now - set[w].sent > now - oldest->sent)
+    {
+      oldest = &set[w];
+    }
+  }
+
+  if (e != nullptr)
+  {
+    n_hits = n_hits + 1;
+    bool same = (e->dlc == msg.DLC) && (msg.RTR || memcmp(e->data, msg.Data8, dlc) == 0);
+    bool due = (heartbeat != 0) && (now - e->sent >= heartbeat);
+    if (same && !due) return false;
+  }
+  else
+  {
+    n_misses = n_misses + 1;
+    e = oldest;
+    e->id = k;
+  }
+
+  e->dlc = msg.DLC;
+  memcpy(e->data, msg.Data8, sizeof(e->data));
+  e->sent = now;
+  return true;
+}
+
+
+bool Forward::pass (const CANbus::RxMsg& msg)
+{
+  Rule* r = find(key(msg.Id, msg.IDE));
+  if (r == nullptr) return (cache_on) ? changed(msg) : true;
+
+  bool ok;
+  if (r->mode == Mode::EveryNth)
+  {
+    ok = (r->count == 0);
+    r->count = (r->count + 1 >= r->value) ? 0 : (r->count + 1);
+  }
+  else
+  {
+    uint32_t now = msg.Arrival;
+    ok = r->fresh || (now - r->last >= r->value);
+    if (ok)
+    {
+      r->last = now;
+      r->fresh = false;
+    }
+  }
+
+  if (!ok) r->dropped++;
+  return (ok && cache_on) ? changed(msg) : ok;
+}
@@ -0,0 +1,33 @@
+#ifndef _FORWARD_HPP_
+#define _FORWARD_HPP_
+
+#include <stdint.h>
+
+#include "can.hpp"
+
+// Per-identifier policy for received frames on their way to the host, run
+// from CANbus::poll() before a frame is formatted or queued. Periods and the
+// heartbeat count from RxMsg::Arrival, when the frame came off the bus. A rule either
+// passes every Nth frame of its identifier or at most one frame per period.
+// In change-only mode what the rules pass is dropped as well when it repeats
+// the last DLC and payload seen for its identifier, unless the heartbeat has
+// expired. The last payloads are kept in a 4-way set-associative cache, a
+// new identifier evicts the entry of its set refreshed least recently.
+namespace Forward
+{
+  static const uint32_t MaxRules = 16;
+  static const uint32_t CacheSets = 16;
+  static const uint32_t CacheWays = 4;
+
+  enum class Mode : uint8_t { EveryNth, MinPeriod };
+
+  void clear (void);
+  bool add (uint32_t id, bool ide, Mode mode, uint32_t value);  // value: N, or period in ms, not 0
+  bool dropped (uint32_t id, bool ide, uint32_t& count);
+  void change_only (bool on, uint32_t heartbeat);  // heartbeat in ms, 0: none
+  uint32_t hits (void);
+  uint32_t misses (void);
+  bool pass (const CANbus::RxMsg& msg);
+};
+
+#endif // _FORWARD_HPP_
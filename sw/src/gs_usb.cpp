@@ -0,0 +1,307 @@
+#include <string.h>
+
+#include "stm32f0xx.h"
+
+#include "can.hpp"
+#include "fifo.hpp"
+#include "gs_usb.hpp"
+
+extern "C" 
+{
+#include "usbd_gs_usb_core.h"
+#include "usbd_usr.h"
+};
+
+
+static uint16_t GS_Init   (void);
+static uint16_t GS_DeInit (void);
+static uint16_t GS_Ctrl   (uint32_t Cmd, uint8_t* Buf, uint32_t Len);
+static uint16_t GS_DataTx (uint8_t* Buf);
+static uint16_t GS_DataRx (uint8_t* Buf, uint32_t Len);
+
+extern "C"
+{
+GS_USB_IF_Prop_TypeDef GS_USB_fops = 
+{
+  GS_Init,
+  GS_DeInit,
+  GS_Ctrl,
+  GS_DataTx,
+  GS_DataRx
+};
+};
+
+extern USB_CORE_HANDLE USB_Device_dev;
+
+static FIFO<GS_Host_Frame_TypeDef, 32> inframes;  // received frames and echoes, CAN -> host
+static FIFO<GS_Host_Frame_TypeDef, 16> outframes; // host -> CAN, kernel keeps at most 10 in flight
+
+// Every frame sent is echoed, a failed one with an error frame after it.
+// inframes keeps room for that, received frames only get the rest.
+static const uint32_t EchoRoom = 2;
+static uint32_t in_flight = 0;    // frames sent and not echoed yet, main loop only
+
+static volatile bool hw_timestamp = false;
+static volatile bool overflow = false;
+
+// Control requests arrive in the USB interrupt, CAN is reconfigured from the main loop
+static volatile bool bittiming_req = false;
+static volatile bool mode_req = false;
+static GS_Device_Bittiming_TypeDef bittiming;
+static GS_Device_Mode_TypeDef mode;
+
+
+static uint16_t GS_Init (void)
+{
+  return USBD_OK;
+}
+
+
+static uint16_t GS_DeInit (void)
+{
+  return USBD_OK;
+}
+
+
+static uint16_t GS_Ctrl (uint32_t Cmd, uint8_t* Buf, uint32_t Len)
+{
+  // Asked before the data stage: a request still pending is not overwritten,
+  // the host gets a stall and may try again
+  if (Buf == NULL)
+  {
+    if (Cmd == GS_USB_BREQ_BITTIMING && bittiming_req) return USBD_BUSY;
+    if (Cmd == GS_USB_BREQ_MODE && mode_req) return USBD_BUSY;
+    return USBD_OK;
+  }
+
+  switch (Cmd)
+  {
+    case GS_USB_BREQ_BITTIMING:
+      if (Len >= sizeof(bittiming) && !bittiming_req)
+      {
+        memcpy(&bittiming, Buf, sizeof(bittiming));
+        bittiming_req = true;
+      }
+      break;
+
+    case GS_USB_BREQ_MODE:
+      if (Len >= sizeof(mode) && !mode_req)
+      {
+        memcpy(&mode, Buf, sizeof(mode));
+        mode_req = true;
+      }
+      break;
+
+    case GS_USB_BREQ_BT_CONST:
+    {
+      GS_Device_BT_Const_TypeDef bt;
+      bt.feature = GS_CAN_FEATURE_LISTEN_ONLY | GS_CAN_FEATURE_LOOP_BACK | GS_CAN_FEATURE_HW_TIMESTAMP;
+      bt.fclk_can = 48000000;
+      bt.tseg1_min = 1;
+      bt.tseg1_max = 16;
+      bt.tseg2_min = 1;
+      bt.tseg2_max = 8;
+      bt.sjw_max = 4;
+      bt.brp_min = 1;
+      bt.brp_max = 1024;
+      bt.brp_inc = 1;
+      memcpy(Buf, &bt, sizeof(bt));
+      return sizeof(bt);
+    }
+
+    case GS_USB_BREQ_DEVICE_CONFIG:
+    {
+      GS_Device_Config_TypeDef cfg;
+      memset(&cfg, 0, sizeof(cfg));
+      cfg.icount = 0;
+      cfg.sw_version = 2;
+      cfg.hw_version = 1;
+      memcpy(Buf, &cfg, sizeof(cfg));
+      return sizeof(cfg);
+    }
+
+    case GS_USB_BREQ_TIMESTAMP:
+    {
+      uint32_t t = CANbus::time_us();
+      memcpy(Buf, &t, sizeof(t));
+      return sizeof(t);
+    }
+
+    case GS_USB_BREQ_HOST_FORMAT:   // we are little-endian as the host format
+    case GS_USB_BREQ_BERR:
+    case GS_USB_BREQ_IDENTIFY:
+    default:
+      break;
+  }
+  return 0;
+}
+
+
+static uint16_t GS_DataTx (uint8_t* Buf)
+{
+  GS_Host_Frame_TypeDef frame;
+  if (!inframes.pop(frame)) return 0;
+  memcpy(Buf, &frame, sizeof(frame));
+  return (hw_timestamp) ? GS_HOST_FRAME_SIZE_TS : GS_HOST_FRAME_SIZE;
+}
+
+
+static uint16_t GS_DataRx (uint8_t* Buf, uint32_t Len)
+{
+  GS_Host_Frame_TypeDef frame;
+  if (Len >= GS_HOST_FRAME_SIZE)
+  {
+    memcpy(&frame, Buf, GS_HOST_FRAME_SIZE);
+    outframes.push(frame);
+  }
+  return USBD_OK;
+}
+
+
+static void ReceiveCANMsg (CANbus::RxMsg &msg)
+{
+  GS_Host_Frame_TypeDef frame;
+  frame.echo_id = GS_HOST_FRAME_ECHO_RX;
+  frame.can_id = msg.Id | ((msg.IDE) ? GS_CAN_EFF_FLAG : 0) | ((msg.RTR) ? GS_CAN_RTR_FLAG : 0);
+  frame.can_dlc = msg.DLC;
+  frame.channel = 0;
+  frame.reserved = 0;
+  memcpy(frame.data, msg.Data8, sizeof(frame.data));
+  frame.timestamp_us = msg.Time;
+
+  // From CANbus::poll(), masked: the USB interrupt takes frames
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  frame.flags = (overflow) ? GS_CAN_FLAG_OVERFLOW : 0;
+  overflow = inframes.space() <= in_flight * EchoRoom || !inframes.push(frame);
+  usbd_gs_usb_Kick(&USB_Device_dev);
+  __set_PRIMASK(primask);
+}
+
+
+static void CANEvent (CANbus::Event ev)
+{
+  if (ev == CANbus::Event::Overrun)
+  {
+    overflow = true;  // flagged on the next frame, the first one after the loss
+  }
+}
+
+
+// The echo tells the host its frame is done with, on the bus at the time
+// given. The driver needs it to free the frame's context even when the
+// frame failed: then an error frame follows saying why.
+static void TransmitDone (CANbus::TxDone &done)
+{
+  GS_Host_Frame_TypeDef frame;
+  frame.echo_id = done.Msg.Tag;
+  frame.can_id = done.Msg.Id | ((done.Msg.IDE) ? GS_CAN_EFF_FLAG : 0) | ((done.Msg.RTR) ? GS_CAN_RTR_FLAG : 0);
+  frame.can_dlc = done.Msg.DLC;
+  frame.channel = 0;
+  frame.flags = 0;
+  frame.reserved = 0;
+  memcpy(frame.data, done.Msg.Data8, sizeof(frame.data));
+  frame.timestamp_us = done.Time;
+
+  GS_Host_Frame_TypeDef err = frame;
+  err.echo_id = GS_HOST_FRAME_ECHO_RX;
+  err.can_dlc = GS_CAN_ERR_DLC;
+  memset(err.data, 0, sizeof(err.data));
+  switch (done.Result)
+  {
+    case CANbus::TxResult::ArbitrationLost:
+      err.can_id = GS_CAN_ERR_FLAG | GS_CAN_ERR_LOSTARB;  // data[0] 0: bit unknown
+      break;
+    case CANbus::TxResult::Error:
+      err.can_id = GS_CAN_ERR_FLAG | GS_CAN_ERR_PROT | GS_CAN_ERR_BUSERROR;
+      err.data[2] = GS_CAN_ERR_PROT_TX;
+      break;
+    case CANbus::TxResult::Aborted:
+      err.can_id = GS_CAN_ERR_FLAG | GS_CAN_ERR_TX_TIMEOUT;
+      break;
+    default:
+      err.can_id = 0;
+      break;
+  }
+
+  if (in_flight != 0) in_flight--;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  inframes.push(frame);
+  if (err.can_id != 0) inframes.push(err);
+  usbd_gs_usb_Kick(&USB_Device_dev);
+  __set_PRIMASK(primask);
+}
+
+
+static void apply_requests (void)
+{
+  if (bittiming_req)
+  {
+    uint32_t ts1 = bittiming.prop_seg + bittiming.phase_seg1;
+    CANbus::bitrate((bittiming.sjw - 1) << 24 | (bittiming.phase_seg2 - 1) << 20 | (ts1 - 1) << 16 | (bittiming.brp - 1));
+    bittiming_req = false;
+  }
+
+  if (mode_req)
+  {
+    in_flight = 0;  // a reset drops what is queued, the driver forgets its frames too
+    if (mode.mode == GS_CAN_MODE_START)
+    {
+      hw_timestamp = (mode.flags & GS_CAN_MODE_HW_TIMESTAMP) ? true : false;
+      CANbus::timestamp((hw_timestamp) ? CANbus::TimeStamp::Micro : CANbus::TimeStamp::Off);
+      if (mode.flags & GS_CAN_MODE_LISTEN_ONLY)
+        CANbus::open(CANbus::OpenMode::ListenOnly);
+      else if (mode.flags & GS_CAN_MODE_LOOP_BACK)
+        CANbus::open(CANbus::OpenMode::LoopBack);
+      else
+        CANbus::open(CANbus::OpenMode::Normal);
+    }
+    else
+    {
+      CANbus::close();
+    }
+    mode_req = false;
+  }
+}
+
+
+static void transmit (void)
+{
+  GS_Host_Frame_TypeDef frame;
+
+  // Keep the frame until there is room for its echo, besides those of the frames in flight
+  if (inframes.space() < (in_flight + 1) * EchoRoom || !outframes.front(frame)) return;
+
+  CANbus::TxMsg msg;
+  msg.IDE = (frame.can_id & GS_CAN_EFF_FLAG) ? true : false;
+  msg.RTR = (frame.can_id & GS_CAN_RTR_FLAG) ? true : false;
+  msg.Id = frame.can_id & ((msg.IDE) ? 0x1FFFFFFF : 0x7FF);
+  msg.DLC = (frame.can_dlc > 8) ? 8 : frame.can_dlc;
+  memcpy(msg.Data8, frame.data, sizeof(msg.Data8));
+  msg.Tag = frame.echo_id;
+  msg.Origin = 0;
+
+  if (CANbus::send(msg) == CANbus::Status::Ok)
+  {
+    outframes.pop(frame);   // echoed by TransmitDone()
+    in_flight++;
+  }
+}
+
+
+void GSUSB::run (void)
+{
+  CANbus::set_rx_cb(ReceiveCANMsg);
+  CANbus::set_event_cb(CANEvent);
+  CANbus::set_tx_cb(TransmitDone);
+
+  USBD_Init(&USB_Device_dev, &USR_desc, &USBD_GS_USB_cb, &USR_cb);
+
+  while (1)
+  {
+    CANbus::poll();
+    apply_requests();
+    transmit();
+  }
+}
@@ -0,0 +1,9 @@
+#ifndef _GS_USB_HPP_
+#define _GS_USB_HPP_
+
+namespace GSUSB
+{
+  void run (void);  // gs_usb device main loop, never returns
+};
+
+#endif // _GS_USB_HPP_
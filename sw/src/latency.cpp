@@ -0,0 +1,47 @@
+#include <string.h>
+
+#include "stm32f0xx.h"
+#include "can.hpp"
+#include "latency.hpp"
+
+#ifdef LATENCY_STATS
+
+using Latency::Stage;
+
+// Each stage is counted from one context: Rx from the main loop, Queue and
+// Usb from the USB interrupt or with it masked
+static uint32_t hist[Latency::Stages][Latency::Buckets];
+
+
+void Latency::add (Stage stage, uint32_t start)
+{
+  uint32_t us = CANbus::time_us() - start;
+  uint32_t b = 0;
+  while (us != 0 && b < Buckets - 1)  // no CLZ on the M0, at most 15 rounds
+  {
+    us >>= 1;
+    b++;
+  }
+  hist[stage][b]++;
+}
+
+
+void Latency::take (Stage stage, uint32_t* counts)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  memcpy(counts, hist[stage], sizeof(hist[stage]));
+  memset(hist[stage], 0, sizeof(hist[stage]));
+  __set_PRIMASK(primask);
+}
+
+
+void Latency::clear (void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  memset(hist, 0, sizeof(hist));
+  __set_PRIMASK(primask);
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _LATENCY_HPP_
+#define _LATENCY_HPP_
+
+#include <stdint.h>
+
+#include "usbd_conf.h"
+
+// Where received frames spend their time on the way to the host, in us of
+// CANbus::time_us() (TIM2, the M0 has no cycle counter). Each stage keeps a
+// histogram of log2 buckets: bucket b counts times up to 2^b - 1 us, the
+// last one everything longer. Without LATENCY_STATS it all compiles away.
+namespace Latency
+{
+  enum Stage : uint8_t
+  {
+    Rx,       // frame read from FIFO0 in the CAN interrupt to handled by CANbus::poll()
+    Queue,    // record queued to formatted into an IN packet (CDC_IN_ZERO_COPY)
+    Usb,      // IN packet handed to the endpoint to picked up by the host
+    Stages
+  };
+
+  static const uint32_t Buckets = 16;
+
+#ifdef LATENCY_STATS
+  void add (Stage stage, uint32_t start);   // the stage began at time_us() start, ends now
+  void take (Stage stage, uint32_t* counts);  // and clear the stage, nothing counted in between is lost
+  void clear (void);
+#else
+  inline void add (Stage, uint32_t) {}
+#endif
+};
+
+#endif // _LATENCY_HPP_
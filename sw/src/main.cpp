@@ -1,12 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 
 #include "stm32f0xx.h"
 
 #include "can.hpp"
 #include "fifo.hpp"
+#include "binrecord.hpp"
+#include "gs_usb.hpp"
+#include "forward.hpp"
+#include "cyclic.hpp"
+#include "latency.hpp"
 
 extern "C" 
 {
@@ -32,26 +36,61 @@ enum {
   SendStd         = 't',
   SendStdRTR      = 'r',
   SendExt         = 'T',
-  SendExtRTR      = 'R'
+  SendExtRTR      = 'R',
+  SetStreamMode   = 'B',  // B0 - ASCII, B1 - binary records, B2 - binary records in batches
+  SetInDeadline   = 'Y',  // Ydd - IN data behind a packet in flight is flushed after dd (hex) ms
+  SetTxPolicy     = 'Q',  // Q0 - TX queue in send order, Q1 - lowest identifier first
+  GetTxQueue      = 'q',  // reply qPDDUU: policy, queue depth and frames queued (hex)
+  SetEventMask    = 'E',  // Ehh - events to report, see Events
+  SetFilterList   = 'f',  // acceptance filter list, see FilterCommand()
+  SetSoftFilter   = 'a',  // software acceptance, see SoftFilterCommand()
+  SetRateLimit    = 'd',  // per-identifier decimation, see RateLimitCommand()
+  SetChangeOnly   = 'c',  // c0 - off, c1[hhhh] - forward changed frames only, heartbeat hhhh ms,
+                          // cs - reply csHHHHHHHHMMMMMMMM: cache hits, misses
+  SetCyclic       = 'p',  // cyclic transmission, see CyclicCommand()
+  SendBurstTx     = 'X',  // many frames, one reply, see BurstStep()
+  GetLatency      = 'h',  // latency histograms, see LatencyCommand()
+  GetFormatRate   = 'j',  // frames formatted per second on target, see FormatBenchCommand()
+  GetQueueStats   = 'i'   // buffer levels and stack use, see StatsCommand()
+};
+
+
+enum class Stream : uint8_t { Ascii, Binary, BinaryBatch };
+
+
+// Optional reports, off by default
+enum Events : uint8_t
+{
+  EventTxDone = 0x01,   // kTTTTTTTTRiii / KTTTTTTTTRiiiiiiii: tag, CANbus::TxResult, id, timestamp as RX
+  EventError  = 0x02    // eCLttrr: CANbus::Event, last error code, TEC, REC, timestamp as RX
 };
 
 
 USB_CORE_HANDLE  USB_Device_dev;
 
 FIFO<uint8_t, 4096> rxfifo; 
-FIFO<uint8_t, 4096> txfifo;
 
+#ifdef CDC_IN_ZERO_COPY
+// Output waiting for IN packets, see VCP_TxFill()
+static FIFO<BinRecord::Record, 128> txrecords;
+#ifdef LATENCY_STATS
+static FIFO<uint32_t, 128> txstamps;        // time_us() each record was queued, in step with txrecords
+#endif
+#endif
 
-uint16_t VCP_callback(uint8_t* Buf, uint32_t Len)
-{
-  while (Len--) rxfifo.push(*Buf++); // TODO: control overflow!
-  return USBD_OK;
-}
+// Set up by thumb_crt0.s, arm_linker_stack_size bytes
+extern "C" uint32_t __stack_start__[];
+extern "C" uint32_t __stack_end__[];
+static const uint32_t StackPaint = 0xDEADBEEF;
 
+static volatile Stream stream = Stream::Ascii;
+static volatile uint8_t events = 0;
 
-static inline void VCP_PutStr (const char* str)
+
+uint16_t VCP_callback(uint8_t* Buf, uint32_t Len)
 {
-  VCP_DataTx((uint8_t*)str, strlen(str));
+  rxfifo.push_n(Buf, Len); // overflow is counted by the fifo
+  return USBD_OK;
 }
 
 
@@ -72,147 +111,1467 @@ static inline CANbus::Bitrate GetBitrate (uint8_t ch)
 }  
 
 
+// Value of a hex digit by its ASCII code, 0xFF for anything else
+static const uint8_t hex_value[256] =
+{
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+
+// Both digits of a byte, high one first
+static const char hex_pair[256][2] =
+{
+  {'0','0'}, {'0','1'}, {'0','2'}, {'0','3'}, {'0','4'}, {'0','5'}, {'0','6'}, {'0','7'},
+  {'0','8'}, {'0','9'}, {'0','A'}, {'0','B'}, {'0','C'}, {'0','D'}, {'0','E'}, {'0','F'},
+  {'1','0'}, {'1','1'}, {'1','2'}, {'1','3'}, {'1','4'}, {'1','5'}, {'1','6'}, {'1','7'},
+  {'1','8'}, {'1','9'}, {'1','A'}, {'1','B'}, {'1','C'}, {'1','D'}, {'1','E'}, {'1','F'},
+  {'2','0'}, {'2','1'}, {'2','2'}, {'2','3'}, {'2','4'}, {'2','5'}, {'2','6'}, {'2','7'},
+  {'2','8'}, {'2','9'}, {'2','A'}, {'2','B'}, {'2','C'}, {'2','D'}, {'2','E'}, {'2','F'},
+  {'3','0'}, {'3','1'}, {'3','2'}, {'3','3'}, {'3','4'}, {'3','5'}, {'3','6'}, {'3','7'},
+  {'3','8'}, {'3','9'}, {'3','A'}, {'3','B'}, {'3','C'}, {'3','D'}, {'3','E'}, {'3','F'},
+  {'4','0'}, {'4','1'}, {'4','2'}, {'4','3'}, {'4','4'}, {'4','5'}, {'4','6'}, {'4','7'},
+  {'4','8'}, {'4','9'}, {'4','A'}, {'4','B'}, {'4','C'}, {'4','D'}, {'4','E'}, {'4','F'},
+  {'5','0'}, {'5','1'}, {'5','2'}, {'5','3'}, {'5','4'}, {'5','5'}, {'5','6'}, {'5','7'},
+  {'5','8'}, {'5','9'}, {'5','A'}, {'5','B'}, {'5','C'}, {'5','D'}, {'5','E'}, {'5','F'},
+  {'6','0'}, {'6','1'}, {'6','2'}, {'6','3'}, {'6','4'}, {'6','5'}, {'6','6'}, {'6','7'},
+  {'6','8'}, {'6','9'}, {'6','A'}, {'6','B'}, {'6','C'}, {'6','D'}, {'6','E'}, {'6','F'},
+  {'7','0'}, {'7','1'}, {'7','2'}, {'7','3'}, {'7','4'}, {'7','5'}, {'7','6'}, {'7','7'},
+  {'7','8'}, {'7','9'}, {'7','A'}, {'7','B'}, {'7','C'}, {'7','D'}, {'7','E'}, {'7','F'},
+  {'8','0'}, {'8','1'}, {'8','2'}, {'8','3'}, {'8','4'}, {'8','5'}, {'8','6'}, {'8','7'},
+  {'8','8'}, {'8','9'}, {'8','A'}, {'8','B'}, {'8','C'}, {'8','D'}, {'8','E'}, {'8','F'},
+  {'9','0'}, {'9','1'}, {'9','2'}, {'9','3'}, {'9','4'}, {'9','5'}, {'9','6'}, {'9','7'},
+  {'9','8'}, {'9','9'}, {'9','A'}, {'9','B'}, {'9','C'}, {'9','D'}, {'9','E'}, {'9','F'},
+  {'A','0'}, {'A','1'}, {'A','2'}, {'A','3'}, {'A','4'}, {'A','5'}, {'A','6'}, {'A','7'},
+  {'A','8'}, {'A','9'}, {'A','A'}, {'A','B'}, {'A','C'}, {'A','D'}, {'A','E'}, {'A','F'},
+  {'B','0'}, {'B','1'}, {'B','2'}, {'B','3'}, {'B','4'}, {'B','5'}, {'B','6'}, {'B','7'},
+  {'B','8'}, {'B','9'}, {'B','A'}, {'B','B'}, {'B','C'}, {'B','D'}, {'B','E'}, {'B','F'},
+  {'C','0'}, {'C','1'}, {'C','2'}, {'C','3'}, {'C','4'}, {'C','5'}, {'C','6'}, {'C','7'},
+  {'C','8'}, {'C','9'}, {'C','A'}, {'C','B'}, {'C','C'}, {'C','D'}, {'C','E'}, {'C','F'},
+  {'D','0'}, {'D','1'}, {'D','2'}, {'D','3'}, {'D','4'}, {'D','5'}, {'D','6'}, {'D','7'},
+  {'D','8'}, {'D','9'}, {'D','A'}, {'D','B'}, {'D','C'}, {'D','D'}, {'D','E'}, {'D','F'},
+  {'E','0'}, {'E','1'}, {'E','2'}, {'E','3'}, {'E','4'}, {'E','5'}, {'E','6'}, {'E','7'},
+  {'E','8'}, {'E','9'}, {'E','A'}, {'E','B'}, {'E','C'}, {'E','D'}, {'E','E'}, {'E','F'},
+  {'F','0'}, {'F','1'}, {'F','2'}, {'F','3'}, {'F','4'}, {'F','5'}, {'F','6'}, {'F','7'},
+  {'F','8'}, {'F','9'}, {'F','A'}, {'F','B'}, {'F','C'}, {'F','D'}, {'F','E'}, {'F','F'}
+};
+
+
+
 static inline uint8_t char_to_hex (char c)
 {
-  uint8_t res;
-  if (isdigit(c))
-    res = c - '0';
-  else if (c >= 'a' && c <= 'f')
-    res = c - 'a' + 10;
-  else if (c >= 'A' && c <= 'F')
-    res = c - 'A' + 10;
-  else
-    res = 0xFF;
-  return res;
+  return hex_value[static_cast<uint8_t>(c)];
 }
 
 
 static inline char hex_to_char (uint8_t hex)
 {
-  const char tbl[16] = {'0', '1', '2', '3',
-                        '4', '5', '6', '7',
-                        '8', '9', 'A', 'B',
-                        'C', 'D', 'E', 'F'};
-  return tbl[hex & 0x0F];
+  return hex_pair[hex & 0x0F][1];
 }
 
 
-static inline uint32_t get_word (void)
+// Hex digits into buf at len, which is advanced past them
+template <typename T>
+static inline void put_hex8 (T* buf, uint32_t& len, uint8_t b)
+{
+  buf[len++] = hex_pair[b][0];
+  buf[len++] = hex_pair[b][1];
+}
+
+
+template <typename T>
+static inline void put_hex16 (T* buf, uint32_t& len, uint16_t w)
+{
+  put_hex8(buf, len, w >> 8);
+  put_hex8(buf, len, w >> 0);
+}
+
+
+template <typename T>
+static inline void put_hex32 (T* buf, uint32_t& len, uint32_t w)
+{
+  put_hex16(buf, len, w >> 16);
+  put_hex16(buf, len, w >> 0);
+}
+
+
+// Value of len hex digits. A character that is not one clears valid, which
+// is left alone otherwise, so the fields of a line can share one flag.
+static inline uint32_t get_hex (const uint8_t* buf, uint32_t len, bool& valid)
 {
-  uint8_t tmp;
-  uint8_t i = 8;
   uint32_t result = 0;
-  do
+  uint8_t bad = 0;
+  for (uint32_t i = 0; i < len; i++)
   {
-    while (false == rxfifo.pop(tmp)){};
-    result = (result << 4) | char_to_hex(tmp);
-  } while ( tmp != '\r' && --i);
-  return  result;
+    uint8_t d = char_to_hex(buf[i]);
+    bad |= d;   // 0xFF shows in the high nibble
+    result = (result << 4) | d;
+  }
+  if (bad & 0xF0) valid = false;
+  return result;
 }
 
 
-static inline uint32_t GetBitrateCustom (void)
+#ifndef USE_GS_USB  // the LAWICEL command set, gs_usb.cpp serves the host instead
+
+// Command handlers get the whole line without '\r', command letter included,
+// and may point resp to a reply that stays valid after they return
+
+
+// Builds the filter list, applied as a whole by "fa":
+//   fc                  - clear the list (an empty list accepts everything)
+//   ftiii[jjj]          - standard data frames iii, or iii to jjj
+//   friii[jjj]          - standard remote frames
+//   fTiiiiiiii[jjjjjjjj], fRiiiiiiii[jjjjjjjj] - extended data/remote frames
+//   fmCCCCCCCCMMMMMMMM  - code and mask in filter register layout, mask bits
+//                         set are don't care as with 'm'
+//   fa                  - program the filter banks, reply faBBL: banks used
+//                         and 1 if the list had to be widened to fit
+static CANbus::Status FilterCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
 {
-  uint8_t tmp;
-  uint8_t i = 4;
-  uint32_t btr = 0;
+  const uint8_t* line = &cmd[1];
+  if (--len == 0) return CANbus::Status::Error;
 
-  do
+  bool ok = false;
+  uint8_t sub = line[0];
+  switch (sub)
   {
-    while (false == rxfifo.pop(tmp)){};
-    btr = (btr << 4) | char_to_hex(tmp);
-  } while ( tmp != '\r' && --i);
-  btr = (btr & 0x01FF) | ((btr & 0xFE00) << 7);
-  return  btr;
+    case 'c':
+      ok = (len == 1);
+      if (ok) CANFilter::clear();
+      break;
+    case 't': case 'r': case 'T': case 'R':
+    {
+      bool ide = (sub == 'T' || sub == 'R');
+      bool rtr = (sub == 'r' || sub == 'R');
+      uint32_t w = (ide) ? 8 : 3;
+      bool valid = true;
+      if (len == 1 + w)
+      {
+        uint32_t id = get_hex(&line[1], w, valid);
+        ok = valid && CANFilter::add_id(id, ide, rtr);
+      }
+      else if (len == 1 + 2*w)
+      {
+        uint32_t first = get_hex(&line[1], w, valid);
+        uint32_t last = get_hex(&line[1 + w], w, valid);
+        ok = valid && CANFilter::add_range(first, last, ide, rtr);
+      }
+      break;
+    }
+    case 'm':
+      if (len == 17)
+      {
+        bool valid = true;
+        uint32_t code = get_hex(&line[1], 8, valid);
+        uint32_t mask = get_hex(&line[9], 8, valid);
+        ok = valid && CANFilter::add_mask(code, ~mask);
+      }
+      break;
+    case 'a':
+    {
+      static CANFilter::Bank banks[CANFilter::Banks];
+      static char reply[6];
+      bool loose;
+      uint32_t n = CANFilter::compile(banks, loose);
+      ok = (CANbus::filters(banks, n) == CANbus::Status::Ok);
+      uint32_t r = 0;
+      reply[r++] = 'f';
+      reply[r++] = 'a';
+      put_hex8(reply, r, n);
+      reply[r++] = (loose) ? '1' : '0';
+      reply[r] = 0;
+      resp = reply;
+      break;
+    }
+    default:
+      break;
+  }
+  return (ok) ? CANbus::Status::Ok : CANbus::Status::Error;
 }
 
 
-CANbus::Status SendCANMsg (uint8_t type)
+// Loads the software acceptance stage, applied to frames the banks pass:
+//   a0, a1             - off (accept everything) / on
+//   ac                 - clear identifiers and counters
+//   atiii[jjj]         - accept standard identifier iii, or iii to jjj
+//   aTiiiiiiii         - accept extended identifier
+//   as                 - reply asAAAAAAAARRRRRRRR: frames accepted, rejected
+static CANbus::Status SoftFilterCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
 {
-  CANbus::TxMsg msg;
-  msg.Id = 0;
-  msg.IDE = (type == 'T' || type == 'R') ? true : false; 
-  msg.RTR = (type == 'r' || type == 'R') ? true : false;
+  const uint8_t* line = &cmd[1];
+  if (--len == 0) return CANbus::Status::Error;
+
+  bool ok = false;
+  switch (line[0])
+  {
+    case '0': case '1':
+      ok = (len == 1);
+      if (ok) CANFilter::soft_enable(line[0] == '1');
+      break;
+    case 'c':
+      ok = (len == 1);
+      if (ok) CANFilter::soft_clear();
+      break;
+    case 't':
+      if (len == 4 || len == 7)
+      {
+        bool valid = true;
+        uint32_t first = get_hex(&line[1], 3, valid);
+        uint32_t last = (len == 7) ? get_hex(&line[4], 3, valid) : first;
+        ok = valid && (first <= last);
+        for (uint32_t id = first; ok && id <= last; id++) ok = CANFilter::soft_add(id, false);
+      }
+      break;
+    case 'T':
+      if (len == 9)
+      {
+        bool valid = true;
+        uint32_t id = get_hex(&line[1], 8, valid);
+        ok = valid && CANFilter::soft_add(id, true);
+      }
+      break;
+    case 's':
+    {
+      static char reply[19];
+      uint32_t acc = CANFilter::accepted();
+      uint32_t rej = CANFilter::rejected();
+      uint32_t r = 0;
+      reply[r++] = 'a';
+      reply[r++] = 's';
+      put_hex32(reply, r, acc);
+      put_hex32(reply, r, rej);
+      reply[r] = 0;
+      resp = reply;
+      ok = true;
+      break;
+    }
+    default:
+      break;
+  }
+  return (ok) ? CANbus::Status::Ok : CANbus::Status::Error;
+}
+
+
+// Thins out received frames per identifier before they are queued:
+//   dc                       - remove all rules
+//   dtiiinNNNN, dTiiiiiiiinNNNN - pass every NNNN-th frame of standard/extended iii
+//   dtiiimNNNN, dTiiiiiiiimNNNN - pass at most one frame per NNNN ms
+//                            NNNN 0 is refused in both
+//   dstiii, dsTiiiiiiii      - reply dsCCCCCCCC: frames the rule has dropped
+static CANbus::Status RateLimitCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
+{
+  const uint8_t* line = &cmd[1];
+  if (--len == 0) return CANbus::Status::Error;
+
+  if (line[0] == 'c')
+  {
+    if (len != 1) return CANbus::Status::Error;
+    Forward::clear();
+    return CANbus::Status::Ok;
+  }
+
+  bool ok = false;
+  bool query = (line[0] == 's');
+  const uint8_t* p = (query) ? &line[1] : &line[0];
+  uint32_t head = p - line;
+  uint32_t w = (len > head && p[0] == 'T') ? 8 : 3;
+  if (len < head + 1 + w || (p[0] != 't' && p[0] != 'T')) return CANbus::Status::Error;
+
+  bool valid = true;
+  uint32_t id = get_hex(&p[1], w, valid);
+  uint32_t rest = len - head - 1 - w;   // after the identifier
+  if (!valid) return CANbus::Status::Error;
+
+  if (query && rest == 0)
+  {
+    static char reply[11];
+    uint32_t cnt;
+    ok = Forward::dropped(id, (w == 8), cnt);
+    uint32_t r = 0;
+    reply[r++] = 'd';
+    reply[r++] = 's';
+    put_hex32(reply, r, cnt);
+    reply[r] = 0;
+    resp = reply;
+  }
+  else if (!query && rest == 5 && (p[1 + w] == 'n' || p[1 + w] == 'm'))
+  {
+    Forward::Mode mode = (p[1 + w] == 'n') ? Forward::Mode::EveryNth : Forward::Mode::MinPeriod;
+    uint32_t n = get_hex(&p[2 + w], 4, valid);
+    ok = valid && Forward::add(id, (w == 8), mode, n);
+  }
+  return (ok) ? CANbus::Status::Ok : CANbus::Status::Error;
+}
+
+
+static CANbus::Status ChangeOnlyCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
+{
+  const uint8_t* line = &cmd[1];
+  if (--len == 0) return CANbus::Status::Error;
+
+  bool ok = false;
+  switch (line[0])
+  {
+    case '0':
+      ok = (len == 1);
+      if (ok) Forward::change_only(false, 0);
+      break;
+    case '1':
+    {
+      if (len > 5) break;
+      bool valid = true;
+      uint32_t hb = get_hex(&line[1], len - 1, valid);
+      ok = valid;
+      if (ok) Forward::change_only(true, hb);
+      break;
+    }
+    case 's':
+    {
+      static char reply[19];
+      uint32_t hits = Forward::hits();
+      uint32_t misses = Forward::misses();
+      uint32_t r = 0;
+      reply[r++] = 'c';
+      reply[r++] = 's';
+      put_hex32(reply, r, hits);
+      put_hex32(reply, r, misses);
+      reply[r] = 0;
+      resp = reply;
+      ok = (len == 1);
+      break;
+    }
+    default:
+      break;
+  }
+  return (ok) ? CANbus::Status::Ok : CANbus::Status::Error;
+}
+
+
+// Characters the frame at buf takes as far as its first len of them tell:
+// 0 if it is malformed, more than len while the DLC is still to come
+static uint32_t FrameLength (const uint8_t* buf, uint32_t len)
+{
+  if (len < 1) return 1;
+  uint8_t type = buf[0];
+  if (type != 't' && type != 'T' && type != 'r' && type != 'R') return 0;
+
+  uint32_t n = 1 + ((type == 'T' || type == 'R') ? 8 : 3) + 1;
+  if (len < n) return n;
+  uint8_t dlc = char_to_hex(buf[n - 1]);
+  if (dlc > 8) return 0;
+  return (type == 'r' || type == 'R') ? n : n + 2*dlc;
+}
+
+
+// A frame as in t/T/r/R, type letter included. Returns the number of
+// characters it took, 0 if it is malformed.
+static uint32_t ParseFrame (const uint8_t* buf, uint32_t len, CANbus::TxMsg& msg)
+{
+  uint32_t n = FrameLength(buf, len);
+  if (n == 0 || n > len) return 0;
+
+  uint8_t type = buf[0];
+  msg.IDE = (type == 'T' || type == 'R');
+  msg.RTR = (type == 'r' || type == 'R');
+  msg.Tag = 0;
+  msg.Origin = 0;
   memset(msg.Data8, 0, sizeof(msg.Data8));
 
-  uint32_t idx = 0;
+  uint32_t w = (msg.IDE) ? 8 : 3;
+  bool valid = true;
+  msg.Id = get_hex(&buf[1], w, valid);
+  msg.DLC = char_to_hex(buf[1 + w]);  // checked by FrameLength()
+  if (!msg.RTR)
+  {
+    for (uint32_t i = 0; i < msg.DLC; i++) msg.Data8[i] = get_hex(&buf[2 + w + 2*i], 2, valid);
+  }
+  return (valid) ? n : 0;
+}
+
 
-  for (uint32_t i = (msg.IDE) ? 0 : 5; true; i++) // if STD use only 3 chars for ID
+// Transmission on the device, NN is the message index (hex):
+//   pc                        - remove all messages
+//   pNNtiiildd..PPPP[OOOO]    - send the frame (any of t/T/r/R) every PPPP ms,
+//                               the first time after OOOO ms
+//   puNNdd..                  - new payload, the cycle goes on
+//   pdNN                      - remove a message
+//   psNN                      - reply psSSSSSSSSMMMMMMMMJJJJJJJJ: sent, missed and
+//                               largest period deviation in us
+static CANbus::Status CyclicCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
+{
+  const uint8_t* line = &cmd[1];
+  if (--len == 0) return CANbus::Status::Error;
+
+  bool ok = false;
+  uint8_t sub = line[0];
+  if (sub == 'c')
   {
-    uint8_t tmp;
-    while (false == rxfifo.pop(tmp)){};
-    if (tmp == '\r') return CANbus::Status::Error; // FIXME: rewrite this 
-    if (i < 8)                            // get ID
+    ok = (len == 1);
+    if (ok) Cyclic::clear();
+  }
+  else if (sub == 'u' || sub == 'd' || sub == 's')
+  {
+    bool valid = true;
+    uint32_t idx = (len >= 3) ? get_hex(&line[1], 2, valid) : Cyclic::MaxMsgs;
+    if (!valid)
+    {
+      ok = false;
+    }
+    else if (sub == 'u' && (len & 1))
     {
-      msg.Id = (msg.Id << 4) | char_to_hex(tmp);
+      static uint8_t data[8];
+      uint32_t dlc = (len - 3) / 2;
+      for (uint32_t i = 0; i < dlc && i < 8; i++) data[i] = get_hex(&line[3 + 2*i], 2, valid);
+      ok = valid && Cyclic::update(idx, data, dlc);
     }
-    else if (i < 9)                       // get DLC
+    else if (sub == 'd' && len == 3)
     {
-      msg.DLC = char_to_hex(tmp);
-      if ((msg.RTR) || (msg.DLC == 0)) break; // if this is remote frame or zero data length, no need to send data
+      ok = Cyclic::remove(idx);
     }
-    else                                  // get DATA
+    else if (sub == 's' && len == 3)
+    {
+      static char reply[27];
+      Cyclic::Stats st;
+      ok = Cyclic::stats(idx, st);
+      uint32_t r = 0;
+      reply[r++] = 'p';
+      reply[r++] = 's';
+      put_hex32(reply, r, st.Sent);
+      put_hex32(reply, r, st.Missed);
+      put_hex32(reply, r, st.Jitter);
+      reply[r] = 0;
+      if (ok) resp = reply;
+    }
+  }
+  else if (len > 2)
+  {
+    CANbus::TxMsg msg;
+    bool valid = true;
+    uint32_t idx = get_hex(&line[0], 2, valid);
+    uint32_t n = 2 + ParseFrame(&line[2], len - 2, msg);
+    if (n > 2 && (len == n + 4 || len == n + 8))
     {
-      msg.Data8[idx >> 1] <<= 4;
-      msg.Data8[idx >> 1] |= char_to_hex(tmp);
-      if (++idx >= 2*msg.DLC) break;
+      uint32_t period = get_hex(&line[n], 4, valid);
+      uint32_t offset = (len == n + 8) ? get_hex(&line[n + 4], 4, valid) : period;
+      ok = valid && Cyclic::add(idx, msg, period, offset);
     }
   }
+  return (ok) ? CANbus::Status::Ok : CANbus::Status::Error;
+}
+
+
+// t/T/r/R with an optional sequence tag up to 8 hex digits after the frame,
+// echoed in the TX-done event
+static CANbus::Status SendCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
+{
+  resp = (cmd[0] == SendExt || cmd[0] == SendExtRTR) ? "Z" : "z";
+
+  CANbus::TxMsg msg;
+  uint32_t n = ParseFrame(cmd, len, msg);
+  if (n == 0 || len - n > 8) return CANbus::Status::Error;
+  bool valid = true;
+  msg.Tag = get_hex(&cmd[n], len - n, valid);
+  if (!valid) return CANbus::Status::Error;
   return CANbus::send(msg);
-}  
+}
+
+
+static CANbus::Status VersionCommand (const uint8_t* cmd, uint32_t, const char*& resp)
+{
+  resp = (cmd[0] == GetVersionSW) ? "vSTM32" : "V0102";
+  return CANbus::Status::Ok;
+}
+
+
+static CANbus::Status StatusCommand (const uint8_t*, uint32_t, const char*& resp)
+{
+  static char status[4];
+  uint8_t flags = CANbus::status();
+  uint32_t r = 0;
+  status[r++] = 'F';
+  put_hex8(status, r, flags);
+  status[r] = 0;
+  resp = status;
+  return CANbus::Status::Ok;
+}
+
+
+static CANbus::Status OpenCommand (const uint8_t* cmd, uint32_t, const char*&)
+{
+  switch (cmd[0])
+  {
+    case OpenCANLoopback: return CANbus::open(CANbus::OpenMode::LoopBack);
+    case OpenCANListen:   return CANbus::open(CANbus::OpenMode::ListenOnly);
+    default:              return CANbus::open(CANbus::OpenMode::Normal);
+  }
+}
+
+
+static CANbus::Status CloseCommand (const uint8_t*, uint32_t, const char*&)
+{
+  return CANbus::close();
+}
+
+
+static CANbus::Status TimestampCommand (const uint8_t* cmd, uint32_t len, const char*&)
+{
+  if (len != 2) return CANbus::Status::Error;
+  return CANbus::timestamp((cmd[1]=='0') ? CANbus::TimeStamp::Off :
+                           (cmd[1]=='2') ? CANbus::TimeStamp::Micro : CANbus::TimeStamp::Milli);
+}
+
+
+static CANbus::Status BitrateCommand (const uint8_t* cmd, uint32_t len, const char*&)
+{
+  if (len != 2) return CANbus::Status::Error;
+  return CANbus::bitrate(GetBitrate(cmd[1]));
+}
+
+
+// sBBBB: BTR bits 0..8 in the low 9 bits, bits 16..22 above them
+static CANbus::Status BitrateCustomCommand (const uint8_t* cmd, uint32_t len, const char*&)
+{
+  if (len < 2 || len > 5) return CANbus::Status::Error;
+  bool valid = true;
+  uint32_t btr = get_hex(&cmd[1], len - 1, valid);
+  if (!valid) return CANbus::Status::Error;
+  btr = (btr & 0x01FF) | ((btr & 0xFE00) << 7);
+  return CANbus::bitrate(btr);
+}
+
+
+static CANbus::Status FilterCodeCommand (const uint8_t* cmd, uint32_t len, const char*&)
+{
+  if (len < 2 || len > 9) return CANbus::Status::Error;
+  bool valid = true;
+  uint32_t value = get_hex(&cmd[1], len - 1, valid);
+  if (!valid) return CANbus::Status::Error;
+  return (cmd[0] == SetFilterCode) ? CANbus::filtercode(value) : CANbus::filtermask(value);
+}
+
+
+static CANbus::Status StreamCommand (const uint8_t* cmd, uint32_t len, const char*&)
+{
+  if (len != 2) return CANbus::Status::Error;
+  switch (cmd[1])  // reply is already sent in the new mode
+  {
+    case '0': stream = Stream::Ascii; break;
+    case '1': stream = Stream::Binary; break;
+    case '2': stream = Stream::BinaryBatch; break;
+    default:  return CANbus::Status::Error;
+  }
+  return CANbus::Status::Ok;
+}
+
+
+static CANbus::Status DeadlineCommand (const uint8_t* cmd, uint32_t len, const char*&)
+{
+  if (len < 2 || len > 9) return CANbus::Status::Error;
+  bool valid = true;
+  uint32_t deadline = get_hex(&cmd[1], len - 1, valid);
+  if (!valid) return CANbus::Status::Error;
+  usbd_cdc_Deadline(deadline);
+  return CANbus::Status::Ok;
+}
+
+
+static CANbus::Status TxPolicyCommand (const uint8_t* cmd, uint32_t len, const char*&)
+{
+  if (len != 2) return CANbus::Status::Error;
+  switch (cmd[1])
+  {
+    case '0': return CANbus::tx_policy(CANbus::TxPolicy::Fifo);
+    case '1': return CANbus::tx_policy(CANbus::TxPolicy::Priority);
+    default:  return CANbus::Status::Error;
+  }
+}
+
+
+static CANbus::Status TxQueueCommand (const uint8_t*, uint32_t, const char*& resp)
+{
+  static char txq[7];
+  uint32_t depth = CANbus::tx_depth();
+  uint32_t used = CANbus::tx_used();
+  uint32_t r = 0;
+  txq[r++] = 'q';
+  txq[r++] = (CANbus::tx_policy() == CANbus::TxPolicy::Priority) ? '1' : '0';
+  put_hex8(txq, r, depth);
+  put_hex8(txq, r, used);
+  txq[r] = 0;
+  resp = txq;
+  return CANbus::Status::Ok;
+}
+
+
+static CANbus::Status EventMaskCommand (const uint8_t* cmd, uint32_t len, const char*&)
+{
+  if (len < 2 || len > 3) return CANbus::Status::Error;
+  bool valid = true;
+  uint32_t mask = get_hex(&cmd[1], len - 1, valid);
+  if (!valid) return CANbus::Status::Error;
+  events = mask;
+  return CANbus::Status::Ok;
+}
 
 
-void ReceiveCANMsg (CANbus::RxMsg &msg) // FIXME: rewrite function
+// Latency histograms of received frames, see latency.hpp:
+//   hN  - reply hNcccc..: the 16 buckets of Latency::Stage N, counts saturated at FFFF;
+//         the stage starts again from 0, so each reply covers the time since the last
+//   hc  - clear all stages
+static CANbus::Status LatencyCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
+{
+#ifdef LATENCY_STATS
+  if (len != 2) return CANbus::Status::Error;
+  if (cmd[1] == 'c')
+  {
+    Latency::clear();
+    return CANbus::Status::Ok;
+  }
+
+  uint32_t stage = char_to_hex(cmd[1]);
+  if (stage >= Latency::Stages) return CANbus::Status::Error;
+
+  static uint32_t counts[Latency::Buckets];
+  static char reply[2 + 4*Latency::Buckets + 1];
+  Latency::take(static_cast<Latency::Stage>(stage), counts);
+  uint32_t r = 0;
+  reply[r++] = 'h';
+  reply[r++] = cmd[1];
+  for (uint32_t i = 0; i < Latency::Buckets; i++)
+  {
+    put_hex16(reply, r, (counts[i] > 0xFFFF) ? 0xFFFF : counts[i]);
+  }
+  reply[r] = 0;
+  resp = reply;
+  return CANbus::Status::Ok;
+#else
+  (void)cmd;
+  (void)len;
+  (void)resp;
+  return CANbus::Status::Error;
+#endif
+}
+
+
+#endif
+
+
+// Fills the stack below the current frame with StackPaint, before interrupts
+// are enabled. The deepest use since shows as the first word overwritten.
+static void PaintStack (void)
+{
+  uint32_t* sp = reinterpret_cast<uint32_t*>(__get_MSP());
+  for (uint32_t* p = __stack_start__; p < sp; p++) *p = StackPaint;
+}
+
+
+#ifndef USE_GS_USB
+
+static uint32_t StackUsed (void)
+{
+  const uint32_t* p = __stack_start__;
+  while (p < __stack_end__ && *p == StackPaint) p++;
+  return (__stack_end__ - p) * sizeof(uint32_t);
+}
+
+
+static inline void put_count (char* buf, uint32_t& len, uint32_t cnt)
+{
+  put_hex16(buf, len, (cnt > 0xFFFF) ? 0xFFFF : cnt);
+}
+
+
+// Queue statistics, counts saturated at FFFF:
+//   i   - reply iUUUUHHHHDDDD for rxfifo (bytes from the host), the IN queue
+//         (records, or bytes of APP_Rx_Buffer without CDC_IN_ZERO_COPY), the
+//         CAN TX queue and the frames received waiting for CANbus::poll():
+//         fill level, high-water mark and drops; then SSSS, the most stack
+//         in bytes ever used
+//   ic  - restart high-water marks and drops from the current levels
+static CANbus::Status StatsCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
+{
+  if (len == 2 && cmd[1] == 'c')
+  {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    rxfifo.clear_stats();
+#ifdef CDC_IN_ZERO_COPY
+    txrecords.clear_stats();
+#else
+    VCP_TxClearStats();
+#endif
+    CANbus::tx_clear_stats();
+    CANbus::rx_clear_stats();
+    __set_PRIMASK(primask);
+    return CANbus::Status::Ok;
+  }
+  if (len != 1) return CANbus::Status::Error;
+
+  static char reply[1 + 4*12 + 4 + 1];
+  uint32_t r = 0;
+  reply[r++] = 'i';
+  put_count(reply, r, rxfifo.size());
+  put_count(reply, r, rxfifo.high_water());
+  put_count(reply, r, rxfifo.overflows());
+#ifdef CDC_IN_ZERO_COPY
+  put_count(reply, r, txrecords.size());
+  put_count(reply, r, txrecords.high_water());
+  put_count(reply, r, txrecords.overflows());
+#else
+  put_count(reply, r, VCP_TxUsed());
+  put_count(reply, r, VCP_TxPeak());
+  put_count(reply, r, VCP_TxDropped());
+#endif
+  put_count(reply, r, CANbus::tx_used());
+  put_count(reply, r, CANbus::tx_peak());
+  put_count(reply, r, CANbus::tx_rejected());
+  uint32_t used, peak, dropped;
+  CANbus::rx_stats(used, peak, dropped);
+  put_count(reply, r, used);
+  put_count(reply, r, peak);
+  put_count(reply, r, dropped);
+  put_count(reply, r, StackUsed());
+  reply[r] = 0;
+  resp = reply;
+  return CANbus::Status::Ok;
+}
+
+
+typedef CANbus::Status (*Handler) (const uint8_t* cmd, uint32_t len, const char*& resp);
+
+typedef struct
+{
+  uint8_t letter;
+  Handler run;
+} Command;
+
+static CANbus::Status FormatBenchCommand (const uint8_t* cmd, uint32_t len, const char*& resp);
+
+
+// X is not here: its line can be any length, see BurstStep()
+static const Command commands[] =
+{
+  {GetVersionSW,     VersionCommand},
+  {GetVersionHW,     VersionCommand},
+  {GetStatus,        StatusCommand},
+  {OpenCAN,          OpenCommand},
+  {OpenCANLoopback,  OpenCommand},
+  {OpenCANListen,    OpenCommand},
+  {CloseCAN,         CloseCommand},
+  {SetTimestamping,  TimestampCommand},
+  {SetBitrate,       BitrateCommand},
+  {SetBitrateCustom, BitrateCustomCommand},
+  {SetFilterMask,    FilterCodeCommand},
+  {SetFilterCode,    FilterCodeCommand},
+  {SendStd,          SendCommand},
+  {SendStdRTR,       SendCommand},
+  {SendExt,          SendCommand},
+  {SendExtRTR,       SendCommand},
+  {SetStreamMode,    StreamCommand},
+  {SetInDeadline,    DeadlineCommand},
+  {SetTxPolicy,      TxPolicyCommand},
+  {GetTxQueue,       TxQueueCommand},
+  {SetEventMask,     EventMaskCommand},
+  {SetFilterList,    FilterCommand},
+  {SetSoftFilter,    SoftFilterCommand},
+  {SetRateLimit,     RateLimitCommand},
+  {SetChangeOnly,    ChangeOnlyCommand},
+  {SetCyclic,        CyclicCommand},
+  {GetLatency,       LatencyCommand},
+  {GetFormatRate,    FormatBenchCommand},
+  {GetQueueStats,    StatsCommand}
+};
+
+
+static Handler FindCommand (uint8_t letter)
+{
+  for (uint32_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+  {
+    if (commands[i].letter == letter) return commands[i].run;
+  }
+  return nullptr;
+}
+
+#endif
+
+
+// Everything sent to the host is a BinRecord::Record, formatted for the
+// stream mode it was queued in: right away into the CDC IN buffer or, with
+// CDC_IN_ZERO_COPY, straight into packet memory when the IN packet is built.
+static const uint32_t FormatMax = 36; // ASCII extended frame with us timestamp: 35
+
+
+// Batch mode puts a Header in front of records going out together: those
+// fitting into one IN packet or, formatted in place, still waiting in the
+// CDC IN buffer. FormatRecord() writes the records alone.
+static inline uint32_t BinHeader (uint8_t* buf, uint32_t count)
+{
+  BinRecord::Header hdr;
+  hdr.type = BinRecord::Batch;
+  hdr.count = count;
+  hdr.length = count * sizeof(BinRecord::Record);
+  memcpy(buf, &hdr, sizeof(hdr));
+  return sizeof(hdr);
+}
+
+
+static inline uint32_t TimeSize (const BinRecord::Record& rec)
+{
+  return (rec.flags & BinRecord::Time) ? ((rec.flags & BinRecord::Micro) ? 8 : 4) : 0;
+}
+
+
+static uint32_t FormatSize (const BinRecord::Record& rec, Stream mode)
+{
+  if (mode != Stream::Ascii)
+  {
+    return sizeof(rec);
+  }
+  if (rec.type == BinRecord::Reply)
+  {
+    return rec.dlc;
+  }
+  if (rec.type == BinRecord::Overflow)
+  {
+    return 6;
+  }
+  if (rec.type == BinRecord::Error)
+  {
+    return 1 + 1 + 1 + 2 + 2 + TimeSize(rec) + 1;
+  }
+  if (rec.type == BinRecord::TxDone)
+  {
+    return 1 + 8 + 1 + ((rec.flags & BinRecord::IDE) ? 8 : 3) + TimeSize(rec) + 1;
+  }
+  uint32_t dlen = (rec.flags & BinRecord::RTR) ? 0 : ((rec.dlc > 8) ? 8 : rec.dlc);
+  return 1 + ((rec.flags & BinRecord::IDE) ? 8 : 3) + 1 + 2*dlen + TimeSize(rec) + 1;
+}
+
+
+// Writes exactly FormatSize(rec, mode) bytes
+static uint32_t FormatRecord (const BinRecord::Record& rec, Stream mode, uint8_t* tmp)
 {
-  uint8_t tmp[40];
   uint32_t len = 0;
-  
-  if (msg.IDE)  // if Ext frame
-  {
-    tmp[len++] = (msg.RTR) ? 'R' : 'T';
-    tmp[len++] = hex_to_char(msg.Id >> 28); 
-    tmp[len++] = hex_to_char(msg.Id >> 24);
-    tmp[len++] = hex_to_char(msg.Id >> 20);    
-    tmp[len++] = hex_to_char(msg.Id >> 16); 
-    tmp[len++] = hex_to_char(msg.Id >> 12);
-    tmp[len++] = hex_to_char(msg.Id >> 8); 
-    tmp[len++] = hex_to_char(msg.Id >> 4);
-    tmp[len++] = hex_to_char(msg.Id >> 0); 
+
+  if (mode != Stream::Ascii)
+  {
+    memcpy(tmp, &rec, sizeof(rec)); // buffer may be unaligned
+    return sizeof(rec);
+  }
+
+  if (rec.type == BinRecord::Reply)
+  {
+    memcpy(tmp, rec.data, rec.dlc);
+    return rec.dlc;
+  }
+
+  if (rec.type == BinRecord::Overflow)  // "xNNNN\r", number of losses, saturated
+  {
+    uint32_t cnt = (rec.id > 0xFFFF) ? 0xFFFF : rec.id;
+    tmp[len++] = 'x';
+    put_hex16(tmp, len, cnt);
+    tmp[len++] = '\r';
+    return len;
+  }
+
+  uint32_t dlen = (rec.flags & BinRecord::RTR) ? 0 : ((rec.dlc > 8) ? 8 : rec.dlc);
+
+  if (rec.type == BinRecord::TxDone)  // "kTTTTTTTTR" + id and timestamp
+  {
+    uint32_t tag;
+    memcpy(&tag, rec.data, sizeof(tag));
+    tmp[len++] = (rec.flags & BinRecord::IDE) ? 'K' : 'k';
+    put_hex32(tmp, len, tag);
+    tmp[len++] = hex_to_char(rec.data[4]);
+  }
+  else if (rec.type == BinRecord::Error)  // "eCLttrr": event, LEC, TEC, REC
+  {
+    tmp[len++] = 'e';
+    tmp[len++] = hex_to_char(rec.dlc);
+    tmp[len++] = hex_to_char(rec.data[2]);
+    put_hex8(tmp, len, rec.data[0]);
+    put_hex8(tmp, len, rec.data[1]);
+  }
+  else if (rec.flags & BinRecord::IDE)
+  {
+    tmp[len++] = (rec.flags & BinRecord::RTR) ? 'R' : 'T';
   }
   else
   {
-    tmp[len++] = (msg.RTR) ? 'r' : 't';
-    tmp[len++] = hex_to_char(msg.Id >> 8); 
-    tmp[len++] = hex_to_char(msg.Id >> 4);
-    tmp[len++] = hex_to_char(msg.Id >> 0);
+    tmp[len++] = (rec.flags & BinRecord::RTR) ? 'r' : 't';
   }
 
-  tmp[len++] = hex_to_char(msg.DLC >> 0);
-  uint16_t i = 0;
-  while (!msg.RTR && i < msg.DLC)
+  if (rec.type == BinRecord::Error)
   {
-  tmp[len++] = hex_to_char(msg.Data8[i] >> 4);
-  tmp[len++] = hex_to_char(msg.Data8[i] >> 0);
-  i++;
+    // no identifier
+  }
+  else if (rec.flags & BinRecord::IDE)  // if Ext frame
+  {
+    put_hex32(tmp, len, rec.id);
+  }
+  else
+  {
+    tmp[len++] = hex_to_char(rec.id >> 8);
+    put_hex8(tmp, len, rec.id);
   }
 
-  if (CANbus::timestamp())
+  if (rec.type == BinRecord::Frame)
   {
-    tmp[len++] = hex_to_char( msg.Time >> 12);
-    tmp[len++] = hex_to_char( msg.Time >> 8);
-    tmp[len++] = hex_to_char( msg.Time >> 4);
-    tmp[len++] = hex_to_char( msg.Time >> 0);
+    tmp[len++] = hex_to_char(rec.dlc >> 0);
+    for (uint32_t i = 0; i < dlen; i++)
+    {
+      put_hex8(tmp, len, rec.data[i]);
+    }
+  }
+
+  if (rec.flags & BinRecord::Time)
+  {
+    if (rec.flags & BinRecord::Micro) put_hex16(tmp, len, rec.time >> 16);
+    put_hex16(tmp, len, rec.time);
   }
 
   tmp[len++] = '\r';	
- 
-  for (uint8_t i = 0; i < len; i++)
+  return len;
+}
+
+
+#ifdef CDC_IN_ZERO_COPY
+
+static volatile uint32_t tx_produced = 0;   // bytes the queued records format to
+static volatile uint32_t tx_consumed = 0;   // record bytes written into IN packets, headers not counted
+
+
+static bool QueueRecord (BinRecord::Record& rec)
+{
+  Stream mode = stream;
+  rec.reserved = static_cast<uint8_t>(mode); // travels with the record, cleared on output
+  if (!txrecords.push(rec)) return false;    // overflow is counted by the fifo
+#ifdef LATENCY_STATS
+  txstamps.push(CANbus::time_us());
+#endif
+
+  tx_produced = tx_produced + FormatSize(rec, mode);
+  return true;
+}
+
+
+uint32_t VCP_TxPending (void)
+{
+  return tx_produced - tx_consumed;
+}
+
+
+static inline Stream RecordMode (const BinRecord::Record& rec)
+{
+  return static_cast<Stream>(rec.reserved);
+}
+
+
+// Next record for the IN packet, with the mode it was queued in
+static Stream TakeRecord (BinRecord::Record& rec)
+{
+  txrecords.pop(rec);
+#ifdef LATENCY_STATS
+  uint32_t queued;
+  if (txstamps.pop(queued) && rec.type == BinRecord::Frame) Latency::add(Latency::Queue, queued);
+#endif
+  Stream mode = RecordMode(rec);
+  rec.reserved = 0;
+  return mode;
+}
+
+
+uint16_t VCP_TxFill (uint16_t pma, uint16_t max)
+{
+  // A record that did not fit into the previous packet continues here
+  static uint8_t carry[FormatMax];
+  static uint32_t carry_len = 0;
+  static uint32_t carry_pos = 0;
+
+  PMA_Stream st;
+  PMA_StreamInit(&st, pma);
+
+  uint32_t len = 0;
+  uint32_t headers = 0;
+  while (len < max)
+  {
+    if (carry_pos == carry_len)
+    {
+      size_t avail;
+      const BinRecord::Record* next = txrecords.peek(avail);
+      if (avail == 0) break;
+
+      if (RecordMode(*next) == Stream::BinaryBatch)
+      {
+        // One header for the batch records that fit whole, the next
+        // packet starts with the rest
+        uint32_t room = (max - len >= sizeof(BinRecord::Header) + sizeof(BinRecord::Record)) ?
+                        (max - len - sizeof(BinRecord::Header)) / sizeof(BinRecord::Record) : 0;
+        uint32_t count = 0;
+        while (count < room && count < avail && RecordMode(next[count]) == Stream::BinaryBatch) count++;
+        if (count == 0) break;
+
+        uint8_t hdr[sizeof(BinRecord::Header)];
+        PMA_StreamWrite(&st, hdr, BinHeader(hdr, count));
+        for (uint32_t i = 0; i < count; i++)
+        {
+          BinRecord::Record rec;
+          TakeRecord(rec);
+          PMA_StreamWrite(&st, reinterpret_cast<const uint8_t*>(&rec), sizeof(rec));
+        }
+        len += sizeof(hdr) + count * sizeof(BinRecord::Record);
+        headers += sizeof(hdr);
+        continue;
+      }
+
+      BinRecord::Record rec;
+      Stream mode = TakeRecord(rec);
+      carry_len = FormatRecord(rec, mode, carry);
+      carry_pos = 0;
+    }
+    uint32_t n = carry_len - carry_pos;
+    if (n > max - len) n = max - len;
+    PMA_StreamWrite(&st, &carry[carry_pos], n);
+    carry_pos += n;
+    len += n;
+  }
+  PMA_StreamFlush(&st);
+
+  tx_consumed = tx_consumed + (len - headers);
+  return len;
+}
+
+#else
+
+// Header of the last batch queued, nullptr once anything else went after it
+static uint8_t* batch = nullptr;
+
+
+// A batch record joins the batch before it while that is still waiting in
+// the IN buffer, whole and right in front of it, else starts a new one
+static bool QueueBatch (BinRecord::Record& rec)
+{
+  if (batch != nullptr && VCP_TxUnsent(batch))
+  {
+    BinRecord::Header hdr;
+    memcpy(&hdr, batch, sizeof(hdr));
+    uint8_t* tmp = VCP_TxReserve(sizeof(rec));
+    if (hdr.count < 0xFF && tmp == batch + sizeof(hdr) + hdr.length)
+    {
+      BinHeader(batch, hdr.count + 1);
+      VCP_TxCommit(FormatRecord(rec, Stream::BinaryBatch, tmp));
+      return true;
+    }
+  }
+
+  uint8_t* tmp = VCP_TxReserve(sizeof(BinRecord::Header) + sizeof(rec));
+  if (tmp == nullptr) return false;
+  uint32_t len = BinHeader(tmp, 1);
+  len += FormatRecord(rec, Stream::BinaryBatch, &tmp[len]);
+  batch = tmp;
+  VCP_TxCommit(len);
+  return true;
+}
+
+
+static bool QueueRecord (BinRecord::Record& rec)
+{
+  // The record is formatted in place and committed as a whole
+  Stream mode = stream;
+  if (mode == Stream::BinaryBatch) return QueueBatch(rec);
+
+  uint8_t* tmp = VCP_TxReserve(FormatSize(rec, mode));
+  if (tmp == nullptr) return false;
+  batch = nullptr;
+  VCP_TxCommit(FormatRecord(rec, mode, tmp));
+  return true;
+}
+
+#endif
+
+
+// Frames lost since the last Overflow record made it into the stream
+static uint32_t lost = 0;
+
+
+// Called with interrupts masked: the USB interrupt takes txrecords and
+// txstamps in step
+static void PutRecord (BinRecord::Record& rec)
+{
+  if (lost != 0)
+  {
+    BinRecord::Record ovr;
+    memset(&ovr, 0, sizeof(ovr));
+    ovr.type = BinRecord::Overflow;
+    ovr.id = lost;
+    if (QueueRecord(ovr)) lost = 0;
+  }
+
+  if (lost != 0 || !QueueRecord(rec))
+  {
+    lost++;   // keep the order: nothing goes out before the marker
+  }
+#ifdef CDC_IN_ZERO_COPY
+  usbd_cdc_Kick();
+#endif
+}
+
+
+#ifndef USE_GS_USB
+
+static void CANEvent (CANbus::Event ev)
+{
+  if (ev == CANbus::Event::Overrun)
+  {
+    lost++;   // shows as an Overflow record, in place: events come in order with the frames
+    return;
+  }
+  if (!(events & EventError)) return;
+
+  CANbus::Errors err;
+  CANbus::errors(err);
+
+  BinRecord::Record rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.type = BinRecord::Error;
+  rec.dlc = static_cast<uint8_t>(ev);
+  rec.data[0] = err.TEC;
+  rec.data[1] = err.REC;
+  rec.data[2] = err.LEC;
+  rec.data[3] = err.State;
+  CANbus::TimeStamp ts = CANbus::timestamp();
+  if (ts != CANbus::TimeStamp::Off)
+  {
+    rec.flags = BinRecord::Time | ((ts == CANbus::TimeStamp::Micro) ? BinRecord::Micro : 0);
+    rec.time = CANbus::time();
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  PutRecord(rec);
+  __set_PRIMASK(primask);
+}
+
+
+
+static inline void VCP_PutResp (const char* str, CANbus::Status st)
+{
+  static uint8_t tmp[68];   // longest reply: "h" with 16 counters, main loop only
+  uint32_t len = 0;
+  if (st == CANbus::Status::Ok)
+  {
+    while (*str && len < sizeof(tmp) - 1) tmp[len++] = *str++;
+  }
+  tmp[len++] = (st == CANbus::Status::Ok) ? '\r' : '\a';
+
+  // The reply travels as Reply records, 8 chars each, queued in one piece 
+  // so CAN frames can't get in between
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  for (uint32_t i = 0; i < len; i += 8)
+  {
+    BinRecord::Record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = BinRecord::Reply;
+    rec.dlc = (len - i > 8) ? 8 : (len - i);
+    memcpy(rec.data, &tmp[i], rec.dlc);
+    PutRecord(rec);
+  }
+  __set_PRIMASK(primask);
+}
+
+
+static void TransmitDone (CANbus::TxDone &done)
+{
+  if (!(events & EventTxDone)) return;
+
+  BinRecord::Record rec;
+  rec.type = BinRecord::TxDone;
+  rec.flags = ((done.Msg.IDE) ? BinRecord::IDE : 0) | ((done.Msg.RTR) ? BinRecord::RTR : 0);
+  rec.dlc = done.Msg.DLC;
+  rec.reserved = 0;
+  rec.id = done.Msg.Id;
+  memset(rec.data, 0, sizeof(rec.data));
+  memcpy(rec.data, &done.Msg.Tag, sizeof(done.Msg.Tag));
+  rec.data[4] = static_cast<uint8_t>(done.Result);
+  rec.time = 0;
+  CANbus::TimeStamp ts = CANbus::timestamp();
+  if (ts != CANbus::TimeStamp::Off)
+  {
+    rec.flags |= BinRecord::Time | ((ts == CANbus::TimeStamp::Micro) ? BinRecord::Micro : 0);
+    rec.time = done.Time;
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  PutRecord(rec);
+  __set_PRIMASK(primask);
+}
+
+
+// FormatRecord() on target, timed with SysTick at the 48 MHz core clock:
+// 8 passes over 32 standard frames with 8 data bytes and a ms time stamp,
+// interrupts left on, the fastest pass counts (as in test/bench_core.cpp)
+//   j   - reply jCCCCCCCCFFFFFFFF: cycles per frame, frames per second
+static CANbus::Status FormatBenchCommand (const uint8_t* cmd, uint32_t len, const char*& resp)
+{
+  (void)cmd;
+#ifdef FORMAT_BENCH
+  if (len != 1) return CANbus::Status::Error;
+
+  static const uint32_t Frames = 32;
+  static BinRecord::Record recs[Frames];
+  for (uint32_t i = 0; i < Frames; i++)
+  {
+    memset(&recs[i], 0, sizeof(recs[i]));
+    recs[i].type = BinRecord::Frame;
+    recs[i].flags = BinRecord::Time;
+    recs[i].dlc = 8;
+    recs[i].id = (i * 37) & 0x7FF;
+    recs[i].time = i * 1000;
+    for (uint32_t k = 0; k < 8; k++) recs[i].data[k] = i * 8 + k;
+  }
+
+  uint8_t buf[FormatMax];
+  volatile uint32_t sink = 0;   // the results must look used
+  uint32_t best = 0xFFFFFF;
+  SysTick->LOAD = 0xFFFFFF;
+  SysTick->VAL = 0;
+  SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+  for (uint32_t pass = 0; pass < 8; pass++)
+  {
+    uint32_t start = SysTick->VAL;
+    for (uint32_t i = 0; i < Frames; i++)
+    {
+      sink = sink + FormatRecord(recs[i], Stream::Ascii, buf) + buf[4];
+    }
+    uint32_t cycles = (start - SysTick->VAL) & 0xFFFFFF;   // counts down
+    if (cycles < best) best = cycles;
+  }
+  SysTick->CTRL = 0;
+
+  static char reply[18];
+  uint32_t r = 0;
+  reply[r++] = 'j';
+  put_hex32(reply, r, best / Frames);
+  put_hex32(reply, r, static_cast<uint32_t>(48000000ull * Frames / best));
+  reply[r] = 0;
+  resp = reply;
+  return CANbus::Status::Ok;
+#else
+  (void)len;
+  (void)resp;
+  return CANbus::Status::Error;
+#endif
+}
+
+
+#endif
+
+
+void ReceiveCANMsg (CANbus::RxMsg &msg)
+{
+  if (!Forward::pass(msg)) return;
+
+  BinRecord::Record rec;
+  rec.type = BinRecord::Frame;
+  rec.flags = ((msg.IDE) ? BinRecord::IDE : 0) | ((msg.RTR) ? BinRecord::RTR : 0);
+  rec.dlc = msg.DLC;
+  rec.reserved = 0;
+  rec.id = msg.Id;
+  memcpy(rec.data, msg.Data8, sizeof(rec.data));
+  rec.time = 0;
+  CANbus::TimeStamp ts = CANbus::timestamp();
+  if (ts != CANbus::TimeStamp::Off)
   {
-    txfifo.push(tmp[i]);
+    rec.flags |= BinRecord::Time | ((ts == CANbus::TimeStamp::Micro) ? BinRecord::Micro : 0);
+    rec.time = msg.Time;
   }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  PutRecord(rec);
+  __set_PRIMASK(primask);
 }
 
 
+#ifdef LATENCY_STATS
+
+uint32_t VCP_TxQueued (void)
+{
+  return CANbus::time_us();
+}
+
+
+void VCP_TxSent (uint32_t stamp)
+{
+  Latency::add(Latency::Usb, stamp);
+}
+
+#endif
+
+
+#ifndef USE_GS_USB
+
+// Commands are taken from rxfifo as far as the host has sent them, a line
+// waits in cmd_line for its '\r' while the main loop goes on
+enum class Parse : uint8_t { Line, Burst, Skip };
+
+static const uint32_t LineMax = 40;   // longest line: p with an extended frame and offset, 37
+
+static uint8_t cmd_line[LineMax];
+static uint32_t cmd_len = 0;
+static Handler cmd_run = nullptr;
+static Parse cmd_state = Parse::Line;
+
+
+// Xtiiildd..Tiiiiiiiildd..riiil..\r - any number of frames in one line, queued
+// in order. Each frame is queued as soon as its last digit arrives, one that
+// finds the TX queue full holds the rest of the line in rxfifo while the bus
+// drains it. The first frame that still can't be queued after 50 ms ends the
+// burst and the rest of the line is skipped. Reply XAAAAFFFF: frames queued
+// and the index of the first one that was not, FFFF if none.
+static struct
+{
+  CANbus::TxMsg msg;
+  uint32_t start;     // time_us() when msg was complete
+  uint32_t count;
+  uint32_t failed;
+  bool pending;       // msg waits for room in the TX queue
+} burst;
+
+
+// False when nothing can be done until the host sends more or the TX queue drains
+static bool BurstStep (void)
+{
+  if (burst.pending)
+  {
+    bool room = (CANbus::tx_used() < CANbus::tx_depth());  // no retries counted as rejected
+    if (room && CANbus::send(burst.msg) == CANbus::Status::Ok)
+    {
+      burst.count++;
+    }
+    else if (CANbus::is_open() && CANbus::time_us() - burst.start <= 50000)
+    {
+      return false;
+    }
+    else
+    {
+      burst.failed = burst.count;   // the bus is not taking frames
+    }
+    burst.pending = false;
+    return true;
+  }
+
+  uint8_t tmp;
+  if (!rxfifo.pop(tmp)) return false;
+
+  if (tmp == '\r')
+  {
+    if (cmd_len != 0 && burst.failed == 0xFFFF) burst.failed = burst.count; // cut short
+
+    static char reply[10];
+    uint32_t r = 0;
+    reply[r++] = 'X';
+    put_hex16(reply, r, burst.count);
+    put_hex16(reply, r, burst.failed);
+    reply[r] = 0;
+    VCP_PutResp(reply, CANbus::Status::Ok);
+    cmd_len = 0;
+    cmd_state = Parse::Line;
+    return true;
+  }
+  if (burst.failed != 0xFFFF) return true;  // skipping to the end of the line
+
+  cmd_line[cmd_len++] = tmp;
+  uint32_t n = FrameLength(cmd_line, cmd_len);
+  if (n == 0)
+  {
+    burst.failed = burst.count;
+  }
+  else if (n == cmd_len && ParseFrame(cmd_line, cmd_len, burst.msg) == 0)
+  {
+    burst.failed = burst.count;   // not hex where it should be
+  }
+  else if (n == cmd_len)
+  {
+    burst.start = CANbus::time_us();
+    burst.pending = true;
+    cmd_len = 0;
+  }
+  return true;
+}
+
+
+// Consumes what rxfifo holds and returns, it never waits for the host. At
+// most a packet's worth at a time, received frames wait in the meantime.
+static void ParseCommands (void)
+{
+  for (uint32_t n = 0; n < CDC_DATA_MAX_PACKET_SIZE; n++)
+  {
+    if (cmd_state == Parse::Burst)
+    {
+      if (!BurstStep()) return;
+      continue;
+    }
+
+    uint8_t tmp;
+    if (!rxfifo.pop(tmp)) return;
+
+    if (tmp == '\r')
+    {
+      if (cmd_state == Parse::Skip)
+      {
+        VCP_PutResp("", CANbus::Status::Error);   // too long for any command
+      }
+      else if (cmd_len != 0)
+      {
+        const char* resp = "";
+        CANbus::Status st = cmd_run(cmd_line, cmd_len, resp);
+        VCP_PutResp(resp, st);
+      }
+      cmd_len = 0;
+      cmd_state = Parse::Line;
+    }
+    else if (cmd_len == 0)  // anything but a command letter is dropped here
+    {
+      if (tmp == SendBurstTx)
+      {
+        memset(&burst, 0, sizeof(burst));
+        burst.failed = 0xFFFF;
+        cmd_state = Parse::Burst;
+      }
+      else if ((cmd_run = FindCommand(tmp)) != nullptr)
+      {
+        cmd_line[cmd_len++] = tmp;
+      }
+    }
+    else if (cmd_len < LineMax)
+    {
+      cmd_line[cmd_len++] = tmp;
+    }
+    else
+    {
+      cmd_state = Parse::Skip;
+    }
+  }
+}
+
+#endif
+
+
 /*********************************************************************
 *
 *       main()
@@ -226,80 +1585,26 @@ int main(void)
   GPIOB->MODER &= ~GPIO_MODER_MODER10;
   GPIOB->MODER |= GPIO_MODER_MODER10_0; // output
 
+  PaintStack();
+
   CANbus::init();
+
+#ifdef USE_GS_USB
+  GSUSB::run();
+#else
   CANbus::set_rx_cb(ReceiveCANMsg);
+  CANbus::set_event_cb(CANEvent);
+  CANbus::set_tx_cb(TransmitDone);
+  Cyclic::init();
 
   USBD_Init(&USB_Device_dev, &USR_desc, &USBD_CDC_cb, &USR_cb);
   
   while (1)
   {
-    if (!rxfifo.empty())
-    {
-      CANbus::Status st = CANbus::Status::Error;
-      uint8_t tmp;
-      rxfifo.pop(tmp);
-      bool skip_resp = false;
-      
-      switch (tmp)
-      {
-        case GetVersionSW: VCP_PutStr("vSTM32"); st = CANbus::Status::Ok; break;
-        case GetVersionHW: VCP_PutStr("V0102"); st = CANbus::Status::Ok; break;
-        case GetStatus:    VCP_PutStr("F00"); st = CANbus::Status::Ok; break;      // TODO: add response
-        case OpenCAN:
-          txfifo.clear();
-          st = CANbus::open(CANbus::OpenMode::Normal);
-          break;
-        case OpenCANLoopback: st = CANbus::open(CANbus::OpenMode::LoopBack); break;
-        case OpenCANListen:   st = CANbus::open(CANbus::OpenMode::ListenOnly); break;
-        case CloseCAN:        st = CANbus::close(); break;       
-        case SetTimestamping: 
-          while (false == rxfifo.pop(tmp)){};
-          st = CANbus::timestamp((tmp=='0') ? false : true);
-          break;
-        case SetBitrate:
-          while (false == rxfifo.pop(tmp)){};
-          st = CANbus::bitrate(GetBitrate(tmp));
-          break;
-        case SetBitrateCustom:
-          st = CANbus::bitrate(GetBitrateCustom());
-          break;
-        case SendStd: case SendStdRTR:
-          st = SendCANMsg(tmp);
-          if (st==CANbus::Status::Ok) VCP_PutStr("z");
-          break;		
-        case SendExt: case SendExtRTR:
-          st = SendCANMsg(tmp);
-          if (st==CANbus::Status::Ok) VCP_PutStr("Z");
-          break;		
-        case SetFilterCode:
-          st = CANbus::filtercode(get_word());
-          break;
-        case SetFilterMask:
-          st = CANbus::filtermask(get_word());
-          break;
-        default:
-          st = CANbus::Status::Ok;
-          skip_resp = true;
-          break;
-      }
-      
-      if (!skip_resp)
-      {
-        VCP_PutStr ((st==CANbus::Status::Ok) ? "\r" : "\a");
-        skip_resp = false;
-      }
-    }
-
-    while(1)
-    {
-      uint8_t tmp;
-      if (txfifo.front(tmp) && (VCP_DataTx(&tmp, 1) == 1)) {
-        txfifo.pop(tmp); /* remove char from queue only if it successfully written to VCP */
-      } else {
-        break;
-      }
-    }
+    CANbus::poll();
+    ParseCommands();
   }
+#endif
 }
 
 /*************************** End of file ****************************/
@@ -58,14 +58,19 @@
 #define ENDP0_RX_ADDRESS   (0x40)
 #define ENDP0_TX_ADDRESS   (0x80)
 
-/* EP2 Tx buffer base address */
+/* EP1 Tx buffers base address: double buffered for CDC, gs_usb uses the first one */
 #define BULK_IN_TX_ADDRESS  (0xC0) 
+#define BULK_IN_TX_ADDRESS1 (0x100)
+
+/* EP3 Rx buffers base address: double buffered for CDC, gs_usb EP2 uses the first one */
+#define BULK_OUT_RX_ADDRESS  (0x140)
+#define BULK_OUT_RX_ADDRESS1 (0x180)
 
-/* EP2 Rx buffer base address */
-#define BULK_OUT_RX_ADDRESS (0x110)
+/* EP2 Tx buffer base address */
+#define INT_IN_TX_ADDRESS   (0x1C0)
 
-/* EP3 Tx buffer base address */
-#define INT_IN_TX_ADDRESS   (0x100)
+/* DCD_PMA_Config argument for a double buffered endpoint */
+#define PMA_DBL_ADDRESS(buf0, buf1)  (((uint32_t)(buf1) << 16) | (buf0))
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 
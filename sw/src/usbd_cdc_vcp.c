@@ -26,6 +26,7 @@
   */ 
 
 /* Includes ------------------------------------------------------------------*/
+#include <string.h>
 #include "usbd_cdc_vcp.h"
 
 /* Private typedef -----------------------------------------------------------*/
@@ -36,15 +37,22 @@
 
 
 
+#ifndef CDC_IN_ZERO_COPY
 /* These are external variables imported from CDC core to be used for IN 
    transfer management. */
-extern uint8_t  APP_Rx_Buffer []; /* Write CDC received data in this buffer.
-                                     These data will be sent over USB IN endpoint
-                                     in the CDC core functions. */
-extern uint32_t APP_Rx_idx_in;    /* Increment this pointer or roll it back to
-                                     start address when writing received data
-                                     in the buffer APP_Rx_Buffer. */
-extern uint32_t APP_Rx_idx_out;
+extern volatile uint8_t  APP_Rx_Buffer []; /* Write CDC received data in this buffer.
+                                              These data will be sent over USB IN endpoint
+                                              in the CDC core functions. */
+extern volatile uint32_t APP_Rx_idx_in;    /* Increment this pointer or roll it back to
+                                              start address when writing received data
+                                              in the buffer APP_Rx_Buffer. */
+extern volatile uint32_t APP_Rx_idx_out;
+extern volatile uint32_t APP_Rx_idx_wrap;  /* End of valid data when APP_Rx_idx_in 
+                                              has rolled back before APP_Rx_idx_out */
+
+static volatile uint32_t VCP_TxOverflows = 0;
+static volatile uint32_t VCP_TxHighWater = 0;
+#endif
 
 /* Private function prototypes -----------------------------------------------*/
 static uint16_t VCP_Init     (void);
@@ -103,34 +111,169 @@ static uint16_t VCP_Ctrl (uint32_t Cmd, uint8_t* Buf, uint32_t Len)
   return USBD_OK;
 }
 
+#ifndef CDC_IN_ZERO_COPY
+/**
+  * @brief  VCP_TxReserve
+  *         Reserve a contiguous block in the IN buffer. Data written into it
+  *         is not seen by the CDC core until VCP_TxCommit is called, so a
+  *         block is always sent as a whole. Only one block may be reserved
+  *         at a time and the caller must not be preempted by another writer
+  *         until it is committed: the CAN and USB interrupts share one 
+  *         priority, any other context has to mask interrupts (see VCP_DataTx).
+  * @param  Len: Number of bytes needed
+  * @retval Pointer to the block or NULL if there is no room for Len bytes
+  */
+uint8_t* VCP_TxReserve (uint32_t Len)
+{
+  uint32_t idx_in  = APP_Rx_idx_in;
+  uint32_t idx_out = APP_Rx_idx_out;
+
+  if (idx_in >= idx_out)
+  {
+    if (idx_in + Len <= APP_RX_DATA_SIZE)
+    {
+      return (uint8_t*)&APP_Rx_Buffer[idx_in];
+    }
+    if (Len < idx_out) 
+    {
+      /* No room left at the end: mark where the data stops and roll back */
+      APP_Rx_idx_wrap = idx_in;
+      APP_Rx_idx_in = 0;
+      return (uint8_t*)&APP_Rx_Buffer[0];
+    }
+  }
+  else if (idx_in + Len < idx_out)
+  {
+    return (uint8_t*)&APP_Rx_Buffer[idx_in];
+  }
+
+  VCP_TxOverflows++;
+  return NULL;
+}
+
+/**
+  * @brief  VCP_TxCommit
+  *         Hand the block obtained from VCP_TxReserve over to the CDC core
+  *         and let it start an IN transfer if the endpoint is idle.
+  * @param  Len: Number of bytes actually written, not more than reserved
+  * @retval None
+  */
+void VCP_TxCommit (uint32_t Len)
+{
+  APP_Rx_idx_in = APP_Rx_idx_in + Len;
+  uint32_t used = VCP_TxUsed();
+  if (used > VCP_TxHighWater)
+  {
+    VCP_TxHighWater = used;
+  }
+  usbd_cdc_Kick();
+}
+
+/**
+  * @brief  VCP_TxUsed
+  * @param  None
+  * @retval Bytes in the IN buffer not sent yet
+  */
+uint32_t VCP_TxUsed (void)
+{
+  uint32_t idx_in  = APP_Rx_idx_in;
+  uint32_t idx_out = APP_Rx_idx_out;
+  return (idx_in >= idx_out) ? (idx_in - idx_out) : (APP_Rx_idx_wrap - idx_out + idx_in);
+}
+
+/**
+  * @brief  VCP_TxUnsent
+  *         Tell whether a committed byte still waits in the IN buffer: the
+  *         writer may then change it in place. Same context rules as
+  *         VCP_TxReserve.
+  * @param  Ptr: Byte in a block obtained from VCP_TxReserve
+  * @retval 1 if the CDC core has not taken it yet, else 0
+  */
+uint8_t VCP_TxUnsent (const uint8_t* Ptr)
+{
+  uint32_t idx     = Ptr - (const uint8_t*)APP_Rx_Buffer;
+  uint32_t idx_in  = APP_Rx_idx_in;
+  uint32_t idx_out = APP_Rx_idx_out;
+
+  if (idx_in >= idx_out)
+  {
+    return (idx >= idx_out) && (idx < idx_in);
+  }
+  return ((idx >= idx_out) && (idx < APP_Rx_idx_wrap)) || (idx < idx_in);
+}
+
+/**
+  * @brief  VCP_TxPeak
+  * @param  None
+  * @retval Most bytes the IN buffer has held since VCP_TxClearStats
+  */
+uint32_t VCP_TxPeak (void)
+{
+  return VCP_TxHighWater;
+}
+
+/**
+  * @brief  VCP_TxClearStats
+  *         Restart the high-water mark from the current level and the
+  *         overflow count from 0. Same context rules as VCP_TxReserve.
+  * @param  None
+  * @retval None
+  */
+void VCP_TxClearStats (void)
+{
+  VCP_TxHighWater = VCP_TxUsed();
+  VCP_TxOverflows = 0;
+}
+
+/**
+  * @brief  VCP_TxDropped
+  * @param  None
+  * @retval Number of failed VCP_TxReserve calls
+  */
+uint32_t VCP_TxDropped (void)
+{
+  return VCP_TxOverflows;
+}
+
 /**
   * @brief  VCP_DataTx
   *         CDC received data to be send over USB IN endpoint are managed in 
-  *         this function.
+  *         this function. Safe to call from any context.
   * @param  Buf: Buffer of data to be sent
   * @param  Len: Number of data to be sent (in bytes)
-  * @retval Result of the operation: Number of bytes sent
+  * @retval Result of the operation: Number of bytes sent (Len or 0)
   */
 uint16_t VCP_DataTx (uint8_t* Buf, uint32_t Len)
 {
-  uint16_t i = 0;
-  while (i < Len)
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  uint8_t* dst = VCP_TxReserve(Len);
+  if (dst != NULL)
   {
-    uint32_t tmp = APP_Rx_idx_in + 1;
-    if (tmp >= APP_RX_DATA_SIZE)
-    {
-      tmp = 0;
-    }
-     
-    if (tmp == APP_Rx_idx_out)
-    {
-      break; /* buffer is full */
-    }
-    APP_Rx_Buffer[APP_Rx_idx_in] = Buf[i++];
-    APP_Rx_idx_in = tmp;
+    memcpy(dst, Buf, Len);
+    VCP_TxCommit(Len);
   }
-  return i;
+
+  __set_PRIMASK(primask);
+  return (dst != NULL) ? Len : 0;
+}
+#else
+/**
+  * @brief  VCP_DataTx
+  *         Raw data can't be queued in CDC_IN_ZERO_COPY mode, the application
+  *         feeds the IN endpoint through VCP_TxFill.
+  * @param  Buf: Buffer of data to be sent
+  * @param  Len: Number of data to be sent (in bytes)
+  * @retval Result of the operation: 0
+  */
+uint16_t VCP_DataTx (uint8_t* Buf, uint32_t Len)
+{
+  (void)Buf;
+  (void)Len;
+  return 0;
 }
+#endif
 
 /**
   * @brief  VCP_DataRx
@@ -42,6 +42,15 @@
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 extern uint16_t VCP_DataTx (uint8_t* Buf, uint32_t Len);
+#ifndef CDC_IN_ZERO_COPY
+extern uint8_t* VCP_TxReserve (uint32_t Len);
+extern void     VCP_TxCommit (uint32_t Len);
+extern uint32_t VCP_TxDropped (void);
+extern uint32_t VCP_TxUsed    (void);
+extern uint8_t  VCP_TxUnsent  (const uint8_t* Ptr);
+extern uint32_t VCP_TxPeak    (void);
+extern void     VCP_TxClearStats (void);
+#endif
 extern uint16_t VCP_callback(uint8_t* Buf, uint32_t Len);
 
 #endif /* __USBD_CDC_VCP_H */
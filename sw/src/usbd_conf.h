@@ -41,6 +41,10 @@
 
 #define USB_MAX_STR_DESC_SIZ            255 
 
+/* Enumerate as gs_usb (candleLight) compatible device for the Linux gs_usb
+   SocketCAN driver instead of CDC Virtual COM port with LAWICEL protocol */
+/* #define USE_GS_USB */
+
 #define CDC_IN_EP                       0x81  /* EP1 for data IN */
 #define CDC_OUT_EP                      0x03  /* EP3 for data OUT */
 #define CDC_CMD_EP                      0x82  /* EP2 for CDC commands */
@@ -49,12 +53,36 @@
 #define CDC_DATA_MAX_PACKET_SIZE       64   /* Endpoint IN & OUT Packet size */
 #define CDC_CMD_PACKET_SZE             8    /* Control Endpoint Packet size */
 
-#define CDC_IN_FRAME_INTERVAL          1    /* Number of frames between IN transfers */
-#define APP_RX_DATA_SIZE               4096 /* Total size of IN buffer: 
-                                                APP_RX_DATA_SIZE*8/MAX_BAUDARATE*1000 should be > CDC_IN_FRAME_INTERVAL */
+#define CDC_IN_FLUSH_DEADLINE          2    /* Frames a partial IN packet may wait behind one in flight */
+#define APP_RX_DATA_SIZE               6144 /* Total size of IN buffer: 
+                                                APP_RX_DATA_SIZE*8/MAX_BAUDARATE*1000 should be > CDC_IN_FLUSH_DEADLINE.
+                                                CAN frames are formatted straight into it, so it is the only
+                                                device-to-host queue. */
+
+/* IN packets are formatted straight into packet memory from a queue of frame
+   records (see VCP_TxFill), APP_Rx_Buffer is not used. Comment out to format
+   into APP_Rx_Buffer and copy from there. */
+#define CDC_IN_ZERO_COPY
+
+/* Single buffered CDC data endpoints, one IN packet queued at a time, as
+   before double buffering. For comparison, see test/bench_usb.cpp. */
+/* #define CDC_SNG_BUF */
+
+/* Latency histograms of received frames per stage (see latency.hpp), read
+   with the 'h' command. Comment out to build without the time stamping. */
+#define LATENCY_STATS
+
+/* The 'j' command times frame formatting on target with SysTick, see
+   FormatBenchCommand() in main.cpp. Off in normal builds. */
+/* #define FORMAT_BENCH */
 
 #define APP_FOPS                        VCP_fops
 
+#define GS_USB_IN_EP                    0x81  /* EP1 for frames IN */
+#define GS_USB_OUT_EP                   0x02  /* EP2 for frames OUT */
+
+#define GS_USB_FOPS                     GS_USB_fops
+
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 
@@ -30,16 +30,29 @@
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+#ifdef USE_GS_USB
+/* candleLight IDs, matched by the Linux gs_usb driver */
+#define USBD_VID                        0x1D50
+#define USBD_PID                        0x606F
+#else
 #define USBD_VID                        0x0483
 #define USBD_PID                        0x5740
+#endif
 
 #define USBD_LANGID_STRING              0x409
 #define USBD_MANUFACTURER_STRING        "STMicroelectronics"
 
+#ifdef USE_GS_USB
+#define USBD_PRODUCT_FS_STRING          "USB-CAN gs_usb adapter"
+
+#define USBD_CONFIGURATION_FS_STRING    "gs_usb Config"
+#define USBD_INTERFACE_FS_STRING        "gs_usb Interface"
+#else
 #define USBD_PRODUCT_FS_STRING          "STM32 Virtual ComPort in FS Mode"
 
 #define USBD_CONFIGURATION_FS_STRING    "VCP Config"
 #define USBD_INTERFACE_FS_STRING        "VCP Interface"
+#endif
 
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
@@ -0,0 +1,151 @@
+#ifndef _BENCH_HPP_
+#define _BENCH_HPP_
+
+// Host benchmarks. Each case is timed as the best of several runs and
+// expressed in calibration units, the time of one step of a fixed integer
+// loop measured at start, so one baseline file serves fast and slow machines
+// alike. The run fails when a case costs more than threshold times its
+// baseline.
+//
+//   bench_x [--baseline FILE] [--threshold 2.0] [--update]
+//
+// --update rewrites this executable's entries of FILE with the results.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+class Bench
+{
+public:
+  Bench (int argc, char** argv) : threshold(2.0), update(false), failed(false)
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      if (!strcmp(argv[i], "--baseline") && i + 1 < argc) file = argv[++i];
+      else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) threshold = atof(argv[++i]);
+      else if (!strcmp(argv[i], "--update")) update = true;
+    }
+    load();
+    unit = best([] { calibration(); }, 2000) / 1000;
+    printf("calibration unit %.3f ns\n", unit);
+  }
+
+  // Times f(), a case costing n operations; the result is per operation
+  template <class F>
+  void run (const char* name, uint32_t n, F f, uint32_t reps = 0)
+  {
+    if (reps == 0) reps = 1 + 200000 / n;
+    double ns = best(f, reps) / n;
+    result(name, ns / unit, ns);
+  }
+
+  // A figure that is not a time (bytes per frame, frames lost), printed and
+  // compared to its baseline like a time
+  void metric (const char* name, double value)
+  {
+    result(name, value, -1);
+  }
+
+  // Two cases against each other, printed only
+  void ratio (const char* name, double value)
+  {
+    printf("%-40s %10.2fx\n", name, value);
+  }
+
+  double last (void) const { return last_ns; }
+
+  int done (void)
+  {
+    if (update) save();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+private:
+  std::string file;
+  double threshold;
+  bool update;
+  bool failed;
+  double unit;
+  double last_ns;
+  std::map<std::string, double> base;
+  std::vector<std::pair<std::string, double>> results;
+
+  static void calibration (void)
+  {
+    uint32_t x = 2463534242u;
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+    }
+    __asm volatile ("" :: "r" (x));   // keep the result
+  }
+
+  // Best per-call time in ns of 7 runs of reps calls
+  template <class F>
+  static double best (F f, uint32_t reps)
+  {
+    double min = 1e30;
+    for (int run = 0; run < 7; run++)
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      for (uint32_t i = 0; i < reps; i++) f();
+      std::chrono::duration<double, std::nano> dt = std::chrono::steady_clock::now() - t0;
+      if (dt.count() / reps < min) min = dt.count() / reps;
+    }
+    return min;
+  }
+
+  void result (const char* name, double value, double ns)
+  {
+    last_ns = ns;
+    results.push_back(std::make_pair(std::string(name), value));
+    if (ns >= 0) printf("%-40s %10.4f units %10.1f ns", name, value, ns);
+    else printf("%-40s %10.4f      ", name, value);
+
+    auto b = base.find(name);
+    if (b == base.end())
+    {
+      printf("   (no baseline)\n");
+      return;
+    }
+    printf("   baseline %10.4f", b->second);
+    if (value > b->second * threshold)
+    {
+      printf("   REGRESSION");
+      failed = !update;
+    }
+    printf("\n");
+  }
+
+  void load (void)
+  {
+    if (file.empty()) return;
+    FILE* f = fopen(file.c_str(), "r");
+    if (!f) return;
+    char name[128];
+    double v;
+    while (fscanf(f, "%127s %lf", name, &v) == 2) base[name] = v;
+    fclose(f);
+  }
+
+  void save (void)
+  {
+    if (file.empty()) return;
+    for (auto& r : results) base[r.first] = r.second;
+    FILE* f = fopen(file.c_str(), "w");
+    if (!f) return;
+    for (auto& b : base) fprintf(f, "%s %.4f\n", b.first.c_str(), b.second);
+    fclose(f);
+  }
+};
+
+#endif // _BENCH_HPP_
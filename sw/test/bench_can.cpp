@@ -0,0 +1,254 @@
+// Receive bursts on the bxCAN model: the shortest frame interval at which a
+// burst gets through FIFO0 without loss, with the CAN interrupt draining the
+// FIFO per entry as it does now, and taking one frame per entry as it did
+// before, each after the interrupts were held off for a while.
+//
+// Time is simulated with Cortex-M0 costs at 48 MHz: an interrupt entry and
+// exit, then each frame taken out of the FIFO. Frames that arrive while the
+// handler runs are in the FIFO for its next pass; the draining handler looks
+// again before it returns, the old one only on its next entry. The main loop
+// runs between entries at no cost, the records are checked at the end.
+//
+// Back-to-back transmission: bus time per frame while the host offers more
+// than the bus takes, through the TX queue and straight into the mailboxes
+// as send() did before. The host writes once per 1 ms USB frame and sends
+// what was refused again in the next one.
+#include "firmware.hpp"
+#include "decode.hpp"
+#include "bench.hpp"
+
+extern "C" void CEC_CAN_IRQHandler (void);
+
+
+static const uint64_t EntryNs = 1500;   // stacking, vector fetch, TSR/ESR checks, unstacking
+static const uint64_t FrameNs = 2000;   // filter, time stamp, ring push, release
+static const uint32_t BurstFrames = 64;
+static const uint64_t UsbFrameNs = 1000000;
+static const uint64_t TxFrameNs = 111000;     // 8 data bytes, standard identifier, interframe space, at 1 Mbit/s
+static const uint32_t TxPerUsbFrame = 16;
+
+
+// The handler as it was before: one message per entry
+static void one_per_entry (void)
+{
+  if (CAN->RF0R & CAN_RF0R_FMP0)
+  {
+    volatile uint32_t rir = CAN->sFIFOMailBox[0].RIR;
+    (void)rir;
+    CAN->RF0R = CAN_RF0R_RFOM0 | CAN_RF0R_FULL0 | CAN_RF0R_FOVR0;
+  }
+}
+
+
+// send() as it was before the queue: a free mailbox or nothing
+static bool mailbox_only (CANbus::TxMsg& msg)
+{
+  if (!(CAN->TSR & CAN_TSR_TME)) return false;
+  uint32_t mb = (CAN->TSR & CAN_TSR_CODE) >> 24;
+  CAN->sTxMailBox[mb].TDTR = msg.DLC;
+  CAN->sTxMailBox[mb].TDLR = msg.Data32[0];
+  CAN->sTxMailBox[mb].TDHR = msg.Data32[1];
+  CAN->sTxMailBox[mb].TIR = (msg.Id << 21) | CAN_TI0R_TXRQ;
+  return true;
+}
+
+
+// Bus time per frame over ms USB frames; -1 if the frames went out of order
+static double back_to_back (bool queue, CANbus::TxPolicy policy, uint32_t ms)
+{
+  CANbus::tx_policy(policy);
+  uint32_t next = 0;
+  uint32_t sent = 0;
+  bool ordered = true;
+  uint64_t bus = 0;
+  for (uint32_t f = 0; f < ms; f++)
+  {
+    uint64_t frame_end = (f + 1) * UsbFrameNs;
+    for (uint32_t i = 0; i < TxPerUsbFrame; i++, next++)
+    {
+      CANbus::TxMsg msg = {};
+      msg.Id = (policy == CANbus::TxPolicy::Priority) ? 0x100 + (next & 7) : 0x100;
+      msg.DLC = 8;
+      msg.Data32[0] = next;
+      bool ok = (queue) ? (CANbus::send(msg) == CANbus::Status::Ok) : mailbox_only(msg);
+      if (!ok) break;
+    }
+
+    if (bus < f * UsbFrameNs) bus = f * UsbFrameNs;
+    while (bus < frame_end && BxCAN::next_tx() >= 0)
+    {
+      BxCAN::Frame out;
+      BxCAN::transmit(out, (bus / 1000) & 0xFFFF);
+      bus += TxFrameNs;
+      uint32_t seq;
+      memcpy(&seq, out.Data, sizeof(seq));
+      if (policy == CANbus::TxPolicy::Fifo && seq != sent) ordered = false;
+      sent++;
+      BxCAN::service();
+      CANbus::poll();
+      Firmware::read();
+    }
+  }
+
+  // What is left goes out before the next case
+  while (BxCAN::next_tx() >= 0)
+  {
+    BxCAN::Frame out;
+    BxCAN::transmit(out, 0);
+    BxCAN::service();
+  }
+  CANbus::poll();
+  Firmware::read();
+  CANbus::tx_policy(CANbus::TxPolicy::Fifo);
+  return (ordered) ? static_cast<double>(ms * UsbFrameNs) / sent : -1;
+}
+
+
+class Burst
+{
+public:
+  Burst (bool drain) : drain(drain) {}
+
+  // Frames lost, in FIFO0 or the ring, from a burst at interval_ns with the
+  // interrupts held off for block_ns from its start
+  uint32_t run (uint64_t interval_ns, uint64_t block_ns)
+  {
+    interval = interval_ns;
+    sent = 0;
+    lost = 0;
+    uint32_t overruns = CANbus::overruns();
+    received.clear();
+
+    uint64_t now = 0;
+    while (arrive(now) || sent < BurstFrames || BxCAN::rx_level() != 0)
+    {
+      if (BxCAN::rx_level() == 0)
+      {
+        now = sent * interval;
+      }
+      else if (now < block_ns)
+      {
+        now = block_ns;
+      }
+      else
+      {
+        now += EntryNs + pass();
+        while (drain && arrive(now)) now += pass();   // the handler's FMP0 check
+        CANbus::poll();
+        received += Firmware::read();
+      }
+    }
+    if (drain) lost += CANbus::overruns() - overruns;
+    return lost;
+  }
+
+  // The shortest interval between 100 ns and 200 us without loss, the last
+  // run one at that interval
+  uint64_t shortest (uint64_t block_ns)
+  {
+    uint64_t lo = 100;
+    uint64_t hi = 200000;
+    while (hi - lo > 10)
+    {
+      uint64_t mid = (lo + hi) / 2;
+      if (run(mid, block_ns) == 0) hi = mid;
+      else lo = mid;
+    }
+    run(hi, block_ns);
+    return hi;
+  }
+
+  // The draining handler's frames in order and whole in the last run, after
+  // the marker of losses in the run before
+  bool check (void) const
+  {
+    std::vector<BinRecord::Record> recs;
+    if (!Decode::ascii(received, recs)) return false;
+    if (!recs.empty() && recs[0].type == BinRecord::Overflow) recs.erase(recs.begin());
+    if (recs.size() != BurstFrames) return false;
+    for (uint32_t i = 1; i < recs.size(); i++)
+    {
+      if (recs[i].data[0] != uint8_t(recs[i - 1].data[0] + 1)) return false;
+    }
+    return true;
+  }
+
+private:
+  bool drain;
+  uint64_t interval = 0;
+  uint32_t sent = 0;
+  uint32_t lost = 0;
+  uint8_t seq = 0;
+  std::string received;
+
+  // Frames of the burst due by now into FIFO0, how many
+  uint32_t arrive (uint64_t now)
+  {
+    uint32_t n = 0;
+    for (; sent < BurstFrames && sent * interval <= now; sent++, n++)
+    {
+      BxCAN::Frame f = Firmware::frame(seq & 0x7FF, "0011223344556677");
+      f.Data[0] = seq++;
+      if (!BxCAN::receive(f, (sent * interval / 1000) & 0xFFFF)) lost++;
+    }
+    return n;
+  }
+
+  // One pass of the handler, the time it took for the frames
+  uint64_t pass (void)
+  {
+    uint32_t level = BxCAN::rx_level();
+    if (drain) CEC_CAN_IRQHandler();
+    else one_per_entry();
+    return (level - BxCAN::rx_level()) * FrameNs;
+  }
+};
+
+
+int main (int argc, char** argv)
+{
+  Bench b(argc, argv);
+
+  Firmware::start();
+  Firmware::command("S8\r");
+  if (Firmware::command("O\r") != "\r")
+  {
+    printf("CAN bus not open\n");
+    return EXIT_FAILURE;
+  }
+
+  Burst drain(true);
+  Burst one(false);
+  for (uint32_t block_us : {0, 5, 10, 50})
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "can_burst_min_frame_ns_block%uus_drain", block_us);
+    double t_drain = drain.shortest(block_us * 1000ull);
+    b.metric(name, t_drain);
+    if (!drain.check())
+    {
+      printf("records broken\n");
+      return EXIT_FAILURE;
+    }
+    snprintf(name, sizeof(name), "can_burst_min_frame_ns_block%uus_one_per_entry", block_us);
+    double t_one = one.shortest(block_us * 1000ull);
+    b.metric(name, t_one);
+    snprintf(name, sizeof(name), "can_burst_one_per_entry_vs_drain_block%uus", block_us);
+    b.ratio(name, t_one / t_drain);
+  }
+
+  double t_queue = back_to_back(true, CANbus::TxPolicy::Fifo, 100);
+  b.metric("can_tx_ns_per_frame_queue", t_queue);
+  double t_priority = back_to_back(true, CANbus::TxPolicy::Priority, 100);
+  b.metric("can_tx_ns_per_frame_queue_priority", t_priority);
+  double t_mailbox = back_to_back(false, CANbus::TxPolicy::Fifo, 100);
+  b.metric("can_tx_ns_per_frame_mailbox_only", t_mailbox);
+  b.ratio("can_tx_mailbox_only_vs_queue", t_mailbox / t_queue);
+  if (t_queue < 0 || t_mailbox < 0 || t_priority < 0)
+  {
+    printf("frames out of order\n");
+    return EXIT_FAILURE;
+  }
+
+  return b.done();
+}
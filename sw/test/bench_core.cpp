@@ -0,0 +1,352 @@
+// Per-operation cost of the firmware's hot paths on the host: the byte FIFO
+// in spans and byte by byte, also as it was before; a received frame from the
+// CAN interrupt to the IN packet in each stream mode, software acceptance of
+// a frame, a frame command from the OUT data to the bus, and the command
+// parser fed in whole packets and in pieces split at random. The hex codec
+// formatting a frame and decoding digits, also as it was before. Besides,
+// what each stream mode costs the host: bytes per frame and decoding time.
+#include "firmware.hpp"
+#include "decode.hpp"
+#include "bench.hpp"
+
+
+// The ring as it was before push_n/pop_n, modulo indices, one byte per call
+template <class T, size_t SIZE>
+class ModuloFIFO
+{
+  T buf[SIZE];
+  size_t in = 0;
+  size_t out = 0;
+
+public:
+  bool push (const T& data)
+  {
+    size_t tmp = (in + 1) % SIZE;
+    if (tmp == out) return false;
+    buf[tmp] = data;
+    in = tmp;
+    return true;
+  }
+
+  bool pop (T& data)
+  {
+    if (in == out) return false;
+    size_t tmp = (out + 1) % SIZE;
+    data = buf[tmp];
+    out = tmp;
+    return true;
+  }
+};
+
+
+// Hex digits as they were before the tables: a branch per character, a
+// nibble at a time out of a table built on every call
+static inline uint8_t branchy_char_to_hex (char c)
+{
+  uint8_t res;
+  if (isdigit(c))
+    res = c - '0';
+  else if (c >= 'a' && c <= 'f')
+    res = c - 'a' + 10;
+  else if (c >= 'A' && c <= 'F')
+    res = c - 'A' + 10;
+  else
+    res = 0xFF;
+  return res;
+}
+
+
+static inline char nibble_to_char (uint8_t hex)
+{
+  const char tbl[16] = {'0', '1', '2', '3',
+                        '4', '5', '6', '7',
+                        '8', '9', 'A', 'B',
+                        'C', 'D', 'E', 'F'};
+  return tbl[hex & 0x0F];
+}
+
+
+// A data frame record in ASCII the old way, identifier to time stamp
+static uint32_t nibble_format (const BinRecord::Record& rec, uint8_t* tmp)
+{
+  uint32_t len = 0;
+  tmp[len++] = (rec.flags & BinRecord::IDE) ? 'T' : 't';
+  for (int s = (rec.flags & BinRecord::IDE) ? 28 : 8; s >= 0; s -= 4) tmp[len++] = nibble_to_char(rec.id >> s);
+  tmp[len++] = nibble_to_char(rec.dlc);
+  for (uint32_t i = 0; i < rec.dlc; i++)
+  {
+    tmp[len++] = nibble_to_char(rec.data[i] >> 4);
+    tmp[len++] = nibble_to_char(rec.data[i]);
+  }
+  for (int s = 28; s >= 0; s -= 4) tmp[len++] = nibble_to_char(rec.time >> s);
+  tmp[len++] = '\r';
+  return len;
+}
+
+
+// IN packets until nothing is pending, as the CDC class would take them
+static void drain (void)
+{
+  while (VCP_TxPending() != 0) VCP_TxFill(BULK_IN_TX_ADDRESS, CDC_DATA_MAX_PACKET_SIZE);
+}
+
+
+static void bench_rx (Bench& b, const char* name, const char* mode)
+{
+  Firmware::command(mode);
+  BxCAN::Frame f = Firmware::frame(0x1A5, "0011223344556677");
+  uint16_t sof = 0;
+  b.run(name, 1, [&] {
+    BxCAN::receive(f, sof++);
+    BxCAN::service();
+    CANbus::poll();
+    drain();
+  });
+}
+
+
+// n extended frames with 8 data bytes as the host reads them in a stream mode
+static std::string stream_of (const char* mode, uint32_t n)
+{
+  Firmware::command(mode);
+  BxCAN::Frame f = Firmware::frame(0x1ABCDEF, "0011223344556677", true);
+  for (uint32_t i = 0; i < n; i++)
+  {
+    f.Data[0] = i;
+    BxCAN::receive(f, i);
+    if (BxCAN::rx_level() == 3 || i == n - 1)
+    {
+      BxCAN::service();
+      CANbus::poll();
+    }
+  }
+  return Firmware::read();
+}
+
+
+static void bench_stream (Bench& b)
+{
+  const uint32_t n = 96;
+  Firmware::command("Z2\r");
+  std::string ascii = stream_of("B0\r", n);
+  std::string binary = stream_of("B1\r", n);
+  std::string batch = stream_of("B2\r", n);
+  Firmware::command("B0\r");
+  Firmware::command("Z0\r");
+
+  b.metric("bytes_per_frame_ascii", static_cast<double>(ascii.size()) / n);
+  b.metric("bytes_per_frame_binary", static_cast<double>(binary.size()) / n);
+  b.metric("bytes_per_frame_batch", static_cast<double>(batch.size()) / n);
+
+  std::vector<BinRecord::Record> out;
+  out.reserve(n);
+  b.run("decode_frame_ascii", n, [&] { out.clear(); Decode::ascii(ascii, out); });
+  double t_ascii = b.last();
+  b.run("decode_frame_binary", n, [&] { out.clear(); Decode::binary(binary, false, out); });
+  b.ratio("decode_binary_vs_ascii", t_ascii / b.last());
+  b.run("decode_frame_batch", n, [&] { out.clear(); Decode::binary(batch, true, out); });
+  b.ratio("decode_batch_vs_ascii", t_ascii / b.last());
+}
+
+
+// Software acceptance per frame, half of the identifiers subscribed; the
+// extended set filled to half its slots
+static void bench_accept (Bench& b)
+{
+  const uint32_t n = 256;
+  uint32_t std_ids[n];
+  uint32_t ext_ids[n];
+  uint32_t x = 2463534242u;
+  CANFilter::soft_clear();
+  CANFilter::soft_enable(true);
+  for (uint32_t i = 0; i < n; i++)
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    std_ids[i] = x & 0x7FF;
+    ext_ids[i] = x & 0x1FFFFFFF;
+    if (i & 1) continue;
+    CANFilter::soft_add(std_ids[i], false);
+    if (i < CANFilter::ExtSlots) CANFilter::soft_add(ext_ids[i], true);
+  }
+
+  volatile uint32_t sink = 0;
+  b.run("soft_accept_std", n, [&] {
+    uint32_t ok = 0;
+    for (uint32_t i = 0; i < n; i++) ok += CANFilter::accept(std_ids[i], false);
+    sink = ok;
+  });
+  b.run("soft_accept_ext", n, [&] {
+    uint32_t ok = 0;
+    for (uint32_t i = 0; i < n; i++) ok += CANFilter::accept(ext_ids[i], true);
+    sink = ok;
+  });
+  (void)sink;
+  CANFilter::soft_enable(false);
+  CANFilter::soft_clear();
+}
+
+
+// A frame record formatted, and hex digits decoded, per frame and per digit;
+// false if the old formatting gives other bytes
+static bool bench_hex (Bench& b)
+{
+  BinRecord::Record rec = {};
+  rec.type = BinRecord::Frame;
+  rec.flags = BinRecord::IDE | BinRecord::Time | BinRecord::Micro;
+  rec.dlc = 8;
+  rec.id = 0x1ABCDEF;
+  rec.time = 0x89ABCDEF;
+  const uint32_t n = 64;
+  uint8_t out[n][32];
+  uint8_t old[32];
+  if (FormatRecord(rec, Stream::Ascii, out[0]) != nibble_format(rec, old) ||
+      memcmp(out[0], old, FormatSize(rec, Stream::Ascii)) != 0)
+  {
+    printf("nibble_format differs from FormatRecord\n");
+    return false;
+  }
+
+  b.run("format_frame_ascii", n, [&] {
+    for (uint32_t i = 0; i < n; i++)
+    {
+      rec.data[0] = i;
+      FormatRecord(rec, Stream::Ascii, out[i]);
+    }
+  });
+  double t_table = b.last();
+  printf("%-40s %10.0f/s\n", "format_frame_ascii_per_s", 1e9 / t_table);
+  b.run("format_frame_nibbles", n, [&] {
+    for (uint32_t i = 0; i < n; i++)
+    {
+      rec.data[0] = i;
+      nibble_format(rec, out[i]);
+    }
+  });
+  b.ratio("format_nibbles_vs_table", b.last() / t_table);
+
+  const uint8_t* digits = reinterpret_cast<const uint8_t*>("0123456789ABCDEFabcdef0011223344556677");
+  const uint32_t m = 32;
+  volatile uint32_t sink = 0;
+  b.run("hex_decode_table", m, [&] {
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < m; i++) acc = (acc << 4) ^ char_to_hex(digits[i]);
+    sink = acc;
+  });
+  t_table = b.last();
+  b.run("hex_decode_branches", m, [&] {
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < m; i++) acc = (acc << 4) ^ branchy_char_to_hex(digits[i]);
+    sink = acc;
+  });
+  b.ratio("hex_decode_branches_vs_table", b.last() / t_table);
+  (void)sink;
+  return true;
+}
+
+
+// Commands through the parser per command, the host's writes cut into
+// pieces of 1 to max bytes; the main loop runs after each piece and the bus
+// takes what was queued
+static void bench_parse (Bench& b, const char* name, uint32_t max)
+{
+  static const char* const cmds[] =
+  {
+    "t1A580011223344556677\r",
+    "T1234567F2AABB\r",
+    "r1230\r",
+    "Xt1238AABBCCDD00112233T012345671FF\r",
+    "F\r",
+    "V\r",
+    "q\r"
+  };
+  const uint32_t n = 140;
+  std::string s;
+  for (uint32_t i = 0; i < n; i++) s += cmds[i % 7];
+
+  std::vector<uint32_t> cuts;
+  uint32_t x = 88172645u;
+  for (size_t pos = 0; pos < s.size(); )
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    pos += 1 + x % max;
+    cuts.push_back((pos < s.size()) ? pos : s.size());
+  }
+
+  BxCAN::Frame out;
+  b.run(name, n, [&] {
+    size_t pos = 0;
+    for (uint32_t cut : cuts)
+    {
+      Firmware::write(s.substr(pos, cut - pos));
+      pos = cut;
+      while (!rxfifo.empty()) ParseCommands();
+      while (BxCAN::transmit(out, 0)) BxCAN::service();
+      CANbus::poll();
+      drain();
+    }
+  });
+  std::string rate = std::string(name) + "_per_s";
+  printf("%-40s %10.0f/s\n", rate.c_str(), 1e9 / b.last());
+}
+
+
+int main (int argc, char** argv)
+{
+  Bench b(argc, argv);
+
+  // 64 bytes in and out, the size of a USB packet; SIZE is not a power of
+  // two for the old ring, it did not need to be
+  static FIFO<uint8_t, 4096> fifo;
+  static ModuloFIFO<uint8_t, 4000> modulo;
+  uint8_t buf[64] = {};
+  b.run("fifo_bytes_push_pop_n", sizeof(buf), [&] {
+    fifo.push_n(buf, sizeof(buf));
+    fifo.pop_n(buf, sizeof(buf));
+  });
+  double t_span = b.last();
+  b.run("fifo_bytes_push_pop", sizeof(buf), [&] {
+    for (uint32_t i = 0; i < sizeof(buf); i++) fifo.push(buf[i]);
+    for (uint32_t i = 0; i < sizeof(buf); i++) fifo.pop(buf[i]);
+  });
+  b.ratio("fifo_push_pop_n_vs_push_pop", b.last() / t_span);
+  b.run("fifo_bytes_modulo_push_pop", sizeof(buf), [&] {
+    for (uint32_t i = 0; i < sizeof(buf); i++) modulo.push(buf[i]);
+    for (uint32_t i = 0; i < sizeof(buf); i++) modulo.pop(buf[i]);
+  });
+  b.ratio("fifo_push_pop_n_vs_modulo", b.last() / t_span);
+  bench_accept(b);
+
+  Firmware::start();
+  Firmware::command("S8\r");
+  Firmware::command("O\r");
+  bench_rx(b, "rx_frame_ascii", "B0\r");
+  bench_rx(b, "rx_frame_binary", "B1\r");
+  bench_rx(b, "rx_frame_batch", "B2\r");
+  bench_stream(b);
+  Firmware::command("B0\r");
+
+  const std::string cmd = "t1A580011223344556677\r";
+  BxCAN::Frame out;
+  uint16_t sof = 0;
+  b.run("tx_frame_command", 1, [&] {
+    Firmware::write(cmd);
+    ParseCommands();
+    BxCAN::service();
+    BxCAN::transmit(out, sof++);
+    BxCAN::service();
+    CANbus::poll();
+    drain();
+  });
+
+  if (!bench_hex(b)) return EXIT_FAILURE;
+  bench_parse(b, "parse_command_packets", CDC_DATA_MAX_PACKET_SIZE);
+  double t_packets = b.last();
+  bench_parse(b, "parse_command_split", 8);
+  b.ratio("parse_split_vs_packets", b.last() / t_packets);
+
+  return b.done();
+}
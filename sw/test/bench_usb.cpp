@@ -0,0 +1,234 @@
+// IN throughput of the CDC data endpoint on the simulated USB peripheral
+// (host/usb.hpp) with the firmware's USB stack, as built: double buffered,
+// or single buffered in bench_usb_single. The host keeps polling EP1 IN at
+// full speed while CAN frames keep the VCP queue full; the figure is bus
+// time per byte that reached the host, for a few USB interrupt latencies.
+//
+// Time is simulated, 1 ms frames at 12 Mbit/s. A transaction takes its
+// token, data and handshake on the wire, an IN that is NAKed only token and
+// NAK; none starts that would not end within the frame. Transactions are
+// atomic, the device runs between them: its interrupt latency after the
+// flag, the main loop after every event.
+#include "firmware.hpp"
+#include "usb.hpp"
+#include "decode.hpp"
+#include "bench.hpp"
+
+extern "C" void USB_Istr (void);
+
+#ifdef CDC_SNG_BUF
+#define BUFFERING "single"
+#else
+#define BUFFERING "double"
+#endif
+
+
+static const double BitNs = 1000.0 / 12;
+static const uint64_t FrameNs = 1000000;
+static const uint64_t NakNs = 50 * BitNs;
+
+// Transaction with n data bytes, sync, PIDs, CRC, EOPs and turnarounds
+static inline uint64_t transaction_ns (uint32_t n)
+{
+  return (8*n + 100) * BitNs;
+}
+
+
+// Control transfers for the enumeration, no timing
+static void service (void)
+{
+  while (USBDev::irq_pending()) USB_Istr();
+}
+
+static void request (uint8_t type, uint8_t req, uint16_t value)
+{
+  const uint8_t setup[8] = {type, req, uint8_t(value), uint8_t(value >> 8), 0, 0, 0, 0};
+  USBDev::setup(0, setup);
+  service();
+  uint8_t status[CDC_DATA_MAX_PACKET_SIZE];
+  while (USBDev::in(0, status) == USBDev::Nak) service();   // status stage, a ZLP
+  service();
+}
+
+static std::string transfer (const std::string& out)
+{
+  for (size_t pos = 0; pos < out.size(); pos += CDC_DATA_MAX_PACKET_SIZE)
+  {
+    std::string p = out.substr(pos, CDC_DATA_MAX_PACKET_SIZE);
+    while (USBDev::out(CDC_OUT_EP, reinterpret_cast<const uint8_t*>(p.data()), p.size()) == USBDev::Nak) service();
+    service();
+  }
+  for (int i = 0; i < 4; i++) Firmware::step();
+
+  std::string in;
+  uint8_t buf[CDC_DATA_MAX_PACKET_SIZE];
+  int n;
+  while ((n = USBDev::in(CDC_IN_EP & 0x7F, buf)) >= 0 || USBDev::irq_pending())
+  {
+    if (n > 0) in.append(reinterpret_cast<char*>(buf), n);
+    service();
+  }
+  return in;
+}
+
+
+// A frame goes out at once while nothing is in flight, frames that come in
+// behind a packet in flight share the next one
+static bool check_schedule (void)
+{
+  for (uint32_t id = 1; id <= 3; id++)
+  {
+    BxCAN::receive(Firmware::frame(id, "AA"), 0);
+    Firmware::step();
+  }
+
+  std::vector<std::string> packets;
+  uint8_t buf[CDC_DATA_MAX_PACKET_SIZE];
+  int n;
+  while ((n = USBDev::in(CDC_IN_EP & 0x7F, buf)) >= 0)
+  {
+    packets.push_back(std::string(reinterpret_cast<char*>(buf), n));
+    service();
+  }
+  return packets == std::vector<std::string>{"t0011AA\r", "t0021AA\rt0031AA\r"};
+}
+
+
+class Sim
+{
+public:
+  // Bus time per byte of IN data over frames frames, the USB interrupt
+  // latency_us after its flag
+  double run (uint32_t frames, uint32_t latency_us)
+  {
+    latency = latency_us * 1000ull;
+    uint64_t end = now + frames * FrameNs;
+    uint64_t start = now;
+    while (now < end)
+    {
+      device(now);
+      if (now + transaction_ns(CDC_DATA_MAX_PACKET_SIZE) > frame_end)
+      {
+        now = frame_end;      // rest of the frame left, no room for a packet
+        continue;
+      }
+      uint8_t buf[CDC_DATA_MAX_PACKET_SIZE];
+      int n = USBDev::in(CDC_IN_EP & 0x7F, buf);
+      if (n < 0)
+      {
+        now += NakNs;
+        continue;
+      }
+      received.append(reinterpret_cast<char*>(buf), n);
+      bytes += n;
+      now += transaction_ns(n);
+    }
+    double ns = static_cast<double>(now - start) / bytes;
+    bytes = 0;
+    return ns;
+  }
+
+  // The frames in order and whole up to the last one that arrived complete
+  bool check (void) const
+  {
+    std::vector<BinRecord::Record> recs;
+    if (!Decode::ascii(received.substr(0, received.rfind('\r') + 1), recs) || recs.size() < 100) return false;
+    for (uint32_t i = 0; i < recs.size(); i++)
+    {
+      if (recs[i].id != (i & 0x7FF) || recs[i].data[0] != uint8_t(i)) return false;
+    }
+    return true;
+  }
+
+private:
+  uint64_t latency = 0;
+  uint64_t now = 0;
+  uint64_t frame_end = FrameNs;
+  uint64_t irq_at = 0;
+  bool irq_due = false;
+  uint32_t seq = 0;
+  uint64_t bytes = 0;
+  std::string received;
+
+  // The device up to t: SOFs, the USB interrupt latency after its flag, and
+  // the main loop with CAN frames coming in faster than USB takes them
+  void device (uint64_t t)
+  {
+    for (;;)
+    {
+      feed();
+      if (!irq_due && USBDev::irq_pending())
+      {
+        irq_due = true;
+        irq_at = now + latency;
+      }
+      if (irq_due && irq_at <= frame_end && irq_at <= t)
+      {
+        now = (irq_at > now) ? irq_at : now;
+        Host::set_time(now / 1000);
+        irq_due = false;
+        USB_Istr();
+      }
+      else if (frame_end <= t)
+      {
+        now = frame_end;
+        Host::set_time(now / 1000);
+        frame_end += FrameNs;
+        USBDev::sof();
+      }
+      else
+      {
+        return;
+      }
+    }
+  }
+
+  void feed (void)
+  {
+    BxCAN::Frame f = Firmware::frame(0, "0011223344556677");
+    while (VCP_TxPending() < 16 * CDC_DATA_MAX_PACKET_SIZE)
+    {
+      f.Id = seq & 0x7FF;
+      f.Data[0] = seq++;
+      BxCAN::receive(f, 0);
+      Firmware::step();
+    }
+  }
+};
+
+
+int main (int argc, char** argv)
+{
+  Bench b(argc, argv);
+
+  Firmware::start();
+  USBDev::bus_reset();
+  service();
+  request(0x00, USB_REQ_SET_ADDRESS, 5);
+  request(0x00, USB_REQ_SET_CONFIGURATION, 1);
+  if (transfer("S8\r") != "\r" || transfer("O\r") != "\r")
+  {
+    printf("CDC data interface not up\n");
+    return EXIT_FAILURE;
+  }
+  if (!check_schedule())
+  {
+    printf("IN packets not scheduled as expected\n");
+    return EXIT_FAILURE;
+  }
+
+  Sim sim;
+  for (uint32_t latency : {10, 25, 50})
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "usb_in_ns_per_byte_isr%uus_" BUFFERING, latency);
+    b.metric(name, sim.run(100, latency));
+  }
+  if (!sim.check())
+  {
+    printf("IN stream broken\n");
+    return EXIT_FAILURE;
+  }
+
+  return b.done();
+}
@@ -0,0 +1,3 @@
+// bench_usb with the CDC data endpoints single buffered (CDC_SNG_BUF), for
+// comparison
+#include "bench_usb.cpp"
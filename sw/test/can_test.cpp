@@ -0,0 +1,308 @@
+// CANbus against the bxCAN model: what reaches the callbacks, in what order
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "host.hpp"
+#include "can.hpp"
+#include "check.hpp"
+
+
+static std::vector<CANbus::RxMsg> rx;
+static std::vector<std::string> seen;   // every callback in order: R<id>, T<id>, E<event>
+static void (*during_rx) (void) = nullptr;
+
+static void on_rx (CANbus::RxMsg& msg)
+{
+  rx.push_back(msg);
+  seen.push_back("R" + std::to_string(msg.Id));
+  if (during_rx) during_rx();
+}
+
+
+static void on_tx (CANbus::TxDone& done)
+{
+  seen.push_back("T" + std::to_string(done.Msg.Id));
+}
+
+
+static void on_event (CANbus::Event ev)
+{
+  seen.push_back("E" + std::to_string(static_cast<int>(ev)));
+}
+
+
+static BxCAN::Frame frame (uint32_t id, uint8_t b0)
+{
+  BxCAN::Frame f = {};
+  f.Id = id;
+  f.DLC = 1;
+  f.Data[0] = b0;
+  return f;
+}
+
+
+// Frames the interrupt took before close() are not handed out after open()
+static void test_reopen (void)
+{
+  CANbus::open(CANbus::OpenMode::Normal);
+  BxCAN::receive(frame(0x100, 1), 0);
+  BxCAN::receive(frame(0x101, 2), 0);
+  BxCAN::service();
+  CANbus::close();
+  CANbus::open(CANbus::OpenMode::Normal);
+  CANbus::poll();
+  CHECK(rx.empty());
+
+  BxCAN::receive(frame(0x102, 3), 0);
+  BxCAN::service();
+  CANbus::poll();
+  CHECK_EQ(rx.size(), 1);
+  if (!rx.empty()) CHECK_EQ(rx[0].Id, 0x102);
+  CANbus::close();
+  seen.clear();
+  rx.clear();
+}
+
+
+// Arrival is when the interrupt read the frame, not when poll() got to it
+static void test_arrival (void)
+{
+  CANbus::open(CANbus::OpenMode::Normal);
+  Host::set_time(0x12345678);
+  BxCAN::receive(frame(0x100, 1), 0);
+  BxCAN::service();
+  Host::advance(1500);
+  BxCAN::receive(frame(0x101, 2), 0);
+  BxCAN::service();
+  Host::advance(20000);
+  CANbus::poll();
+  CHECK_EQ(rx.size(), 2);
+  if (rx.size() == 2)
+  {
+    CHECK_EQ(rx[0].Arrival, 0x12345678);
+    CHECK_EQ(rx[1].Arrival, 0x12345678 + 1500);
+  }
+  CANbus::close();
+  seen.clear();
+  rx.clear();
+}
+
+
+static std::vector<std::string> frames (uint32_t from, uint32_t to)
+{
+  std::vector<std::string> v;
+  for (uint32_t id = from; id < to; id++) v.push_back("R" + std::to_string(id));
+  return v;
+}
+
+
+static void receive (uint32_t id)
+{
+  BxCAN::receive(frame(id, 0), 0);
+  BxCAN::service();
+}
+
+
+// Lost frames show as Overrun events where they were lost, one each
+static void test_overrun_position (void)
+{
+  CANbus::open(CANbus::OpenMode::Normal);
+  for (uint32_t id = 0; id < 34; id++) receive(id);  // the ring takes 32
+
+  // While poll() hands out the first frames: one more is lost (no room for
+  // the Overrun entry and the frame), the next one fits behind the Overrun
+  static uint32_t calls;
+  calls = 0;
+  during_rx = [] { if (calls++ < 2) receive(100 + calls); };
+  CANbus::poll();
+  during_rx = nullptr;
+
+  std::vector<std::string> expect = frames(0, 32);
+  expect.push_back("E0");
+  expect.push_back("E0");
+  expect.push_back("E0");
+  expect.push_back("R102");
+  CHECK(seen == expect);
+  CHECK_EQ(CANbus::overruns(), 3);
+
+  // A loss at the very end is reported once the ring has run empty
+  seen.clear();
+  for (uint32_t id = 0; id < 33; id++) receive(id);
+  CANbus::poll();
+  expect = frames(0, 32);
+  expect.push_back("E0");
+  CHECK(seen == expect);
+
+  uint32_t used, peak, dropped;
+  CANbus::rx_stats(used, peak, dropped);
+  CHECK_EQ(used, 0);
+  CHECK_EQ(peak, 32);
+  CHECK_EQ(dropped, 4);
+  CANbus::close();
+  seen.clear();
+  rx.clear();
+}
+
+
+// A frame received before a transmission completes is reported before it
+static void test_tx_done_order (void)
+{
+  CANbus::open(CANbus::OpenMode::Normal);
+  CANbus::TxMsg msg = {};
+  msg.Id = 0x200;
+  msg.DLC = 1;
+  CANbus::send(msg);
+  receive(0x100);
+  BxCAN::Frame out;
+  BxCAN::transmit(out, 10);
+  BxCAN::service();
+  receive(0x101);
+  BxCAN::bus_error(3);
+  BxCAN::service();
+  CANbus::poll();
+
+  std::vector<std::string> expect = {"R256", "T512", "R257", "E1"};
+  CHECK(seen == expect);
+  CANbus::close();
+  seen.clear();
+  rx.clear();
+}
+
+
+static uint32_t seed = 0x2545F491;
+
+static uint32_t rnd (uint32_t n)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed % n;
+}
+
+
+// The TX queue against std::set: random sends and transmissions in turn,
+// every frame on the bus must be the one the reference picks. Identifiers
+// repeat, so the priority policy holds a frame back behind a mailbox with
+// the same identifier.
+class TxRef
+{
+public:
+  TxRef (CANbus::TxPolicy policy) : priority(policy == CANbus::TxPolicy::Priority) {}
+
+  bool send (uint32_t id, uint32_t seq)
+  {
+    if (queue.size() == CANbus::tx_depth()) return false;
+    ids[seq] = id;
+    queue.insert(std::make_pair((priority) ? id : 0, seq));
+    refill();
+    return true;
+  }
+
+  // The frame to win arbitration next, the sequence number it was sent with
+  uint32_t transmit (void)
+  {
+    size_t next = 0;
+    for (size_t i = 1; i < mb.size(); i++)
+    {
+      if ((priority) ? (ids[mb[i]] < ids[mb[next]]) : (mb[i] < mb[next])) next = i;
+    }
+    uint32_t seq = mb[next];
+    mb.erase(mb.begin() + next);
+    refill();
+    return seq;
+  }
+
+  size_t queued (void) const { return queue.size(); }
+  size_t pending (void) const { return queue.size() + mb.size(); }
+
+private:
+  bool priority;
+  std::set<std::pair<uint32_t, uint32_t>> queue;   // key, seq
+  std::map<uint32_t, uint32_t> ids;
+  std::vector<uint32_t> mb;
+
+  void refill (void)
+  {
+    while (mb.size() < 3 && !queue.empty())
+    {
+      uint32_t seq = queue.begin()->second;
+      for (uint32_t m : mb)
+      {
+        if (priority && ids[m] == ids[seq]) return;
+      }
+      mb.push_back(seq);
+      queue.erase(queue.begin());
+    }
+  }
+};
+
+
+static void check_tx_order (CANbus::TxPolicy policy)
+{
+  CANbus::open(CANbus::OpenMode::Normal);
+  CHECK(CANbus::tx_policy(policy) == CANbus::Status::Ok);
+
+  TxRef ref(policy);
+  uint32_t failed = 0;
+  for (uint32_t seq = 0; seq < 2000 || ref.pending() != 0; )
+  {
+    if (seq < 2000 && rnd(2))
+    {
+      CANbus::TxMsg msg = {};
+      msg.Id = 0x100 + rnd(8);
+      msg.DLC = 2;
+      msg.Data8[0] = seq;
+      msg.Data8[1] = seq >> 8;
+      bool ok = ref.send(msg.Id, seq);
+      if ((CANbus::send(msg) == CANbus::Status::Ok) != ok) failed++;
+      if (ok) seq++;
+    }
+    else if (ref.pending() != 0)
+    {
+      BxCAN::Frame out;
+      if (!BxCAN::transmit(out, 0))
+      {
+        failed++;
+        break;
+      }
+      BxCAN::service();
+      CANbus::poll();
+      if (static_cast<uint32_t>(out.Data[0] | out.Data[1] << 8) != ref.transmit()) failed++;
+    }
+    if (CANbus::tx_used() != ref.queued()) failed++;
+  }
+  CHECK_EQ(failed, 0);
+  CHECK_EQ(CANbus::tx_peak(), CANbus::tx_depth());
+
+  CANbus::close();
+  CANbus::tx_clear_stats();
+  seen.clear();
+  rx.clear();
+}
+
+
+static void test_tx_order (void)
+{
+  check_tx_order(CANbus::TxPolicy::Fifo);
+  check_tx_order(CANbus::TxPolicy::Priority);
+  CANbus::tx_policy(CANbus::TxPolicy::Fifo);
+}
+
+
+int main (void)
+{
+  Host::reset();
+  CANbus::init();
+  CANbus::set_rx_cb(on_rx);
+  CANbus::set_tx_cb(on_tx);
+  CANbus::set_event_cb(on_event);
+
+  test_reopen();
+  test_arrival();
+  test_overrun_position();
+  test_tx_done_order();
+  test_tx_order();
+  return check_done();
+}
@@ -0,0 +1,387 @@
+// CANFilter::compile() against the subscription it was given: random rule
+// sets, the banks read back the way bxCAN matches them. The banks never
+// pass fewer frames than the rules ask for, and loose is set exactly when
+// they pass more.
+#include <stdint.h>
+#include <string.h>
+
+#include <set>
+#include <vector>
+
+#include "canfilter.hpp"
+#include "check.hpp"
+
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t rnd (void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static uint32_t rnd (uint32_t n) { return rnd() % n; }
+
+
+typedef struct
+{
+  uint32_t id;
+  bool ide;
+  bool rtr;
+} Frame;
+
+// Filter register layout, 32-bit scale: STID[10:0] EXID[17:0] IDE RTR 0.
+// A standard frame has no extended identifier, its bits are 0.
+static const uint32_t IDE = 0x4;
+static const uint32_t RTR = 0x2;
+static const uint32_t STID = 0xFFE00000;
+static const uint32_t EXID = 0x001FFFF8;
+static const uint32_t AllBits = 0xFFFFFFFE;
+
+static uint32_t reg32 (const Frame& f)
+{
+  return ((f.ide) ? ((f.id << 3) | IDE) : (f.id << 21)) | ((f.rtr) ? RTR : 0);
+}
+
+static Frame frame_of (uint32_t reg)
+{
+  Frame f;
+  f.ide = (reg & IDE) != 0;
+  f.rtr = (reg & RTR) != 0;
+  f.id = (f.ide) ? ((reg >> 3) & 0x1FFFFFFF) : (reg >> 21);
+  return f;
+}
+
+// 16-bit scale: STID[10:0] RTR IDE EXID[17:15], as a 32-bit layout pattern
+static uint32_t from16 (uint32_t h)
+{
+  return ((h >> 5) << 21) | (((h >> 4) & 1) ? RTR : 0) | (((h >> 3) & 1) ? IDE : 0) | ((h & 7) << 18);
+}
+
+
+// What the host asked for
+typedef struct
+{
+  bool mask;            // add_mask(), else add_range()
+  uint32_t first, last;
+  bool ide, rtr;
+  uint32_t code, bits;  // mask bits set must match
+} Spec;
+
+static bool asked (const std::vector<Spec>& specs, const Frame& f)
+{
+  for (auto& s : specs)
+  {
+    if (s.mask)
+    {
+      if (!((reg32(f) ^ s.code) & s.bits & AllBits)) return true;
+    }
+    else if (f.ide == s.ide && f.rtr == s.rtr && f.id >= s.first && f.id <= s.last)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// A filter as a value/mask pattern in the 32-bit layout
+typedef struct
+{
+  uint32_t value;
+  uint32_t mask;
+} Pattern;
+
+static std::vector<Pattern> patterns (const CANFilter::Bank* banks, uint32_t n)
+{
+  std::vector<Pattern> out;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    const CANFilter::Bank& b = banks[i];
+    if (b.Wide && b.List)
+    {
+      out.push_back({b.FR1, AllBits});
+      out.push_back({b.FR2, AllBits});
+    }
+    else if (b.Wide)
+    {
+      out.push_back({b.FR1, b.FR2 & AllBits});
+    }
+    else if (b.List)
+    {
+      for (uint32_t h : {b.FR1 & 0xFFFF, b.FR1 >> 16, b.FR2 & 0xFFFF, b.FR2 >> 16})
+      {
+        out.push_back({from16(h), from16(0xFFFF)});
+      }
+    }
+    else
+    {
+      out.push_back({from16(b.FR1 & 0xFFFF), from16(b.FR1 >> 16)});
+      out.push_back({from16(b.FR2 & 0xFFFF), from16(b.FR2 >> 16)});
+    }
+  }
+  return out;
+}
+
+static bool passed (const std::vector<Pattern>& banks, const Frame& f)
+{
+  uint32_t r = reg32(f);
+  for (auto& p : banks)
+  {
+    if (!((r ^ p.value) & p.mask)) return true;
+  }
+  return false;
+}
+
+
+// Calls f for the frames of p, all of them if there are at most 2^16 in a
+// branch, else a sample; returns false if it sampled
+template <class F>
+static bool frames_of (const Pattern& p, F f)
+{
+  bool all = true;
+  for (uint32_t ide = 0; ide < 2; ide++)
+  {
+    if ((p.mask & IDE) && ((p.value & IDE) != 0) != (ide != 0)) continue;
+    uint32_t value = (p.value & p.mask & ~IDE) | ((ide) ? IDE : 0);
+    uint32_t free = AllBits & ~p.mask & ~IDE;
+    if (!ide)
+    {
+      if (value & EXID) continue;   // no standard frame has these
+      free &= STID | RTR;
+    }
+
+    if (__builtin_popcount(free) <= 16)
+    {
+      uint32_t sub = free;
+      for (;;)
+      {
+        f(frame_of(value | sub));
+        if (sub == 0) break;
+        sub = (sub - 1) & free;
+      }
+    }
+    else
+    {
+      all = false;
+      for (uint32_t i = 0; i < 4096; i++) f(frame_of(value | (rnd() & free)));
+    }
+  }
+  return all;
+}
+
+
+static Spec range (bool ide, uint32_t first, uint32_t span)
+{
+  uint32_t top = (ide) ? 0x1FFFFFFF : 0x7FF;
+  Spec s = {};
+  s.ide = ide;
+  s.rtr = rnd(4) == 0;
+  s.first = first & top;
+  s.last = (s.first + span > top) ? top : s.first + span;
+  return s;
+}
+
+
+// Kinds of sets: standard only, extended in a 4096 window, both, and many
+// single identifiers close together so they have to be merged
+static std::vector<Spec> random_set (uint32_t kind)
+{
+  std::vector<Spec> specs;
+  uint32_t window = rnd() & 0x1FFFF000;
+  uint32_t cluster = rnd(2048 - 256);
+  uint32_t count = (kind == 3) ? 20 + rnd(40) : 1 + rnd(30);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    bool ide = (kind == 1) || (kind == 2 && rnd(2));
+    uint32_t pick = rnd(8);
+    Spec s;
+    if (kind == 3)
+    {
+      s = range(false, cluster + rnd(256), 0);
+    }
+    else if (pick < 4)
+    {
+      s = range(ide, (ide) ? window + rnd(4096) : rnd(2048), 0);
+    }
+    else if (pick < 7)
+    {
+      s = range(ide, (ide) ? window + rnd(4096) : rnd(2048), rnd(64));
+    }
+    else
+    {
+      // a few identifier bits don't care, IDE and RTR fixed
+      Frame f = {(ide) ? window + rnd(4096) : rnd(2048), ide, rnd(4) == 0};
+      uint32_t loose_bits = ((ide) ? (0xFF << 3) : (0x0F << 21)) & rnd();
+      s = Spec();
+      s.mask = true;
+      s.code = reg32(f);
+      s.bits = AllBits & ~loose_bits;
+    }
+    specs.push_back(s);
+  }
+  return specs;
+}
+
+
+static void check_set (uint32_t kind)
+{
+  std::vector<Spec> specs = random_set(kind);
+  std::vector<Spec> taken;
+  CANFilter::clear();
+  for (auto& s : specs)
+  {
+    bool ok = (s.mask) ? CANFilter::add_mask(s.code, s.bits) : CANFilter::add_range(s.first, s.last, s.ide, s.rtr);
+    if (ok) taken.push_back(s);
+  }
+  if (taken.empty()) return;
+
+  CANFilter::Bank banks[CANFilter::Banks];
+  bool loose = true;
+  uint32_t n = CANFilter::compile(banks, loose);
+  CHECK(n >= 1 && n <= CANFilter::Banks);
+  std::vector<Pattern> pass = patterns(banks, n);
+
+  // Never fewer: every standard frame, and extended ones around the rules
+  uint32_t missed = 0;
+  uint32_t extra = 0;
+  auto compare = [&] (const Frame& f)
+  {
+    bool a = asked(taken, f);
+    bool p = passed(pass, f);
+    if (a && !p) missed++;
+    if (p && !a) extra++;
+  };
+  for (uint32_t id = 0; id < 2048; id++)
+  {
+    compare({id, false, false});
+    compare({id, false, true});
+  }
+  for (auto& s : taken)
+  {
+    if (s.mask)
+    {
+      frames_of({s.code, s.bits & AllBits}, compare);
+    }
+    else if (s.ide)
+    {
+      for (uint32_t id : {s.first - 1, s.first, s.last, s.last + 1, s.first + rnd(s.last - s.first + 1)})
+      {
+        compare({id & 0x1FFFFFFF, true, s.rtr});
+        compare({id & 0x1FFFFFFF, true, !s.rtr});
+      }
+    }
+  }
+  CHECK_EQ(missed, 0);
+
+  // More exactly when loose: every frame the banks pass where they are few
+  // enough to go through, a sample of them where not
+  bool all = true;
+  for (auto& p : pass) all = frames_of(p, compare) && all;
+  if (extra != 0) CHECK(loose);
+  if (all) CHECK_EQ(loose, extra != 0);
+}
+
+
+// The software stage against std::set: random identifiers, the extended
+// ones from a window so the hash neighbourhoods fill up and refuse some
+static void test_soft (void)
+{
+  uint32_t refused = 0;
+  for (uint32_t round = 0; round < 50; round++)
+  {
+    std::set<uint32_t> std_ids;
+    std::set<uint32_t> ext_ids;
+    uint32_t window = rnd() & 0x1FFF0000;
+    CANFilter::soft_clear();
+    CANFilter::soft_enable(true);
+
+    uint32_t count = rnd(200);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint32_t id = rnd(2048);
+      CHECK(CANFilter::soft_add(id, false));
+      std_ids.insert(id);
+
+      id = (rnd(2)) ? window + rnd(0x10000) : rnd() & 0x1FFFFFFF;
+      if (CANFilter::soft_add(id, true))
+      {
+        ext_ids.insert(id);
+      }
+      else
+      {
+        CHECK(!ext_ids.count(id));   // a stored identifier is never refused
+        refused++;
+      }
+    }
+    CHECK(ext_ids.size() <= CANFilter::ExtSlots);
+    CHECK(!CANFilter::soft_add(0x800, false));
+    CHECK(!CANFilter::soft_add(0x20000000, true));
+
+    uint32_t yes = 0;
+    uint32_t no = 0;
+    auto lookup = [&] (uint32_t id, bool ide)
+    {
+      bool want = (ide) ? ext_ids.count(id) != 0 : std_ids.count(id) != 0;
+      CHECK_EQ(CANFilter::accept(id, ide), want);
+      if (want) yes++; else no++;
+    };
+    for (uint32_t id = 0; id < 2048; id++) lookup(id, false);
+    for (uint32_t id : ext_ids)
+    {
+      lookup(id, true);
+      lookup(id ^ 1, true);
+    }
+    for (uint32_t i = 0; i < 2000; i++) lookup(window + rnd(0x10000), true);
+    CHECK_EQ(CANFilter::accepted(), yes);
+    CHECK_EQ(CANFilter::rejected(), no);
+
+    // Off passes everything and counts nothing
+    CANFilter::soft_enable(false);
+    CHECK(CANFilter::accept(0x7FF, false) && CANFilter::accept(0x1FFFFFFF, true));
+    CHECK_EQ(CANFilter::accepted() + CANFilter::rejected(), yes + no);
+  }
+  CHECK(refused != 0);   // full neighbourhoods were tried
+  CANFilter::soft_clear();
+}
+
+
+// Small cases with a known answer
+static void test_known (void)
+{
+  CANFilter::Bank banks[CANFilter::Banks];
+  bool loose;
+
+  // 30 extended identifiers need 15 banks, so two are merged; neighbours
+  // merge into a mask that passes nothing else
+  CANFilter::clear();
+  for (uint32_t id = 0x1000; id < 0x1000 + 30; id++) CHECK(CANFilter::add_id(id, true, false));
+  CHECK_EQ(CANFilter::compile(banks, loose), CANFilter::Banks);
+  CHECK(!loose);
+
+  // Scattered ones do not
+  CANFilter::clear();
+  for (uint32_t i = 0; i < 30; i++) CHECK(CANFilter::add_id(0x1000 + 0x111 * i, true, false));
+  CHECK_EQ(CANFilter::compile(banks, loose), CANFilter::Banks);
+  CHECK(loose);
+
+  CANFilter::clear();
+  CHECK(CANFilter::add_id(0x100, false, false));
+  CHECK_EQ(CANFilter::compile(banks, loose), 1);
+  CHECK(!loose);
+
+  CANFilter::clear();
+  CHECK_EQ(CANFilter::compile(banks, loose), 1);  // empty: everything
+  CHECK(!loose);
+}
+
+
+int main (void)
+{
+  test_known();
+  test_soft();
+  for (uint32_t i = 0; i < 400; i++) check_set(i % 4);
+  return check_done();
+}
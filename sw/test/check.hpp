@@ -0,0 +1,24 @@
+#ifndef _CHECK_HPP_
+#define _CHECK_HPP_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Minimal assertions for the host tests: report every failure, exit status
+// says whether any happened (see check_done())
+static int check_failures = 0;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); check_failures++; } } while (0)
+
+#define CHECK_EQ(a, b) \
+  do { long long _a = (long long)(a), _b = (long long)(b); \
+       if (_a != _b) { printf("%s:%d: %s == %s failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, _a, _b); check_failures++; } } while (0)
+
+static inline int check_done (void)
+{
+  if (check_failures) printf("%d check(s) failed\n", check_failures);
+  return check_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif // _CHECK_HPP_
@@ -0,0 +1,132 @@
+#ifndef _DECODE_HPP_
+#define _DECODE_HPP_
+
+// The host's side of the VCP stream: what a driver on the PC does with the
+// bytes it reads. Both decoders give BinRecord::Records, so a test can check
+// the two stream formats against each other.
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "binrecord.hpp"
+
+namespace Decode
+{
+  // A B1 stream, or with batched a B2 one. False if the stream breaks off
+  // inside a record or, batched, a header does not match the records after
+  // it; the records up to there are in out.
+  inline bool binary (const std::string& in, bool batched, std::vector<BinRecord::Record>& out)
+  {
+    const size_t rsize = sizeof(BinRecord::Record);
+    size_t pos = 0;
+    while (pos < in.size())
+    {
+      size_t count = 1;
+      if (batched)
+      {
+        BinRecord::Header hdr;
+        if (in.size() - pos < sizeof(hdr)) return false;
+        memcpy(&hdr, &in[pos], sizeof(hdr));
+        pos += sizeof(hdr);
+        if (hdr.type != BinRecord::Batch || hdr.count == 0 || hdr.length != hdr.count * rsize) return false;
+        count = hdr.count;
+      }
+      if (in.size() - pos < count * rsize) return false;
+      for (size_t i = 0; i < count; i++)
+      {
+        BinRecord::Record rec;
+        memcpy(&rec, &in[pos], rsize);
+        pos += rsize;
+        out.push_back(rec);
+      }
+    }
+    return true;
+  }
+
+
+  inline int hex (char c)
+  {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+  }
+
+
+  // Hex field of n digits at p, -1 if it is not one
+  inline int64_t field (const char* p, size_t n)
+  {
+    int64_t v = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+      int d = hex(p[i]);
+      if (d < 0) return -1;
+      v = (v << 4) | d;
+    }
+    return v;
+  }
+
+
+  // The frame lines of an ASCII stream: "tiiil<data>[time]\r" and its
+  // extended and RTR forms, the time 4 digits of ms or 8 of us. Replies
+  // and reports are skipped. False on a malformed frame line.
+  inline bool ascii (const std::string& in, std::vector<BinRecord::Record>& out)
+  {
+    size_t pos = 0;
+    while (pos < in.size())
+    {
+      size_t end = in.find_first_of("\r\a", pos);
+      if (end == std::string::npos) return false;
+      const char* p = &in[pos];
+      size_t len = end - pos;
+      pos = end + 1;
+      if (len == 0) continue;
+
+      char c = p[0];
+      if (c != 't' && c != 'T' && c != 'r' && c != 'R') continue;
+
+      BinRecord::Record rec;
+      memset(&rec, 0, sizeof(rec));
+      rec.type = BinRecord::Frame;
+      bool ide = (c == 'T' || c == 'R');
+      bool rtr = (c == 'r' || c == 'R');
+      rec.flags = (ide ? BinRecord::IDE : 0) | (rtr ? BinRecord::RTR : 0);
+
+      size_t idlen = ide ? 8 : 3;
+      if (len < 1 + idlen + 1) return false;
+      int64_t id = field(&p[1], idlen);
+      int64_t dlc = field(&p[1 + idlen], 1);
+      if (id < 0 || dlc < 0 || dlc > 8) return false;
+      rec.id = id;
+      rec.dlc = dlc;
+
+      size_t i = 2 + idlen;
+      if (!rtr)
+      {
+        if (len < i + 2*dlc) return false;
+        for (int64_t b = 0; b < dlc; b++, i += 2)
+        {
+          int64_t v = field(&p[i], 2);
+          if (v < 0) return false;
+          rec.data[b] = v;
+        }
+      }
+
+      size_t tlen = len - i;
+      if (tlen != 0 && tlen != 4 && tlen != 8) return false;
+      if (tlen != 0)
+      {
+        int64_t t = field(&p[i], tlen);
+        if (t < 0) return false;
+        rec.flags |= BinRecord::Time | ((tlen == 8) ? BinRecord::Micro : 0);
+        rec.time = t;
+      }
+      out.push_back(rec);
+    }
+    return true;
+  }
+}
+
+#endif // _DECODE_HPP_
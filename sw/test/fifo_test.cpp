@@ -0,0 +1,148 @@
+// FIFO with its producer and consumer on two threads, the way the USB and
+// CAN interrupts share rings with the main loop: every access pattern on
+// either side, the sequence must come out whole and in order.
+#include <stdint.h>
+
+#include <thread>
+
+#include "fifo.hpp"
+#include "check.hpp"
+
+
+static uint32_t xorshift (uint32_t& x)
+{
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+
+// Producer: the sequence 0, 1, 2 ... through push, push_n and
+// reserve/commit at random; what does not fit is sent again. Returns the
+// items it saw refused, for overflows().
+template <class T, size_t SIZE>
+static uint32_t produce (FIFO<T, SIZE>& fifo, uint32_t total)
+{
+  uint32_t x = 0x12345678;
+  uint32_t next = 0;
+  uint32_t refused = 0;
+  T chunk[SIZE + 8];
+  while (next < total)
+  {
+    uint32_t r = xorshift(x);
+    uint32_t len = 1 + (r >> 8) % (SIZE + 8);
+    if (len > total - next) len = total - next;
+    if (fifo.full()) std::this_thread::yield();   // one CPU: let the consumer run
+    switch (r & 3)
+    {
+      case 0:
+        if (fifo.push(static_cast<T>(next))) next++;
+        else refused++;
+        break;
+
+      case 1:
+      {
+        for (uint32_t i = 0; i < len; i++) chunk[i] = static_cast<T>(next + i);
+        uint32_t done = fifo.push_n(chunk, len);
+        next += done;
+        refused += len - done;
+        break;
+      }
+
+      default:
+      {
+        size_t n;
+        T* dst = fifo.reserve(n);
+        if (n > len) n = len;
+        for (size_t i = 0; i < n; i++) dst[i] = static_cast<T>(next + i);
+        fifo.commit(n);
+        next += n;
+        break;
+      }
+    }
+  }
+  return refused;
+}
+
+
+// Consumer: pop, front, pop_n and peek/release at random; returns the
+// items that came out of order
+template <class T, size_t SIZE>
+static uint32_t consume (FIFO<T, SIZE>& fifo, uint32_t total)
+{
+  uint32_t x = 0x9ABCDEF0;
+  uint32_t next = 0;
+  uint32_t wrong = 0;
+  T chunk[SIZE + 8];
+  while (next < total)
+  {
+    uint32_t r = xorshift(x);
+    uint32_t len = 1 + (r >> 8) % (SIZE + 8);
+    if (fifo.empty()) std::this_thread::yield();
+    switch (r & 3)
+    {
+      case 0:
+      {
+        T a, b;
+        if (fifo.front(a))
+        {
+          if (!fifo.pop(b) || a != b) wrong++;
+          if (a != static_cast<T>(next++)) wrong++;
+        }
+        break;
+      }
+
+      case 1:
+      {
+        uint32_t n = fifo.pop_n(chunk, len);
+        for (uint32_t i = 0; i < n; i++)
+        {
+          if (chunk[i] != static_cast<T>(next++)) wrong++;
+        }
+        break;
+      }
+
+      default:
+      {
+        size_t n;
+        const T* src = fifo.peek(n);
+        if (n > len) n = len;
+        for (size_t i = 0; i < n; i++)
+        {
+          if (src[i] != static_cast<T>(next++)) wrong++;
+        }
+        fifo.release(n);
+        break;
+      }
+    }
+  }
+  return wrong;
+}
+
+
+template <class T, size_t SIZE>
+static void stress (uint32_t total)
+{
+  static FIFO<T, SIZE> fifo;
+  uint32_t refused = 0;
+  uint32_t wrong = 0;
+  std::thread producer([&] { refused = produce(fifo, total); });
+  std::thread consumer([&] { wrong = consume(fifo, total); });
+  producer.join();
+  consumer.join();
+
+  CHECK_EQ(wrong, 0);
+  CHECK(fifo.empty());
+  CHECK_EQ(fifo.overflows(), refused);
+  CHECK(fifo.high_water() <= SIZE);
+}
+
+
+int main (void)
+{
+  stress<uint8_t, 16>(2000000);     // wraps the index often, and the byte values
+  stress<uint8_t, 1024>(4000000);
+  stress<uint32_t, 64>(2000000);
+  return check_done();
+}
@@ -0,0 +1,84 @@
+#ifndef _FIRMWARE_HPP_
+#define _FIRMWARE_HPP_
+
+// The LAWICEL firmware on the host: main.cpp is built into the test itself so
+// the test can reach its file-local state. main() never returns, start()
+// does what it does up to the main loop and step() is one turn of the loop.
+
+#include <string>
+
+#include "host.hpp"
+
+#define main firmware_main
+#include "main.cpp"
+#undef main
+
+namespace Firmware
+{
+  inline void start (void)
+  {
+    Host::reset();
+    RCC->AHBENR |= RCC_AHBENR_GPIOBEN;
+    PaintStack();
+    CANbus::init();
+    CANbus::set_rx_cb(ReceiveCANMsg);
+    CANbus::set_event_cb(CANEvent);
+    CANbus::set_tx_cb(TransmitDone);
+    Cyclic::init();
+    USBD_Init(&USB_Device_dev, &USR_desc, &USBD_CDC_cb, &USR_cb);
+  }
+
+  // Pending CAN interrupts, then the main loop once
+  inline void step (void)
+  {
+    BxCAN::service();
+    CANbus::poll();
+    ParseCommands();
+  }
+
+  // Bytes from the host as one OUT transfer
+  inline void write (const std::string& s)
+  {
+    VCP_callback(reinterpret_cast<uint8_t*>(const_cast<char*>(s.data())), s.size());
+  }
+
+  // One IN packet of up to max bytes, as the CDC class would take it
+  inline std::string packet (uint16_t max = CDC_DATA_MAX_PACKET_SIZE)
+  {
+    uint8_t buf[CDC_DATA_MAX_PACKET_SIZE];
+    uint16_t n = VCP_TxFill(BULK_IN_TX_ADDRESS, max);
+    PMAToUserBufferCopy(buf, BULK_IN_TX_ADDRESS, n);
+    return std::string(reinterpret_cast<char*>(buf), n);
+  }
+
+  // Everything queued for the host
+  inline std::string read (void)
+  {
+    std::string out;
+    while (VCP_TxPending() != 0) out += packet();
+    return out;
+  }
+
+  // A command and its reply, the main loop run until the reply is out
+  inline std::string command (const std::string& cmd)
+  {
+    write(cmd);
+    for (int i = 0; i < 4; i++) step();
+    return read();
+  }
+
+  inline BxCAN::Frame frame (uint32_t id, const char* data, bool ide = false)
+  {
+    BxCAN::Frame f = {};
+    f.Id = id;
+    f.IDE = ide;
+    f.DLC = strlen(data) / 2;
+    for (uint32_t i = 0; i < f.DLC; i++)
+    {
+      f.Data[i] = (char_to_hex(data[2*i]) << 4) | char_to_hex(data[2*i + 1]);
+    }
+    return f;
+  }
+}
+
+#endif // _FIRMWARE_HPP_
@@ -0,0 +1,523 @@
+// The LAWICEL side on the host: frames in from the bus and out to it, the
+// reports that go with them
+#include <algorithm>
+
+#include "firmware.hpp"
+#include "decode.hpp"
+#include "check.hpp"
+
+extern "C" void TIM6_DAC_IRQHandler (void);
+
+
+static void test_smoke (void)
+{
+  CHECK(Firmware::command("S8\r") == "\r");
+  CHECK(Firmware::command("O\r") == "\r");
+
+  BxCAN::Frame f = Firmware::frame(0x123, "1122");
+  CHECK(BxCAN::receive(f, 0));
+  Firmware::step();
+  CHECK(Firmware::read() == "t12321122\r");
+
+  CHECK(Firmware::command("t4562AABB\r") == "z\r");
+  BxCAN::Frame out;
+  CHECK(BxCAN::transmit(out, 100));
+  CHECK_EQ(out.Id, 0x456);
+  CHECK_EQ(out.DLC, 2);
+  CHECK_EQ(out.Data[0], 0xAA);
+  CHECK_EQ(out.Data[1], 0xBB);
+  Firmware::step();
+  CHECK(Firmware::read().empty());   // TX-done reports are off by default
+
+  CHECK(Firmware::command("C\r") == "\r");
+  CHECK(BxCAN::receive(f, 200));     // closed: the frame goes nowhere
+  Firmware::step();
+  CHECK(Firmware::read().empty());
+}
+
+
+// The TX-done report carries the whole tag given with the frame
+static void test_tx_done_tag (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("E01\r") == "\r");
+  BxCAN::Frame out;
+
+  CHECK(Firmware::command("t4561AA1234ABCD\r") == "z\r");
+  CHECK(BxCAN::transmit(out, 0));
+  Firmware::step();
+  CHECK(Firmware::read() == "k1234ABCD0456\r");
+
+  CHECK(Firmware::command("T000004561AA7\r") == "Z\r");
+  CHECK(BxCAN::transmit(out, 0));
+  Firmware::step();
+  CHECK(Firmware::read() == "K00000007000000456\r");
+
+  CHECK(Firmware::command("E00\r") == "\r");
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// n frames with identifiers from id on, received one by one
+static void receive_frames (uint32_t n, uint32_t id)
+{
+  for (uint32_t i = 0; i < n; i++)
+  {
+    BxCAN::Frame f = Firmware::frame(id + i, "0011223344556677", true);
+    f.Data[0] = i;
+    CHECK(BxCAN::receive(f, i));
+    Firmware::step();
+  }
+}
+
+
+// The same frames in each stream mode decode to the same records; batches
+// take as many records as fit whole into an IN packet, behind one header
+static void test_binary_stream (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("Z1\r") == "\r");
+
+  receive_frames(7, 0x100);
+  std::vector<BinRecord::Record> ascii;
+  CHECK(Decode::ascii(Firmware::read(), ascii));
+  CHECK_EQ(ascii.size(), 7);
+
+  Firmware::command("B1\r");
+  receive_frames(7, 0x100);
+  std::string bin = Firmware::read();
+  CHECK_EQ(bin.size(), 7 * sizeof(BinRecord::Record));
+  std::vector<BinRecord::Record> records;
+  CHECK(Decode::binary(bin, false, records));
+
+  Firmware::command("B2\r");
+  receive_frames(7, 0x100);
+  std::vector<std::string> packets;
+  while (VCP_TxPending() != 0) packets.push_back(Firmware::packet());
+  CHECK_EQ(packets.size(), 3);
+  if (packets.size() != 3) return;
+  CHECK_EQ(packets[0].size(), 64);    // header and 3 records
+  CHECK_EQ(packets[1].size(), 64);
+  CHECK_EQ(packets[2].size(), 24);
+  std::vector<BinRecord::Record> batched;
+  for (auto& p : packets)
+  {
+    CHECK(Decode::binary(p, true, batched));   // every packet starts with a header
+  }
+
+  CHECK_EQ(records.size(), 7);
+  CHECK_EQ(batched.size(), 7);
+  if (records.size() != 7 || batched.size() != 7) return;
+  for (uint32_t i = 0; i < 7; i++)
+  {
+    CHECK_EQ(records[i].type, BinRecord::Frame);
+    CHECK_EQ(records[i].id, 0x100 + i);
+    CHECK_EQ(records[i].data[0], i);
+    CHECK_EQ(ascii[i].id, records[i].id);
+    CHECK_EQ(ascii[i].flags, records[i].flags);
+    CHECK_EQ(ascii[i].time, records[i].time);
+    CHECK(!memcmp(ascii[i].data, records[i].data, 8));
+    CHECK(!memcmp(&batched[i], &records[i], sizeof(records[i])));
+  }
+
+  Firmware::command("B0\r");
+  CHECK(Firmware::command("Z0\r") == "\r");
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// Replies to commands sent together leave in the IN packets they fit into,
+// built right in packet memory, as Reply records behind one header each
+static void test_reply_batch (void)
+{
+  Firmware::command("B2\r");
+  Firmware::write("V\rv\rV\rv\rV\r");
+  for (int i = 0; i < 4; i++) Firmware::step();
+
+  std::vector<std::string> packets;
+  while (VCP_TxPending() != 0) packets.push_back(Firmware::packet());
+  CHECK_EQ(packets.size(), 2);
+  if (packets.size() != 2) return;
+  CHECK_EQ(packets[0].size(), 64);
+  CHECK_EQ(packets[1].size(), 44);
+  CHECK_EQ(static_cast<uint8_t>(packets[0][1]), 3);   // header count
+  CHECK_EQ(static_cast<uint8_t>(packets[1][1]), 2);
+
+  std::vector<BinRecord::Record> records;
+  for (auto& p : packets) CHECK(Decode::binary(p, true, records));
+  std::string replies;
+  for (auto& r : records)
+  {
+    CHECK_EQ(r.type, BinRecord::Reply);
+    replies.append(reinterpret_cast<char*>(r.data), r.dlc);
+  }
+  CHECK(replies == "V0102\rvSTM32\rV0102\rvSTM32\rV0102\r");
+
+  Firmware::command("B0\r");
+}
+
+
+// A malformed line changes nothing
+static void test_filter_clear (void)
+{
+  CHECK(Firmware::command("fc\r") == "\r");
+  CHECK(Firmware::command("fT00000001\r") == "\r");   // two a bank
+  CHECK(Firmware::command("fT00000002\r") == "\r");
+  CHECK(Firmware::command("fT00000003\r") == "\r");
+  std::string banks = Firmware::command("fa\r");
+  CHECK(banks == "fa020\r");
+  CHECK(Firmware::command("fcX\r") == "\a");
+  CHECK(Firmware::command("fa\r") == banks);
+  CHECK(Firmware::command("fc\r") == "\r");
+  CHECK(Firmware::command("fa\r") == "fa010\r");
+}
+
+
+// Neither may a malformed line switch or clear the software stage
+static void test_soft_filter_lines (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("a1\r") == "\r");
+  CHECK(Firmware::command("at123\r") == "\r");
+  CHECK(Firmware::command("a0X\r") == "\a");   // stays on
+  CHECK(Firmware::command("acX\r") == "\a");   // keeps 123
+
+  BxCAN::receive(Firmware::frame(0x123, "01"), 0);
+  BxCAN::receive(Firmware::frame(0x124, "02"), 0);
+  Firmware::step();
+  CHECK(Firmware::read() == "t123101\r");
+
+  CHECK(Firmware::command("ac\r") == "\r");
+  CHECK(Firmware::command("a0\r") == "\r");
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// Short d lines are refused, and dc takes no arguments
+static void test_rate_limit_lines (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("dt123n0002\r") == "\r");
+  CHECK(Firmware::command("dcX\r") == "\a");   // the rule stays
+  CHECK(Firmware::command("ds\r") == "\a");
+  CHECK(Firmware::command("dsT1234\r") == "\a");
+  CHECK(Firmware::command("dt12\r") == "\a");
+  CHECK(Firmware::command("d\r") == "\a");
+  CHECK(Firmware::command("dt123n0000\r") == "\a");
+  CHECK(Firmware::command("dt123m0000\r") == "\a");
+
+  BxCAN::receive(Firmware::frame(0x123, "01"), 0);
+  BxCAN::receive(Firmware::frame(0x123, "02"), 0);
+  Firmware::step();
+  CHECK_EQ(Firmware::read().size(), 8);
+  CHECK(Firmware::command("dst123\r") == "ds00000001\r");
+
+  CHECK(Firmware::command("dc\r") == "\r");
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// A rejected c line leaves change-only forwarding as it was
+static void test_change_only_lines (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("c1\r") == "\r");
+  CHECK(Firmware::command("c10FFFFF\r") == "\a");
+  CHECK(Firmware::command("c0X\r") == "\a");
+
+  BxCAN::receive(Firmware::frame(0x321, "01"), 0);
+  BxCAN::receive(Firmware::frame(0x321, "01"), 0);
+  Firmware::step();
+  CHECK(Firmware::read() == "t321101\r");
+  CHECK(Firmware::command("cs\r") == "cs0000000100000001\r");
+
+  // A repeat 67.6 s later is past a 1 s heartbeat, though 16-bit ms
+  // ticks would have wrapped to 0.5 s
+  CHECK(Firmware::command("c103E8\r") == "\r");
+  Host::set_time(1000000);
+  BxCAN::receive(Firmware::frame(0x321, "01"), 0);
+  Firmware::step();
+  Host::advance(67600000);
+  BxCAN::receive(Firmware::frame(0x321, "01"), 0);
+  Firmware::step();
+  CHECK(Firmware::read() == "t321101\rt321101\r");
+
+  CHECK(Firmware::command("c0\r") == "\r");
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// A character that is not a hex digit where one belongs fails the command
+static void test_hex_digits (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("t1G21122\r") == "\a");
+  CHECK(Firmware::command("t12321G22\r") == "\a");
+  CHECK(Firmware::command("T0000012G1AA\r") == "\a");
+  CHECK(Firmware::command("t1231AAZ\r") == "\a");     // tag
+  CHECK_EQ(BxCAN::next_tx(), -1);
+  CHECK(Firmware::command("Xt1231AAt1G31BB\r") == "X00010001\r");
+  BxCAN::Frame out;
+  CHECK(BxCAN::transmit(out, 0));
+  CHECK_EQ(out.Id, 0x123);
+  CHECK_EQ(BxCAN::next_tx(), -1);
+
+  CHECK(Firmware::command("E0G\r") == "\a");
+  CHECK(Firmware::command("ft12G\r") == "\a");
+  CHECK(Firmware::command("m0000000G\r") == "\a");
+  CHECK(Firmware::command("C\r") == "\r");
+  CHECK(Firmware::command("s0G\r") == "\a");
+}
+
+
+// The hex tables against the C library: every character decoded, every byte
+// and a spread of words encoded, frame records formatted as printf would
+static void test_hex_codec (void)
+{
+  uint32_t bad = 0;
+  for (uint32_t c = 0; c < 256; c++)
+  {
+    char s[2] = {static_cast<char>(c), 0};
+    uint8_t expect = (isxdigit(c)) ? strtoul(s, nullptr, 16) : 0xFF;
+    if (char_to_hex(c) != expect) bad++;
+  }
+  CHECK_EQ(bad, 0);
+
+  char buf[16];
+  char ref[16];
+  for (uint32_t i = 0; i < 0x10000; i++)
+  {
+    uint32_t w = i * 0x9E3779B9u;
+    uint32_t len = 0;
+    put_hex8(buf, len, i);
+    put_hex16(buf, len, i);
+    put_hex32(buf, len, w);
+    snprintf(ref, sizeof(ref), "%02X%04X%08X", i & 0xFF, i, w);
+    if (len != 14 || memcmp(buf, ref, len) != 0) bad++;
+    if (hex_to_char(i) != ref[5]) bad++;
+  }
+  CHECK_EQ(bad, 0);
+
+  uint8_t out[64];
+  for (uint32_t i = 0; i < 1024; i++)
+  {
+    BinRecord::Record rec = {};
+    rec.type = BinRecord::Frame;
+    rec.flags = i & (BinRecord::IDE | BinRecord::RTR | BinRecord::Time | BinRecord::Micro);
+    rec.dlc = i % 9;
+    rec.id = (rec.flags & BinRecord::IDE) ? (i * 0x9E3779B9u) >> 3 : (i * 37) & 0x7FF;
+    rec.time = i * 0x01234567u;
+    for (uint32_t k = 0; k < 8; k++) rec.data[k] = i * 8 + k;
+
+    std::string expect;
+    snprintf(ref, sizeof(ref), (rec.flags & BinRecord::IDE) ? "%c%08X%X" : "%c%03X%X",
+             "tTrR"[rec.flags & 3], rec.id, rec.dlc);
+    expect = ref;
+    for (uint32_t k = 0; k < rec.dlc && !(rec.flags & BinRecord::RTR); k++)
+    {
+      snprintf(ref, sizeof(ref), "%02X", rec.data[k]);
+      expect += ref;
+    }
+    if (rec.flags & BinRecord::Time)
+    {
+      snprintf(ref, sizeof(ref), (rec.flags & BinRecord::Micro) ? "%08X" : "%04X",
+               (rec.flags & BinRecord::Micro) ? rec.time : (rec.time & 0xFFFF));
+      expect += ref;
+    }
+    expect += "\r";
+
+    uint32_t len = FormatRecord(rec, Stream::Ascii, out);
+    if (len != FormatSize(rec, Stream::Ascii) || std::string(reinterpret_cast<char*>(out), len) != expect) bad++;
+  }
+  CHECK_EQ(bad, 0);
+}
+
+
+// Y takes a hex deadline of up to 8 digits, nothing else
+static void test_deadline_lines (void)
+{
+  CHECK(Firmware::command("Y0A\r") == "\r");
+  CHECK_EQ(Host::deadline, 10);
+  CHECK(Firmware::command("Y\r") == "\a");
+  CHECK(Firmware::command("Y0X\r") == "\a");
+  CHECK(Firmware::command("Y123456789\r") == "\a");
+  CHECK_EQ(Host::deadline, 10);
+  CHECK(Firmware::command("Y0\r") == "\r");
+  CHECK_EQ(Host::deadline, 0);
+  CHECK(Firmware::command("Y2\r") == "\r");
+}
+
+
+// A lost frame shows as "xNNNN" where it is missing from the stream: a FIFO0
+// overrun overwrites the newest frame, behind the two before it; a full
+// stream drops what comes after the records it holds
+static void test_loss_marker (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  for (uint32_t id = 0; id < 4; id++)
+  {
+    CHECK(BxCAN::receive(Firmware::frame(id, "AA"), 0) == (id < 3));
+  }
+  Firmware::step();
+  CHECK(Firmware::read() == "t0001AA\rt0011AA\rx0001\rt0031AA\r");
+
+  // txrecords takes 128, the marker goes in once the stream has room
+  const uint32_t n = 128 + 5;
+  for (uint32_t id = 0; id < n; id++)
+  {
+    CHECK(BxCAN::receive(Firmware::frame(id, "AA"), 0));
+    Firmware::step();
+  }
+  std::string held = Firmware::read();
+  CHECK(BxCAN::receive(Firmware::frame(0x7FF, "BB"), 0));
+  Firmware::step();
+  std::vector<BinRecord::Record> recs;
+  CHECK(Decode::ascii(held, recs));
+  CHECK_EQ(recs.size(), 128);
+  if (recs.size() == 128) CHECK_EQ(recs[127].id, 127);
+  CHECK(Firmware::read() == "x0005\rt7FF1BB\r");
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// "pcX" is refused and leaves the schedule alone
+static void test_cyclic_clear (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("p00t1231AA0064\r") == "\r");
+  CHECK(Firmware::command("pcX\r") == "\a");
+  CHECK(Firmware::command("pd00\r") == "\r");   // still there to remove
+  CHECK(Firmware::command("pd00\r") == "\a");
+  CHECK(Firmware::command("pc\r") == "\r");
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// The jitter is taken on the bus: a cyclic frame held up behind others in
+// the TX queue shows by how long
+static void test_cyclic_jitter (void)
+{
+  CHECK(Firmware::command("S8\r") == "\r");
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("p00t1231AA000A\r") == "\r");   // every 10 ms
+
+  BxCAN::Frame out;
+  uint32_t sof[3] = {10000, 20500, 30100};
+  for (uint32_t ms = 1; ms <= 30; ms++)
+  {
+    TIM6_DAC_IRQHandler();
+    if (ms % 10 != 0) continue;
+    CHECK_EQ(BxCAN::next_tx(), 0);
+    Host::set_time(sof[ms / 10 - 1] + 51);    // SOF, then 51 bits at 1 Mbit/s until TXOK
+    CHECK(BxCAN::transmit(out, sof[ms / 10 - 1]));
+    Firmware::step();
+  }
+  CHECK(Firmware::command("ps00\r") == "ps0000000300000000000001F4\r");   // 500 us
+  CHECK(Firmware::command("pc\r") == "\r");
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// "hN" hands over the counts of stage N and starts it again: the next reply
+// only has what came after
+static void test_latency_take (void)
+{
+  const std::string empty = "h0" + std::string(4 * Latency::Buckets, '0') + "\r";
+  CHECK(Firmware::command("O\r") == "\r");
+  CHECK(Firmware::command("hc\r") == "\r");
+  CHECK(BxCAN::receive(Firmware::frame(0x123, "AA"), 0));
+  Firmware::step();
+  Firmware::read();
+  CHECK(Firmware::command("h0\r") != empty);
+  CHECK(Firmware::command("h0\r") == empty);
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+// A mix of commands, a frame burst and a malformed line, as the host writes them
+static const char* const mixed[] =
+{
+  "t1A580011223344556677\r",
+  "T1234567F2AABB\r",
+  "r1230\r",
+  "Xt1238AABBCCDD00112233T012345671FF\r",
+  "t1G21122\r",
+  "F\r",
+  "V\r",
+  "q\r"
+};
+
+
+// Commands fed in pieces of 1 to max bytes, the main loop run after each
+// until rxfifo is empty and the bus has sent what was queued; the replies
+static std::string feed (const std::string& s, uint32_t max, std::string& bus)
+{
+  static uint32_t seed = 0x9E3779B9;
+  std::string out;
+  for (size_t pos = 0; pos < s.size(); )
+  {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    size_t n = 1 + seed % max;
+    Firmware::write(s.substr(pos, n));
+    pos += n;
+    do
+    {
+      Firmware::step();
+      BxCAN::Frame f;
+      while (BxCAN::transmit(f, 0))
+      {
+        bus += std::to_string(f.Id) + " ";
+        BxCAN::service();
+      }
+    } while (!rxfifo.empty());
+    out += Firmware::read();
+  }
+  return out;
+}
+
+
+// Where the host's writes split the commands makes no difference: the same
+// replies and frames as whole USB packets
+static void test_split_commands (void)
+{
+  CHECK(Firmware::command("O\r") == "\r");
+  Firmware::command("F\r");   // flags left by the tests before
+  std::string s;
+  for (uint32_t i = 0; i < 400; i++) s += mixed[i % 8];
+
+  std::string bus_packets;
+  std::string bus_split;
+  std::string packets = feed(s, CDC_DATA_MAX_PACKET_SIZE, bus_packets);
+  CHECK(std::count(packets.begin(), packets.end(), '\a') == 50);   // the malformed lines
+  CHECK(feed(s, 1, bus_split) == packets);
+  CHECK(bus_split == bus_packets);
+  bus_split.clear();
+  CHECK(feed(s, 9, bus_split) == packets);
+  CHECK(bus_split == bus_packets);
+  CHECK(Firmware::command("C\r") == "\r");
+}
+
+
+int main (void)
+{
+  Firmware::start();
+  test_smoke();
+  test_tx_done_tag();
+  test_binary_stream();
+  test_reply_batch();
+  test_filter_clear();
+  test_soft_filter_lines();
+  test_rate_limit_lines();
+  test_change_only_lines();
+  test_hex_digits();
+  test_hex_codec();
+  test_deadline_lines();
+  test_cyclic_clear();
+  test_cyclic_jitter();
+  test_latency_take();
+  test_loss_marker();
+  test_split_commands();
+  return check_done();
+}
@@ -0,0 +1,173 @@
+#ifndef _GS_HOST_HPP_
+#define _GS_HOST_HPP_
+
+// The gs_usb firmware on the host: the class driver usbd_gs_usb_core.c runs
+// on a mocked DCD layer, so a test plays the Linux driver's side with the
+// control and bulk transfers it would make. gs_usb.cpp is built into the
+// test to reach its state; GSUSB::run() never returns, start() and step()
+// do what it does.
+
+#include <string.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "host.hpp"
+
+#include "gs_usb.cpp"
+
+USB_CORE_HANDLE USB_Device_dev;
+
+namespace GsHost
+{
+  // What the class driver did to the mocked DCD layer
+  struct Dcd
+  {
+    uint8_t* ep0_rx;            // USBD_CtlPrepareRx() buffer
+    std::string ep0_tx;         // USBD_CtlSendData() bytes
+    uint32_t stalls;            // USBD_CtlError() calls
+    uint8_t* out_buf;           // DCD_EP_PrepareRx() buffer of the bulk OUT endpoint
+    uint32_t out_len;
+    std::string in;             // DCD_EP_Tx() transfer waiting for the host
+    bool in_busy;
+  };
+  Dcd dcd;
+}
+
+extern "C"
+{
+uint32_t DCD_PMA_Config (USB_CORE_HANDLE*, uint16_t, uint16_t, uint32_t) { return 0; }
+uint32_t DCD_EP_Open (USB_CORE_HANDLE*, uint16_t, uint16_t, uint8_t) { return 0; }
+uint32_t DCD_EP_Close (USB_CORE_HANDLE*, uint8_t) { return 0; }
+
+uint32_t DCD_EP_PrepareRx (USB_CORE_HANDLE*, uint8_t, uint8_t* pbuf, uint16_t buf_len)
+{
+  GsHost::dcd.out_buf = pbuf;
+  GsHost::dcd.out_len = buf_len;
+  return 0;
+}
+
+uint32_t DCD_EP_Tx (USB_CORE_HANDLE*, uint8_t, uint8_t* pbuf, uint32_t buf_len)
+{
+  GsHost::dcd.in.assign(reinterpret_cast<char*>(pbuf), buf_len);
+  GsHost::dcd.in_busy = true;
+  return 0;
+}
+
+void USBD_CtlError (USB_CORE_HANDLE*, USB_SETUP_REQ*)
+{
+  GsHost::dcd.stalls++;
+}
+
+USBD_Status USBD_CtlSendData (USB_CORE_HANDLE*, uint8_t* buf, uint16_t len)
+{
+  GsHost::dcd.ep0_tx.assign(reinterpret_cast<char*>(buf), len);
+  return USBD_OK;
+}
+
+USBD_Status USBD_CtlPrepareRx (USB_CORE_HANDLE*, uint8_t* pbuf, uint16_t)
+{
+  GsHost::dcd.ep0_rx = pbuf;
+  return USBD_OK;
+}
+}
+
+namespace GsHost
+{
+  // Requests as the gs_usb driver sends them: vendor, to the interface
+  static const uint8_t ReqOut = 0x41;
+  static const uint8_t ReqIn = 0xC1;
+
+  inline void start (void)
+  {
+    Host::reset();
+    dcd = Dcd();
+    CANbus::init();
+    CANbus::set_rx_cb(ReceiveCANMsg);
+    CANbus::set_event_cb(CANEvent);
+    CANbus::set_tx_cb(TransmitDone);
+    USB_Device_dev.dev.device_status = USB_CONFIGURED;
+    USBD_GS_USB_cb.Init(&USB_Device_dev, 1);
+  }
+
+  // Pending CAN interrupts, then the main loop once
+  inline void step (void)
+  {
+    BxCAN::service();
+    CANbus::poll();
+    apply_requests();
+    transmit();
+  }
+
+  // Host-to-device request with its data stage, false if it was stalled
+  inline bool control_out (uint8_t req, const void* data, uint16_t len)
+  {
+    USB_SETUP_REQ setup = {ReqOut, req, 0, 0, len};
+    uint32_t stalls = dcd.stalls;
+    dcd.ep0_rx = nullptr;
+    USBD_GS_USB_cb.Setup(&USB_Device_dev, &setup);
+    if (dcd.stalls != stalls) return false;
+    if (len != 0)
+    {
+      if (dcd.ep0_rx == nullptr) return false;
+      memcpy(dcd.ep0_rx, data, len);
+      USBD_GS_USB_cb.EP0_RxReady(&USB_Device_dev);
+    }
+    return true;
+  }
+
+  // Device-to-host request, the data stage as the device answered it; empty
+  // if it was stalled
+  inline std::string control_in (uint8_t req, uint16_t len)
+  {
+    USB_SETUP_REQ setup = {ReqIn, req, 0, 0, len};
+    uint32_t stalls = dcd.stalls;
+    dcd.ep0_tx.clear();
+    USBD_GS_USB_cb.Setup(&USB_Device_dev, &setup);
+    return (dcd.stalls != stalls) ? std::string() : dcd.ep0_tx;
+  }
+
+  // One bulk OUT transfer, the 20 bytes of a frame without timestamp as
+  // the driver sends them
+  inline void bulk_out (const GS_Host_Frame_TypeDef& frame, uint32_t len = GS_HOST_FRAME_SIZE)
+  {
+    memcpy(dcd.out_buf, &frame, len);
+    USB_Device_dev.dev.out_ep[GS_USB_OUT_EP & 0x7F].xfer_count = len;
+    USBD_GS_USB_cb.DataOut(&USB_Device_dev, GS_USB_OUT_EP & 0x7F);
+  }
+
+  // Every IN transfer the device has queued, completed one after the other
+  inline std::vector<GS_Host_Frame_TypeDef> bulk_in (std::vector<uint32_t>* sizes = nullptr)
+  {
+    std::vector<GS_Host_Frame_TypeDef> frames;
+    while (dcd.in_busy)
+    {
+      GS_Host_Frame_TypeDef f;
+      memset(&f, 0, sizeof(f));
+      memcpy(&f, dcd.in.data(), (dcd.in.size() > sizeof(f)) ? sizeof(f) : dcd.in.size());
+      frames.push_back(f);
+      if (sizes) sizes->push_back(dcd.in.size());
+      dcd.in_busy = false;
+      USBD_GS_USB_cb.DataIn(&USB_Device_dev, GS_USB_IN_EP & 0x7F);
+    }
+    return frames;
+  }
+
+  inline GS_Host_Frame_TypeDef frame (uint32_t echo_id, uint32_t can_id, const char* data)
+  {
+    GS_Host_Frame_TypeDef f;
+    memset(&f, 0, sizeof(f));
+    f.echo_id = echo_id;
+    f.can_id = can_id;
+    f.can_dlc = strlen(data) / 2;
+    for (uint32_t i = 0; i < f.can_dlc; i++)
+    {
+      char byte[3] = {data[2*i], data[2*i + 1], 0};
+      f.data[i] = strtoul(byte, nullptr, 16);
+    }
+    return f;
+  }
+}
+
+#endif // _GS_HOST_HPP_
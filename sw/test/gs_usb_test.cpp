@@ -0,0 +1,257 @@
+// gs_usb as the Linux driver sees it: probe, open, frames both ways, stop
+#include "gs_host.hpp"
+#include "check.hpp"
+
+
+static GS_Device_Mode_TypeDef start_mode (uint32_t flags)
+{
+  GS_Device_Mode_TypeDef m = {GS_CAN_MODE_START, flags};
+  return m;
+}
+
+
+// gs_usb_probe(): host format, device config, bit timing constants
+static void test_probe (void)
+{
+  uint32_t host_format = 0x0000BEEF;
+  CHECK(GsHost::control_out(GS_USB_BREQ_HOST_FORMAT, &host_format, sizeof(host_format)));
+
+  std::string cfg = GsHost::control_in(GS_USB_BREQ_DEVICE_CONFIG, sizeof(GS_Device_Config_TypeDef));
+  CHECK_EQ(cfg.size(), sizeof(GS_Device_Config_TypeDef));
+  GS_Device_Config_TypeDef dc;
+  memcpy(&dc, cfg.data(), sizeof(dc));
+  CHECK_EQ(dc.icount, 0);      // one channel
+  CHECK_EQ(dc.sw_version, 2);
+  CHECK_EQ(dc.hw_version, 1);
+
+  std::string btc = GsHost::control_in(GS_USB_BREQ_BT_CONST, sizeof(GS_Device_BT_Const_TypeDef));
+  CHECK_EQ(btc.size(), sizeof(GS_Device_BT_Const_TypeDef));
+  GS_Device_BT_Const_TypeDef bt;
+  memcpy(&bt, btc.data(), sizeof(bt));
+  CHECK_EQ(bt.fclk_can, 48000000);
+  CHECK_EQ(bt.tseg1_max, 16);
+  CHECK_EQ(bt.tseg2_max, 8);
+  CHECK_EQ(bt.brp_max, 1024);
+  CHECK(bt.feature & GS_CAN_FEATURE_HW_TIMESTAMP);
+
+  // The device only answers what it knows, a short request gets what fits
+  CHECK(GsHost::control_in(GS_USB_BREQ_IDENTIFY, 4).empty());
+  CHECK_EQ(GsHost::control_in(GS_USB_BREQ_DEVICE_CONFIG, 4).size(), 4);
+  CHECK(!GsHost::control_out(GS_USB_BREQ_MODE, &bt, sizeof(bt) + 1));  // longer than the EP0 buffer
+}
+
+
+// gs_can_open(): bit timing, then start; applied by the main loop
+static void test_open (void)
+{
+  GS_Device_Bittiming_TypeDef bt = {6, 7, 2, 1, 6};  // 500 kbit/s of 48 MHz: 1 + 13 + 2 quanta
+  CHECK(GsHost::control_out(GS_USB_BREQ_BITTIMING, &bt, sizeof(bt)));
+  GS_Device_Mode_TypeDef m = start_mode(GS_CAN_MODE_HW_TIMESTAMP);
+  CHECK(GsHost::control_out(GS_USB_BREQ_MODE, &m, sizeof(m)));
+  CHECK(!CANbus::is_open());
+
+  // Pending requests are not overwritten: another one is stalled until the
+  // main loop applied them
+  GS_Device_Bittiming_TypeDef other = {1, 1, 1, 1, 1};
+  CHECK(!GsHost::control_out(GS_USB_BREQ_BITTIMING, &other, sizeof(other)));
+  GS_Device_Mode_TypeDef reset = {GS_CAN_MODE_RESET, 0};
+  CHECK(!GsHost::control_out(GS_USB_BREQ_MODE, &reset, sizeof(reset)));
+  GsHost::step();
+  CHECK(CANbus::is_open());
+  CHECK_EQ(host_can.BTR.value & 0x03FF03FF, (0 << 24) | (1 << 20) | (12 << 16) | 5);
+  CHECK(CANbus::timestamp() == CANbus::TimeStamp::Micro);
+
+  Host::set_time(0xCAFE0000);
+  std::string ts = GsHost::control_in(GS_USB_BREQ_TIMESTAMP, 4);
+  uint32_t t = 0;
+  CHECK_EQ(ts.size(), 4);
+  memcpy(&t, ts.data(), ts.size());
+  CHECK_EQ(t, 0xCAFE0000);
+}
+
+
+// Received frames go up one per IN transfer, with the 4-byte timestamp
+static void test_receive (void)
+{
+  BxCAN::Frame f = {};
+  f.Id = 0x123;
+  f.DLC = 2;
+  f.Data[0] = 0x11;
+  f.Data[1] = 0x22;
+  BxCAN::receive(f, 0);
+  f.Id = 0x1ABCDEF;
+  f.IDE = true;
+  f.RTR = true;
+  f.DLC = 0;
+  BxCAN::receive(f, 0);
+  GsHost::step();
+
+  std::vector<uint32_t> sizes;
+  std::vector<GS_Host_Frame_TypeDef> in = GsHost::bulk_in(&sizes);
+  CHECK_EQ(in.size(), 2);
+  if (in.size() != 2) return;
+  CHECK_EQ(sizes[0], GS_HOST_FRAME_SIZE_TS);
+  CHECK_EQ(in[0].echo_id, GS_HOST_FRAME_ECHO_RX);
+  CHECK_EQ(in[0].can_id, 0x123);
+  CHECK_EQ(in[0].can_dlc, 2);
+  CHECK_EQ(in[0].data[0], 0x11);
+  CHECK_EQ(in[0].data[1], 0x22);
+  CHECK_EQ(in[0].flags, 0);
+  CHECK_EQ(in[1].can_id, 0x1ABCDEF | GS_CAN_EFF_FLAG | GS_CAN_RTR_FLAG);
+}
+
+
+// Frames from the host go out on the bus and come back as echoes with their
+// echo_id, which is what frees the driver's TX context
+static void test_transmit (void)
+{
+  GsHost::bulk_out(GsHost::frame(7, 0x321, "AABBCC"));
+  GsHost::bulk_out(GsHost::frame(8, 0x1234567 | GS_CAN_EFF_FLAG, "01"));
+  GsHost::step();   // one frame a turn
+  GsHost::step();
+
+  BxCAN::Frame out;
+  CHECK(BxCAN::transmit(out, 0));
+  CHECK_EQ(out.Id, 0x321);
+  CHECK(!out.IDE);
+  CHECK_EQ(out.DLC, 3);
+  CHECK_EQ(out.Data[2], 0xCC);
+  CHECK(BxCAN::transmit(out, 0));
+  CHECK_EQ(out.Id, 0x1234567);
+  CHECK(out.IDE);
+  GsHost::step();
+
+  std::vector<GS_Host_Frame_TypeDef> in = GsHost::bulk_in();
+  CHECK_EQ(in.size(), 2);
+  if (in.size() != 2) return;
+  CHECK_EQ(in[0].echo_id, 7);
+  CHECK_EQ(in[0].can_id, 0x321);
+  CHECK_EQ(in[1].echo_id, 8);
+  CHECK_EQ(in[1].can_id, 0x1234567 | GS_CAN_EFF_FLAG);
+}
+
+
+// The echo goes up once the frame is on the bus, stamped with when it went
+static void test_echo_time (void)
+{
+  Host::set_time(1000000);
+  GsHost::bulk_out(GsHost::frame(9, 0x100, "00"));
+  GsHost::step();
+  GsHost::step();
+  CHECK(GsHost::bulk_in().empty());
+
+  Host::advance(5000);
+  BxCAN::Frame out;
+  CHECK(BxCAN::transmit(out, 0));
+  Host::advance(100);
+  GsHost::step();
+  std::vector<GS_Host_Frame_TypeDef> in = GsHost::bulk_in();
+  CHECK_EQ(in.size(), 1);
+  if (in.size() != 1) return;
+  CHECK_EQ(in[0].echo_id, 9);
+  CHECK(in[0].timestamp_us > 1000000);
+  CHECK(in[0].timestamp_us <= Host::time());
+}
+
+
+// A frame that does not make it is echoed all the same, the driver needs
+// the echo to free its context, and an error frame says what went wrong
+static void test_tx_failure (void)
+{
+  GsHost::bulk_out(GsHost::frame(11, 0x200, "01"));
+  GsHost::bulk_out(GsHost::frame(12, 0x201, "02"));
+  GsHost::bulk_out(GsHost::frame(13, 0x202, "03"));
+  GsHost::step();
+  GsHost::step();
+  GsHost::step();
+  BxCAN::fail_tx(0, CAN_TSR_ALST0);
+  BxCAN::fail_tx(1, CAN_TSR_TERR0);
+  BxCAN::fail_tx(2, 0);   // aborted
+  GsHost::step();
+
+  std::vector<GS_Host_Frame_TypeDef> in = GsHost::bulk_in();
+  CHECK_EQ(in.size(), 6);
+  if (in.size() != 6) return;
+  CHECK_EQ(in[0].echo_id, 11);
+  CHECK_EQ(in[1].echo_id, GS_HOST_FRAME_ECHO_RX);
+  CHECK_EQ(in[1].can_id, GS_CAN_ERR_FLAG | GS_CAN_ERR_LOSTARB);
+  CHECK_EQ(in[1].can_dlc, GS_CAN_ERR_DLC);
+  CHECK_EQ(in[2].echo_id, 12);
+  CHECK_EQ(in[3].can_id, GS_CAN_ERR_FLAG | GS_CAN_ERR_PROT | GS_CAN_ERR_BUSERROR);
+  CHECK_EQ(in[3].data[2], GS_CAN_ERR_PROT_TX);
+  CHECK_EQ(in[4].echo_id, 13);
+  CHECK_EQ(in[5].can_id, GS_CAN_ERR_FLAG | GS_CAN_ERR_TX_TIMEOUT);
+}
+
+
+// Received frames never take the room the echoes of frames in flight need:
+// with the host not reading, a flood of traffic overflows, the echoes still
+// all come up
+static void test_echo_room (void)
+{
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    GsHost::bulk_out(GsHost::frame(20 + i, 0x300 + i, "00"));
+    GsHost::step();
+  }
+
+  BxCAN::Frame f = {};
+  f.Id = 0x7FF;
+  f.DLC = 1;
+  for (uint32_t i = 0; i < 40; i++)
+  {
+    BxCAN::receive(f, 0);
+    GsHost::step();
+  }
+  BxCAN::Frame out;
+  while (BxCAN::transmit(out, 0)) {}
+  GsHost::step();
+
+  // The class driver holds one frame in its IN transfer, inframes the rest
+  std::vector<GS_Host_Frame_TypeDef> in = GsHost::bulk_in();
+  uint32_t echoes = 0;
+  for (auto& fr : in)
+  {
+    if (fr.echo_id != GS_HOST_FRAME_ECHO_RX) echoes++;
+  }
+  CHECK_EQ(echoes, 3);
+  CHECK(in.size() < 40 + 3);
+
+  // The first frame with room again carries the loss
+  BxCAN::receive(f, 0);
+  GsHost::step();
+  in = GsHost::bulk_in();
+  CHECK_EQ(in.size(), 1);
+  if (in.size() != 1) return;
+  CHECK(in[0].flags & GS_CAN_FLAG_OVERFLOW);
+}
+
+
+// gs_can_close(): reset mode stops the controller
+static void test_stop (void)
+{
+  GS_Device_Mode_TypeDef m = {GS_CAN_MODE_RESET, 0};
+  CHECK(GsHost::control_out(GS_USB_BREQ_MODE, &m, sizeof(m)));
+  GsHost::step();
+  CHECK(!CANbus::is_open());
+  BxCAN::Frame f = {};
+  f.Id = 0x55;
+  BxCAN::receive(f, 0);
+  GsHost::step();
+  CHECK(GsHost::bulk_in().empty());
+}
+
+
+int main (void)
+{
+  GsHost::start();
+  test_probe();
+  test_open();
+  test_receive();
+  test_transmit();
+  test_echo_time();
+  test_tx_failure();
+  test_echo_room();
+  test_stop();
+  return check_done();
+}
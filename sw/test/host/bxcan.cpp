@@ -0,0 +1,322 @@
+#include <string.h>
+
+#include "stm32f0xx.h"
+
+extern "C" void CEC_CAN_IRQHandler (void);
+
+using BxCAN::Frame;
+
+
+HostCAN host_can;
+
+static Frame fifo[3];
+static uint16_t fifo_sof[3];
+static uint32_t fifo_n = 0;
+static bool tx_pending[3];
+static uint32_t tx_seq[3];      // order of the requests, for TXFP
+static uint32_t seq = 0;
+
+static const uint32_t tme[3] = {CAN_TSR_TME0, CAN_TSR_TME1, CAN_TSR_TME2};
+
+
+static inline uint32_t rir_value (const Frame& f)
+{
+  uint32_t rir = (f.IDE) ? ((f.Id << 3) | CAN_RI0R_IDE) : (f.Id << 21);
+  return rir | ((f.RTR) ? CAN_RI0R_RTR : 0);
+}
+
+
+// Head of FIFO0 into its mailbox registers, FMP0
+static void show_fifo (void)
+{
+  host_can.RF0R.value = (host_can.RF0R.value & ~CAN_RF0R_FMP0) | fifo_n;
+  if (fifo_n == 0) return;
+
+  const Frame& f = fifo[0];
+  uint32_t data[2];
+  memcpy(data, f.Data, sizeof(data));
+  host_can.sFIFOMailBox[0].RIR.value = rir_value(f);
+  host_can.sFIFOMailBox[0].RDTR.value = f.DLC | (static_cast<uint32_t>(fifo_sof[0]) << 16);
+  host_can.sFIFOMailBox[0].RDLR.value = data[0];
+  host_can.sFIFOMailBox[0].RDHR.value = data[1];
+}
+
+
+// CODE: the lowest empty mailbox
+static void update_code (void)
+{
+  uint32_t tsr = host_can.TSR.value & ~CAN_TSR_CODE;
+  for (uint32_t mb = 0; mb < 3; mb++)
+  {
+    if (tsr & tme[mb])
+    {
+      tsr |= mb << 24;
+      break;
+    }
+  }
+  host_can.TSR.value = tsr;
+}
+
+
+static void complete (uint32_t mb, uint32_t flags)
+{
+  tx_pending[mb] = false;
+  host_can.sTxMailBox[mb].TIR.value &= ~CAN_TI0R_TXRQ;
+  host_can.TSR.value |= ((CAN_TSR_RQCP0 | flags) << (8*mb)) | tme[mb];
+  update_code();
+}
+
+
+static void write_mcr (HostReg& r, uint32_t v)
+{
+  if (v & CAN_MCR_RESET)
+  {
+    BxCAN::reset();   // clears itself, the peripheral ends up in sleep mode
+    return;
+  }
+  r.value = v;
+  uint32_t msr = host_can.MSR.value & ~(CAN_MSR_INAK | CAN_MSR_SLAK);
+  if (v & CAN_MCR_INRQ)
+  {
+    msr |= CAN_MSR_INAK;
+  }
+  else if (v & CAN_MCR_SLEEP)
+  {
+    msr |= CAN_MSR_SLAK;
+  }
+  host_can.MSR.value = msr;
+}
+
+
+static void write_msr (HostReg& r, uint32_t v)
+{
+  r.value &= ~(v & (CAN_MSR_ERRI | CAN_MSR_WKUI | CAN_MSR_SLAKI));
+}
+
+
+static void write_tsr (HostReg& r, uint32_t v)
+{
+  for (uint32_t mb = 0; mb < 3; mb++)
+  {
+    if (v & (CAN_TSR_RQCP0 << (8*mb)))
+    {
+      r.value &= ~(0x0F << (8*mb));   // RQCP, TXOK, ALST, TERR
+    }
+    if ((v & (CAN_TSR_ABRQ0 << (8*mb))) && tx_pending[mb])
+    {
+      complete(mb, 0);
+    }
+  }
+}
+
+
+static void write_tir (HostReg& r, uint32_t v)
+{
+  uint32_t mb = 0;
+  while (&host_can.sTxMailBox[mb].TIR != &r) mb++;
+
+  r.value = v;
+  if ((v & CAN_TI0R_TXRQ) && !tx_pending[mb])
+  {
+    tx_pending[mb] = true;
+    tx_seq[mb] = seq++;
+    host_can.TSR.value &= ~tme[mb];
+    update_code();
+  }
+}
+
+
+static void write_rf0r (HostReg& r, uint32_t v)
+{
+  r.value &= ~(v & (CAN_RF0R_FULL0 | CAN_RF0R_FOVR0));
+  if ((v & CAN_RF0R_RFOM0) && fifo_n != 0)
+  {
+    fifo_n--;
+    for (uint32_t i = 0; i < fifo_n; i++)
+    {
+      fifo[i] = fifo[i + 1];
+      fifo_sof[i] = fifo_sof[i + 1];
+    }
+    show_fifo();
+  }
+}
+
+
+static void write_esr (HostReg& r, uint32_t v)
+{
+  r.value = (r.value & ~CAN_ESR_LEC) | (v & CAN_ESR_LEC);
+}
+
+
+void BxCAN::reset (void)
+{
+  // The filters keep their setup
+  host_can.RF0R.value = 0;
+  host_can.RF1R.value = 0;
+  host_can.IER.value = 0;
+  host_can.ESR.value = 0;
+  for (uint32_t mb = 0; mb < 3; mb++)
+  {
+    host_can.sTxMailBox[mb].TIR.value = 0;
+    host_can.sTxMailBox[mb].TDTR.value = 0;
+    host_can.sTxMailBox[mb].TDLR.value = 0;
+    host_can.sTxMailBox[mb].TDHR.value = 0;
+  }
+
+  host_can.MCR.write = write_mcr;
+  host_can.MSR.write = write_msr;
+  host_can.TSR.write = write_tsr;
+  host_can.RF0R.write = write_rf0r;
+  host_can.ESR.write = write_esr;
+  for (uint32_t mb = 0; mb < 3; mb++)
+  {
+    host_can.sTxMailBox[mb].TIR.write = write_tir;
+    tx_pending[mb] = false;
+  }
+
+  host_can.MCR.value = CAN_MCR_SLEEP | 0x00010000;  // DBF
+  host_can.MSR.value = CAN_MSR_SLAK;
+  host_can.TSR.value = CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2;
+  host_can.BTR.value = 0x01230000;
+  fifo_n = 0;
+}
+
+
+static struct PowerOn
+{
+  PowerOn (void) { BxCAN::reset(); }
+} power_on;
+
+
+static inline bool running (void)
+{
+  return !(host_can.MSR.value & (CAN_MSR_INAK | CAN_MSR_SLAK));
+}
+
+
+bool BxCAN::receive (const Frame& f, uint16_t sof)
+{
+  if (!running()) return true;   // nobody listens, nothing overran either
+
+  if (fifo_n == 3)
+  {
+    if (!(host_can.MCR.value & CAN_MCR_RFLM))
+    {
+      fifo[2] = f;      // the last message is overwritten
+      fifo_sof[2] = sof;
+      show_fifo();
+    }
+    host_can.RF0R.value |= CAN_RF0R_FOVR0;
+    return false;
+  }
+
+  fifo[fifo_n] = f;
+  fifo_sof[fifo_n] = sof;
+  fifo_n++;
+  if (fifo_n == 3) host_can.RF0R.value |= CAN_RF0R_FULL0;
+  show_fifo();
+  return true;
+}
+
+
+uint32_t BxCAN::rx_level (void)
+{
+  return fifo_n;
+}
+
+
+// Arbitration order of the identifier field, the lower key wins
+static inline uint32_t arbitration (uint32_t tir)
+{
+  uint32_t stid = tir >> 21;
+  uint32_t rtr = (tir & CAN_TI0R_RTR) ? 1 : 0;
+  if (tir & CAN_TI0R_IDE)
+  {
+    return stid << 21 | 3 << 19 | ((tir >> 3) & 0x3FFFF) << 1 | rtr;
+  }
+  return stid << 21 | rtr << 20;
+}
+
+
+int BxCAN::next_tx (void)
+{
+  int next = -1;
+  for (uint32_t mb = 0; mb < 3; mb++)
+  {
+    if (!tx_pending[mb]) continue;
+    if (next < 0)
+    {
+      next = mb;
+    }
+    else if (host_can.MCR.value & CAN_MCR_TXFP)
+    {
+      if (static_cast<int32_t>(tx_seq[mb] - tx_seq[next]) < 0) next = mb;
+    }
+    else if (arbitration(host_can.sTxMailBox[mb].TIR) < arbitration(host_can.sTxMailBox[next].TIR))
+    {
+      next = mb;
+    }
+  }
+  return next;
+}
+
+
+bool BxCAN::transmit (Frame& f, uint16_t sof)
+{
+  int mb = next_tx();
+  if (mb < 0 || !running()) return false;
+
+  uint32_t tir = host_can.sTxMailBox[mb].TIR;
+  uint32_t data[2] = {host_can.sTxMailBox[mb].TDLR, host_can.sTxMailBox[mb].TDHR};
+  f.IDE = (tir & CAN_TI0R_IDE) ? true : false;
+  f.RTR = (tir & CAN_TI0R_RTR) ? true : false;
+  f.Id = (f.IDE) ? (tir >> 3) : (tir >> 21);
+  f.DLC = host_can.sTxMailBox[mb].TDTR & CAN_TDT0R_DLC;
+  memcpy(f.Data, data, sizeof(f.Data));
+
+  host_can.sTxMailBox[mb].TDTR.value = (host_can.sTxMailBox[mb].TDTR.value & 0xFFFF) |
+                                       (static_cast<uint32_t>(sof) << 16);
+  complete(mb, CAN_TSR_TXOK0);
+  if (host_can.BTR.value & CAN_BTR_LBKM) receive(f, sof);
+  return true;
+}
+
+
+void BxCAN::fail_tx (uint32_t mb, uint32_t tsr)
+{
+  if (tx_pending[mb]) complete(mb, tsr);
+}
+
+
+void BxCAN::bus_error (uint32_t lec)
+{
+  host_can.ESR.value = (host_can.ESR.value & ~CAN_ESR_LEC) | (lec << 4);
+  if (host_can.IER.value & CAN_IER_LECIE) host_can.MSR.value |= CAN_MSR_ERRI;
+}
+
+
+bool BxCAN::irq_pending (void)
+{
+  if (!host_irq_enabled(CEC_CAN_IRQn)) return false;
+
+  uint32_t ier = host_can.IER;
+  uint32_t tsr = host_can.TSR;
+  uint32_t rf0r = host_can.RF0R;
+  return ((ier & CAN_IER_TMEIE) && (tsr & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2))) ||
+         ((ier & CAN_IER_FMPIE0) && (rf0r & CAN_RF0R_FMP0)) ||
+         ((ier & CAN_IER_FFIE0) && (rf0r & CAN_RF0R_FULL0)) ||
+         ((ier & CAN_IER_FOVIE0) && (rf0r & CAN_RF0R_FOVR0)) ||
+         ((ier & CAN_IER_ERRIE) && (host_can.MSR & CAN_MSR_ERRI));
+}
+
+
+uint32_t BxCAN::service (void)
+{
+  uint32_t n = 0;
+  while (irq_pending() && n < 100)  // a handler that clears nothing shows as 100
+  {
+    CEC_CAN_IRQHandler();
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,78 @@
+#ifndef _HOST_BXCAN_HPP_
+#define _HOST_BXCAN_HPP_
+
+#include <stdint.h>
+
+// Register of the bxCAN model: reads give the value, writes go through the
+// register's handler so the model can react the way the peripheral does
+// (request bits, flags cleared by writing 1, FIFO release).
+class HostReg
+{
+public:
+  typedef void (*Write) (HostReg& reg, uint32_t value);
+
+  HostReg (void) : value(0), write(nullptr) {}
+  HostReg (const HostReg&) = delete;
+  HostReg& operator= (const HostReg&) = delete;
+
+  operator uint32_t () const { return value; }
+  HostReg& operator= (uint32_t v) { if (write) write(*this, v); else value = v; return *this; }
+  HostReg& operator|= (uint32_t v) { return *this = (value | v); }
+  HostReg& operator&= (uint32_t v) { return *this = (value & v); }
+
+  uint32_t value;
+  Write write;
+};
+
+
+// Same member names as CAN_TypeDef, so can.cpp builds unchanged against it
+struct HostCAN
+{
+  HostReg MCR;
+  HostReg MSR;
+  HostReg TSR;
+  HostReg RF0R;
+  HostReg RF1R;
+  HostReg IER;
+  HostReg ESR;
+  HostReg BTR;
+  struct { HostReg TIR, TDTR, TDLR, TDHR; } sTxMailBox[3];
+  struct { HostReg RIR, RDTR, RDLR, RDHR; } sFIFOMailBox[2];
+  HostReg FMR;
+  HostReg FM1R;
+  HostReg FS1R;
+  HostReg FFA1R;
+  HostReg FA1R;
+  struct { HostReg FR1, FR2; } sFilterRegister[28];
+};
+
+extern HostCAN host_can;
+
+
+// The bus side of the model. Frames go into the 3-deep FIFO0 and out of the
+// three mailboxes as the peripheral would take them; the tests call the CAN
+// interrupt whenever irq_pending() says it would run. SOF time stamps are
+// the 16-bit bit counter of TTCM, at 1 Mbit/s simply the microsecond.
+namespace BxCAN
+{
+  typedef struct
+  {
+    uint32_t Id;
+    bool IDE;
+    bool RTR;
+    uint8_t DLC;
+    uint8_t Data[8];
+  } Frame;
+
+  void reset (void);                            // power-on state
+  bool receive (const Frame& f, uint16_t sof);  // false: FIFO0 overran, the newest frame was lost
+  uint32_t rx_level (void);                     // frames in FIFO0
+  int next_tx (void);                           // mailbox to win arbitration next, -1: none pending
+  bool transmit (Frame& f, uint16_t sof);       // next_tx() goes out: RQCP, TXOK
+  void fail_tx (uint32_t mb, uint32_t tsr);     // request ends without TXOK, tsr: ALST0 or TERR0
+  void bus_error (uint32_t lec);                // error frame seen, LEC 1..6
+  bool irq_pending (void);
+  uint32_t service (void);                      // runs the CAN interrupt while pending, returns how often
+}
+
+#endif // _HOST_BXCAN_HPP_
@@ -0,0 +1,32 @@
+#include "host.hpp"
+
+extern "C"
+{
+#include "usbd_cdc_core.h"
+#include "usbd_usr.h"
+};
+
+
+// The CDC class is not built for the tests: they take IN packets with
+// VCP_TxFill() and feed OUT data to VCP_callback() themselves. bench_usb
+// links the real stack, so none of this comes out of the library there.
+USBD_Class_cb_TypeDef USBD_CDC_cb;
+USBD_Usr_cb_TypeDef USR_cb;
+USBD_DEVICE USR_desc;
+
+
+void USBD_Init (USB_CORE_HANDLE*, USBD_DEVICE*, USBD_Class_cb_TypeDef*, USBD_Usr_cb_TypeDef*)
+{
+}
+
+
+void usbd_cdc_Kick (void)
+{
+  Host::kicks++;
+}
+
+
+void usbd_cdc_Deadline (uint32_t deadline)
+{
+  Host::deadline = deadline;
+}
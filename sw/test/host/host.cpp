@@ -0,0 +1,87 @@
+#include <string.h>
+
+#include "host.hpp"
+#include "usb.hpp"
+
+extern "C"
+{
+#include "usbd_cdc_core.h"
+};
+
+
+extern "C"
+{
+TIM_TypeDef host_tim2;
+TIM_TypeDef host_tim6;
+TIM_TypeDef host_tim15;
+RCC_TypeDef host_rcc;
+GPIO_TypeDef host_gpiob;
+
+volatile uint32_t host_primask = 0;
+}
+
+static uint32_t nvic_enabled = 0;
+
+// arm_linker_stack_size bytes, as thumb_crt0.s would set them up. Below 4 GB
+// as the tests are not position independent: __get_MSP() is 32-bit.
+asm (".bss\n"
+     ".balign 4\n"
+     ".globl __stack_start__\n"
+     "__stack_start__:\n"
+     ".skip 512\n"
+     ".globl __stack_end__\n"
+     "__stack_end__:\n"
+     ".skip 4\n"
+     ".text\n");
+
+extern "C" uint32_t __stack_end__[];
+
+
+uint32_t __get_MSP (void)
+{
+  return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(__stack_end__));
+}
+
+
+void NVIC_EnableIRQ (IRQn_Type IRQn)
+{
+  nvic_enabled |= 1 << IRQn;
+}
+
+
+void NVIC_DisableIRQ (IRQn_Type IRQn)
+{
+  nvic_enabled &= ~(1 << IRQn);
+}
+
+
+void NVIC_SetPriority (IRQn_Type, uint32_t)
+{
+}
+
+
+uint32_t host_irq_enabled (IRQn_Type IRQn)
+{
+  return nvic_enabled & (1 << IRQn);
+}
+
+
+void Host::reset (void)
+{
+  memset(&host_tim2, 0, sizeof(host_tim2));
+  memset(&host_tim6, 0, sizeof(host_tim6));
+  memset(&host_tim15, 0, sizeof(host_tim15));
+  host_tim2.SR = TIM_SR_UIF;    // Timer::init() waits for the update event
+  host_tim6.SR = TIM_SR_UIF;
+  host_tim15.SR = TIM_SR_UIF;
+  BxCAN::reset();
+  USBDev::reset();
+  nvic_enabled = 0;
+  host_primask = 0;
+  kicks = 0;
+}
+
+
+// Set by the CDC class stubs in cdc_stub.cpp
+uint32_t Host::kicks = 0;
+uint32_t Host::deadline = 0;
@@ -0,0 +1,28 @@
+#ifndef _HOST_HPP_
+#define _HOST_HPP_
+
+#include <stdint.h>
+
+#include "stm32f0xx.h"
+
+// Test side of the host build: the clocks and the USB stubs
+namespace Host
+{
+  void reset (void);    // timers ready for init(), bxCAN at power-on, interrupts unmasked
+
+  // TIM2 is the microsecond timebase, TIM15 the 1 ms one wrapping at 60000
+  inline void set_time (uint32_t us)
+  {
+    host_tim2.CNT = us;
+    host_tim15.CNT = (us / 1000) % 60000;
+  }
+  inline uint32_t time (void) { return host_tim2.CNT; }
+  inline void advance (uint32_t us) { set_time(time() + us); }
+
+  extern uint32_t kicks;          // usbd_cdc_Kick() calls
+  extern uint32_t deadline;       // last usbd_cdc_Deadline()
+}
+
+extern "C" uint16_t host_pma[512];  // USB packet memory, 1 KB, see usb_pma.c
+
+#endif // _HOST_HPP_
@@ -0,0 +1,69 @@
+#ifndef _HOST_STM32F0XX_H_
+#define _HOST_STM32F0XX_H_
+
+// Host build of the firmware core. The register layouts come from the device
+// header, core_cm0.h (inline assembly) is kept out and replaced by the few
+// intrinsics the firmware uses. The peripherals the core touches live in RAM,
+// see host.cpp: TIM2, TIM6, TIM15, RCC and GPIOB as plain registers, CAN as
+// the bxCAN model in bxcan.hpp, USB as the one in usb.hpp.
+
+#include <stdint.h>
+
+#define __CORE_CM0_H_GENERIC
+#define __CORE_CM0_H_DEPENDANT
+#ifdef __cplusplus
+#define __I   volatile
+#else
+#define __I   volatile const
+#endif
+#define __O   volatile
+#define __IO  volatile
+
+#include "../../STM32F0xx/CMSIS/Device/Include/stm32f0xx.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern TIM_TypeDef host_tim2;
+extern TIM_TypeDef host_tim6;
+extern TIM_TypeDef host_tim15;
+extern RCC_TypeDef host_rcc;
+extern GPIO_TypeDef host_gpiob;
+
+#undef TIM2
+#undef TIM6
+#undef TIM15
+#undef RCC
+#undef GPIOB
+#define TIM2    (&host_tim2)
+#define TIM6    (&host_tim6)
+#define TIM15   (&host_tim15)
+#define RCC     (&host_rcc)
+#define GPIOB   (&host_gpiob)
+
+// Interrupts are run by the tests themselves, PRIMASK is only kept so masked
+// sections can be checked
+extern volatile uint32_t host_primask;
+
+static inline uint32_t __get_PRIMASK (void) { return host_primask; }
+static inline void __set_PRIMASK (uint32_t primask) { host_primask = primask; }
+static inline void __disable_irq (void) { host_primask = 1; }
+static inline void __enable_irq (void) { host_primask = 0; }
+uint32_t __get_MSP (void);
+
+void NVIC_EnableIRQ (IRQn_Type IRQn);
+void NVIC_DisableIRQ (IRQn_Type IRQn);
+void NVIC_SetPriority (IRQn_Type IRQn, uint32_t priority);
+uint32_t host_irq_enabled (IRQn_Type IRQn);
+
+#ifdef __cplusplus
+}
+
+#include "bxcan.hpp"
+
+#undef CAN
+#define CAN     (&host_can)
+#endif
+
+#endif // _HOST_STM32F0XX_H_
@@ -0,0 +1,195 @@
+#include <string.h>
+
+#include "stm32f0xx.h"
+#include "usb.hpp"
+
+extern "C"
+{
+#include "usb_model.h"
+}
+
+
+uint32_t host_usb_regs[0x60 / 4];
+
+static const uint16_t Plain = EP_T_FIELD | EP_KIND | EPADDR_FIELD;
+static const uint16_t Toggle = EP_DTOG_RX | EPRX_STAT | EP_DTOG_TX | EPTX_STAT;
+static const uint16_t Ctr = EP_CTR_RX | EP_CTR_TX;
+static const uint16_t IstrFlags = 0xFF80;   // CTR, DIR and EP_ID come from the endpoints
+
+static inline uint32_t& reg (uint32_t offset)
+{
+  return host_usb_regs[offset / 4];
+}
+
+
+// Endpoint registers: EP_TYPE, EP_KIND and EA are written as they are, DTOG
+// and STAT toggle where a 1 is written, CTR clear where a 0 is
+uint16_t host_usb_ep_read (uint8_t ep)
+{
+  return reg(4*ep);
+}
+
+
+void host_usb_ep_write (uint8_t ep, uint16_t v)
+{
+  uint32_t r = reg(4*ep);
+  r = (r & ~Plain) | (v & Plain);
+  r ^= v & Toggle;
+  r &= v | ~Ctr;
+  reg(4*ep) = r;
+}
+
+
+// The lowest endpoint with a transfer done is the one ISTR shows
+uint16_t host_usb_istr_read (void)
+{
+  uint16_t istr = reg(0x44) & IstrFlags & ~ISTR_CTR;
+  for (uint8_t ep = 0; ep < 8; ep++)
+  {
+    uint32_t r = reg(4*ep);
+    if (r & Ctr)
+    {
+      istr |= ISTR_CTR | ep | ((r & EP_CTR_RX) ? ISTR_DIR : 0);
+      break;
+    }
+  }
+  return istr;
+}
+
+
+void host_usb_istr_write (uint16_t v)
+{
+  reg(0x44) &= v | ~IstrFlags;
+}
+
+
+// Buffer table entry of an endpoint: 0 ADDR_TX, 2 COUNT_TX, 4 ADDR_RX,
+// 6 COUNT_RX; the second buffer of a double buffered one uses the RX pair
+static inline uint16_t& table (uint8_t ep, uint32_t entry)
+{
+  return host_pma[((reg(0x50) & 0xFFF8) + 8*ep + entry) / 2];
+}
+
+
+static inline uint8_t* pma (uint16_t addr)
+{
+  return reinterpret_cast<uint8_t*>(host_pma) + addr;
+}
+
+
+static inline bool double_buffered (uint32_t r)
+{
+  return (r & (EP_T_FIELD | EP_KIND)) == (EP_BULK | EP_KIND);
+}
+
+
+static inline void set_stat (uint32_t& r, uint32_t mask, uint32_t stat)
+{
+  r = (r & ~mask) | stat;
+}
+
+
+// Room of an RX buffer by its COUNT_RX block field
+static inline uint16_t room (uint16_t count)
+{
+  uint16_t blocks = (count >> 10) & 0x1F;
+  return (count & 0x8000) ? (blocks + 1) * 32 : blocks * 2;
+}
+
+
+void USBDev::reset (void)
+{
+  memset(host_usb_regs, 0, sizeof(host_usb_regs));
+}
+
+
+void USBDev::bus_reset (void)
+{
+  for (uint8_t ep = 0; ep < 8; ep++) reg(4*ep) = 0;
+  reg(0x4C) = 0;
+  reg(0x44) |= ISTR_RESET;
+}
+
+
+void USBDev::sof (void)
+{
+  reg(0x48) = (reg(0x48) & ~FNR_FN) | ((reg(0x48) + 1) & FNR_FN);
+  reg(0x44) |= ISTR_SOF;
+}
+
+
+int USBDev::setup (uint8_t ep, const uint8_t* req)
+{
+  uint32_t r = reg(4*ep);
+  if ((r & EP_T_FIELD) != EP_CONTROL || (r & EPRX_STAT) == EP_RX_DIS) return Ignored;
+
+  memcpy(pma(table(ep, 4)), req, 8);
+  table(ep, 6) = (table(ep, 6) & ~0x3FF) | 8;
+  set_stat(r, EPRX_STAT, EP_RX_NAK);
+  set_stat(r, EPTX_STAT, EP_TX_NAK);
+  r |= EP_DTOG_RX | EP_DTOG_TX | EP_SETUP | EP_CTR_RX;   // the data stage is DATA1
+  reg(4*ep) = r;
+  return 8;
+}
+
+
+int USBDev::in (uint8_t ep, uint8_t* data)
+{
+  uint32_t r = reg(4*ep);
+  switch (r & EPTX_STAT)
+  {
+    case EP_TX_DIS:   return Ignored;
+    case EP_TX_STALL: return Stall;
+    case EP_TX_NAK:   return Nak;
+  }
+
+  bool dbl = double_buffered(r);
+  uint32_t entry = (dbl && (r & EP_DTOG_TX)) ? 4 : 0;
+  uint16_t len = table(ep, entry + 2) & 0x3FF;
+  memcpy(data, pma(table(ep, entry)), len);
+
+  r ^= EP_DTOG_TX;
+  if (!dbl || ((r & EP_DTOG_TX) != 0) == ((r & EP_DTOG_RX) != 0))
+  {
+    set_stat(r, EPTX_STAT, EP_TX_NAK);
+  }
+  reg(4*ep) = r | EP_CTR_TX;
+  return len;
+}
+
+
+int USBDev::out (uint8_t ep, const uint8_t* data, uint16_t len)
+{
+  uint32_t r = reg(4*ep);
+  switch (r & EPRX_STAT)
+  {
+    case EP_RX_DIS:   return Ignored;
+    case EP_RX_STALL: return Stall;
+    case EP_RX_NAK:   return Nak;
+  }
+
+  bool dbl = double_buffered(r);
+  uint32_t entry = (dbl && !(r & EP_DTOG_RX)) ? 0 : 4;
+  uint16_t& count = table(ep, entry + 2);
+  if (len > room(count))
+  {
+    reg(0x44) |= ISTR_ERR;
+    return Ignored;
+  }
+  memcpy(pma(table(ep, entry)), data, len);
+  count = (count & ~0x3FF) | len;
+
+  r ^= EP_DTOG_RX;
+  if (!dbl || ((r & EP_DTOG_RX) != 0) == ((r & EP_DTOG_TX) != 0))
+  {
+    set_stat(r, EPRX_STAT, EP_RX_NAK);
+  }
+  reg(4*ep) = (r & ~EP_SETUP) | EP_CTR_RX;
+  return len;
+}
+
+
+bool USBDev::irq_pending (void)
+{
+  return host_irq_enabled(USB_IRQn) && (host_usb_istr_read() & reg(0x40) & IstrFlags);
+}
@@ -0,0 +1,31 @@
+#ifndef _HOST_USB_HPP_
+#define _HOST_USB_HPP_
+
+#include <stdint.h>
+
+// The bus side of the USB peripheral model (see usb_model.h for the driver
+// side). A test acts as the host controller: it sends tokens to endpoints
+// and gets what the peripheral would answer, packets come from and go to the
+// buffers in host_pma the buffer table points to. The tests call the USB
+// interrupt whenever irq_pending() says it would run. Device addresses,
+// data PIDs and errors on the wire are not modelled.
+//
+// At the end of a transaction a single buffered endpoint goes to NAK; a
+// double buffered one (bulk with EP_KIND) toggles DTOG and goes to NAK only
+// when DTOG then equals SW_BUF, the application owning both buffers.
+namespace USBDev
+{
+  const int Nak = -1;
+  const int Stall = -2;
+  const int Ignored = -3;   // endpoint disabled, or a packet too long for its buffer
+
+  void reset (void);                        // power-on state
+  void bus_reset (void);                    // RESET flag, endpoints and address cleared
+  void sof (void);                          // SOF flag, next frame number
+  int setup (uint8_t ep, const uint8_t* req);             // 8 bytes, taken unless disabled: 8 or Ignored
+  int in (uint8_t ep, uint8_t* data);                     // the packet's length, or Nak, Stall, Ignored
+  int out (uint8_t ep, const uint8_t* data, uint16_t len);  // len, or Nak, Stall, Ignored
+  bool irq_pending (void);
+}
+
+#endif // _HOST_USB_HPP_
@@ -0,0 +1,33 @@
+/* The USB device driver on the peripheral model in usb.cpp, for the USB
+   stack of bench_usb. The board part is reduced to the interrupt enable;
+   suspend and resume never happen on the model. */
+#include "usb_model.h"
+#include "usb_bsp.h"
+#include "usbd_pwr.h"
+
+#include "../../STM32_USB_Device_Driver/src/usb_dcd.c"
+#include "../../STM32_USB_Device_Driver/src/usb_dcd_int.c"
+
+
+void USB_BSP_Init (USB_CORE_HANDLE *pdev)
+{
+  (void)pdev;
+}
+
+
+void USB_BSP_EnableInterrupt (USB_CORE_HANDLE *pdev)
+{
+  (void)pdev;
+  NVIC_EnableIRQ(USB_IRQn);
+}
+
+
+void Suspend (void)
+{
+}
+
+
+void Resume (RESUME_STATE eResumeSetVal)
+{
+  (void)eResumeSetVal;
+}
@@ -0,0 +1,41 @@
+#ifndef _HOST_USB_MODEL_H_
+#define _HOST_USB_MODEL_H_
+
+/* The USB peripheral of the host build, for the driver sources that include
+   this after usb_core.h: the registers and the packet memory live in RAM,
+   and the endpoint and interrupt status registers go through the model in
+   usb.cpp, which knows their toggle and clear-only bits. */
+
+#include "usb_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern uint16_t host_pma[512];
+extern uint32_t host_usb_regs[0x60 / 4];
+
+uint16_t host_usb_ep_read (uint8_t ep);
+void host_usb_ep_write (uint8_t ep, uint16_t value);
+uint16_t host_usb_istr_read (void);
+void host_usb_istr_write (uint16_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef RegBase
+#undef PMAAddr
+#define RegBase  ((uintptr_t)host_usb_regs)
+#define PMAAddr  ((uintptr_t)host_pma)
+
+#undef _SetENDPOINT
+#undef _GetENDPOINT
+#undef _SetISTR
+#undef _GetISTR
+#define _SetENDPOINT(bEpNum,wRegValue)  host_usb_ep_write((uint8_t)(bEpNum), (uint16_t)(wRegValue))
+#define _GetENDPOINT(bEpNum)            host_usb_ep_read((uint8_t)(bEpNum))
+#define _SetISTR(wRegValue)             host_usb_istr_write((uint16_t)(wRegValue))
+#define _GetISTR()                      host_usb_istr_read()
+
+#endif /* _HOST_USB_MODEL_H_ */
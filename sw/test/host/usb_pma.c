@@ -0,0 +1,8 @@
+/* Packet memory and register routines of the USB driver, working on the
+   peripheral model in usb.cpp. The firmware core only uses the packet
+   memory copies, the rest comes along for the USB stack of bench_usb. */
+#include "usb_model.h"
+
+uint16_t host_pma[512];
+
+#include "../../STM32_USB_Device_Driver/src/usb_core.c"
@@ -0,0 +1,14 @@
+/* The device descriptors for bench_usb, the serial number from a unique
+   device ID in RAM instead of the system memory. */
+#include "usbd_desc.h"
+
+static const uint32_t host_uid[3] = {0x00450036, 0x34365114, 0x30373836};
+
+#undef Device1_Identifier
+#undef Device2_Identifier
+#undef Device3_Identifier
+#define Device1_Identifier  (&host_uid[0])
+#define Device2_Identifier  (&host_uid[1])
+#define Device3_Identifier  (&host_uid[2])
+
+#include "../../src/usbd_desc.c"